@@ -50,6 +50,17 @@ bool ConfigParser::parseFile(const std::string& path,std::vector<ServerConfig>&
 	content=stripComments(content);
 	std::vector<Token> t=tokenize(content);
 
+	std::string dir=".";
+	std::size_t slash=path.rfind('/');
+	if(slash!=std::string::npos)
+	{
+		dir=path.substr(0,slash);
+	}
+	if(!expandIncludes(t,dir,0))
+	{
+		return false;
+	}
+
 	if(!parseTokens(t,out))
 	{
 		if(_error.empty())
@@ -71,3 +82,57 @@ bool ConfigParser::parseFile(const std::string& path,std::vector<ServerConfig>&
 
 	return true;
 }
+
+// include file; -> the tokens of file, a relative path being taken from
+// the directory of the including config. Includes nest up to 8 deep.
+bool ConfigParser::expandIncludes(std::vector<Token>& t,const std::string& dir,int depth)
+{
+	std::size_t i=0;
+	while(i<t.size())
+	{
+		bool atStatement=(i==0||t[i-1].text=="{"||t[i-1].text=="}"||t[i-1].text==";");
+		if(!atStatement||t[i].text!="include")
+		{
+			++i;
+			continue;
+		}
+
+		if(i+2>=t.size()||t[i+2].text!=";")
+		{
+			return setError(t[i].line,"Expected 'include file;'");
+		}
+		if(depth>=8)
+		{
+			return setError(t[i].line,"include nested too deep");
+		}
+
+		std::string file=t[i+1].text;
+		if(file.empty()||file[0]!='/')
+		{
+			file=dir+"/"+file;
+		}
+
+		std::string content=readFile(file);
+		if(content.empty())
+		{
+			return setError(t[i].line,"Cannot read included file "+file);
+		}
+
+		std::vector<Token> sub=tokenize(stripComments(content));
+		std::string subDir=".";
+		std::size_t slash=file.rfind('/');
+		if(slash!=std::string::npos)
+		{
+			subDir=file.substr(0,slash);
+		}
+		if(!expandIncludes(sub,subDir,depth+1))
+		{
+			return false;
+		}
+
+		t.erase(t.begin()+static_cast<std::ptrdiff_t>(i),t.begin()+static_cast<std::ptrdiff_t>(i+3));
+		t.insert(t.begin()+static_cast<std::ptrdiff_t>(i),sub.begin(),sub.end());
+		i+=sub.size();
+	}
+	return true;
+}
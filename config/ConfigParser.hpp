@@ -26,20 +26,24 @@ private:
 	static std::string readFile(const std::string& path);
 	static std::string stripComments(const std::string& s);
 	static std::vector<Token> tokenize(const std::string& s);
+	bool expandIncludes(std::vector<Token>& t,const std::string& dir,int depth);
 
 	bool parseTokens(const std::vector<Token>& t,std::vector<ServerConfig>& out);
 	bool parseServer(const std::vector<Token>& t,std::size_t& i,ServerConfig& out);
 	bool parseLocation(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv);
+	bool parseUpstream(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv);
+	bool parseTypes(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv,bool replace);
 	bool parseDirective(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv,LocationConfig* loc);
 
 	static bool applyServerDirective(ServerConfig& srv,const std::string& key,const std::vector<std::string>& args);
 	static bool applyLocationDirective(ServerConfig& srv,LocationConfig& loc,const std::string& key,const std::vector<std::string>& args);
+	static bool applyUpstreamDirective(UpstreamConfig& up,const std::string& key,const std::vector<std::string>& args);
 
 	static unsigned short parsePort(const std::string& s);
 	static bool isNumber(const std::string& s);
 
 	static bool setAllowed(LocationConfig& loc,const std::vector<std::string>& args);
-	static LocationConfig* getOrCreateLocation(ServerConfig& srv,const std::string& prefix);
+	static LocationConfig* getOrCreateLocation(ServerConfig& srv,const std::string& prefix,LocationConfig::Match match);
 
 	bool normalizeAll(std::vector<ServerConfig>& out);
 };
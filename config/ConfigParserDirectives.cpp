@@ -107,6 +107,84 @@ bool ConfigParser::applyServerDirective(ServerConfig& srv,const std::string& key
 		return true;
 	}
 
+	if(key=="cgi_max_concurrent"||key=="cgi_queue_size")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<0||n>65536)
+			return false;
+
+		if(key=="cgi_max_concurrent")
+			srv.cgiMaxConcurrent=static_cast<std::size_t>(n);
+		else
+			srv.cgiQueueSize=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="cgi_queue_timeout")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<=0)
+			return false;
+
+		srv.cgiQueueTimeout=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="cgi_output_buffer_size")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<4096)
+			return false;
+
+		srv.cgiOutputBufferSize=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="cgi_max_output_size")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		srv.cgiMaxOutputSize=static_cast<std::size_t>(std::atoll(args[0].c_str()));
+		return true;
+	}
+
+	if(key=="cgi_temp_path")
+	{
+		if(args.size()!=1)
+			return false;
+
+		srv.cgiTempPath=args[0];
+		return true;
+	}
+
+	if(key=="cgi_error_log")
+	{
+		if(args.size()!=1)
+			return false;
+
+		srv.cgiErrorLog=args[0];
+		return true;
+	}
+
+	if(key=="cgi_stderr_limit")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		srv.cgiStderrLimit=static_cast<std::size_t>(std::atoll(args[0].c_str()));
+		return true;
+	}
+
 	if(key=="session")
 	{
 		if(args.size()!=1)
@@ -178,6 +256,15 @@ bool ConfigParser::applyLocationDirective(ServerConfig& srv,LocationConfig& loc,
 		return true;
 	}
 
+	if(key=="internal")
+	{
+		if(!args.empty())
+			return false;
+
+		loc.internal=true;
+		return true;
+	}
+
 	if(key=="allowed_methods")
 	{
 		if(args.empty())
@@ -205,6 +292,380 @@ bool ConfigParser::applyLocationDirective(ServerConfig& srv,LocationConfig& loc,
 		return false;
 	}
 
+	if(key=="fastcgi_pass")
+	{
+		if(args.size()!=1)
+			return false;
+
+		const std::string& a=args[0];
+		if(a.compare(0,5,"unix:")==0)
+		{
+			if(a.size()<=5)
+				return false;
+		}
+		else if(a.find(':')==std::string::npos||parsePort(a)==0)
+		{
+			return false;
+		}
+
+		loc.fastcgiPass=a;
+		return true;
+	}
+
+	if(key=="fastcgi_pool_size"||key=="fastcgi_multiplex")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<=0||n>1024)
+			return false;
+
+		if(key=="fastcgi_pool_size")
+			loc.fastcgiPoolSize=static_cast<std::size_t>(n);
+		else
+			loc.fastcgiMultiplex=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="proxy_pass")
+	{
+		// http://host:port or http://<upstream name>; the request URI is
+		// forwarded unchanged, so no URI part is accepted
+		if(args.size()!=1||args[0].compare(0,7,"http://")!=0)
+			return false;
+
+		std::string a=args[0].substr(7);
+		if(!a.empty()&&a[a.size()-1]=='/')
+			a.erase(a.size()-1);
+		if(a.empty()||a.find('/')!=std::string::npos)
+			return false;
+
+		loc.proxyPass=a;
+		return true;
+	}
+
+	if(key=="proxy_connect_timeout"||key=="proxy_send_timeout"||key=="proxy_read_timeout")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<=0||n>3600)
+			return false;
+
+		if(key=="proxy_connect_timeout")
+			loc.proxyConnectTimeout=static_cast<std::size_t>(n);
+		else if(key=="proxy_send_timeout")
+			loc.proxySendTimeout=static_cast<std::size_t>(n);
+		else
+			loc.proxyReadTimeout=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="proxy_buffering")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		loc.proxyBuffering=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="proxy_buffer_size")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long long n=std::atoll(args[0].c_str());
+		if(n<4096)
+			return false;
+
+		loc.proxyBufferSize=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="cgi_pool")
+	{
+		// cgi_pool <ext> <workers> <max_requests> <bootstrap>; the bootstrap is
+		// taken as written, like every other path of the config
+		if(args.size()!=4||args[3].empty())
+			return false;
+
+		if(args[0].size()<2||args[0][0]!='.')
+			return false;
+		if(!isNumber(args[1])||!isNumber(args[2]))
+			return false;
+
+		long workers=std::atol(args[1].c_str());
+		long maxRequests=std::atol(args[2].c_str());
+		if(workers<=0||workers>256)
+			return false;
+
+		CgiPoolConfig pool;
+		pool.workers=static_cast<std::size_t>(workers);
+		pool.maxRequests=static_cast<std::size_t>(maxRequests);
+		pool.bootstrap=args[3];
+
+		loc.cgiPools[args[0]]=pool;
+		return true;
+	}
+
+	if(key=="cgi_max_concurrent")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<0||n>65536)
+			return false;
+
+		loc.cgiMaxConcurrent=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="cgi_stream_body")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		loc.cgiStreamBody=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="cgi_cache_valid")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		loc.cgiCacheValid=static_cast<std::size_t>(std::atol(args[0].c_str()));
+		return true;
+	}
+
+	if(key=="cgi_cache_key_headers")
+	{
+		if(args.empty())
+			return false;
+
+		for(std::size_t i=0;i<args.size();++i)
+		{
+			std::string h=args[i];
+			for(std::size_t j=0;j<h.size();++j)
+				h[j]=static_cast<char>(std::tolower(static_cast<unsigned char>(h[j])));
+			loc.cgiCacheKeyHeaders.push_back(h);
+		}
+		return true;
+	}
+
+	if(key=="cgi_cache_lock")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		loc.cgiCacheLock=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="cgi_cache_lock_timeout")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<=0)
+			return false;
+
+		loc.cgiCacheLockTimeout=static_cast<std::size_t>(n);
+		return true;
+	}
+
+	if(key=="gzip_static"||key=="brotli_static")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		if(key=="gzip_static")
+			loc.gzipStatic=(args[0]=="on");
+		else
+			loc.brotliStatic=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="gzip"||key=="brotli")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		if(key=="gzip")
+			loc.gzip=(args[0]=="on");
+		else
+			loc.brotli=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="gzip_comp_level"||key=="brotli_comp_level")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(key=="gzip_comp_level")
+		{
+			if(n<1||n>9)
+				return false;
+			loc.gzipCompLevel=static_cast<int>(n);
+		}
+		else
+		{
+			if(n>11)
+				return false;
+			loc.brotliCompLevel=static_cast<int>(n);
+		}
+		return true;
+	}
+
+	if(key=="gzip_min_length"||key=="brotli_min_length")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		std::size_t n=static_cast<std::size_t>(std::atoll(args[0].c_str()));
+		if(key=="gzip_min_length")
+			loc.gzipMinLength=n;
+		else
+			loc.brotliMinLength=n;
+		return true;
+	}
+
+	if(key=="gzip_types"||key=="brotli_types")
+	{
+		if(args.empty())
+			return false;
+
+		std::vector<std::string> types;
+		for(std::size_t i=0;i<args.size();++i)
+		{
+			std::string t=args[i];
+			for(std::size_t j=0;j<t.size();++j)
+				t[j]=static_cast<char>(std::tolower(static_cast<unsigned char>(t[j])));
+			types.push_back(t);
+		}
+
+		if(key=="gzip_types")
+			loc.gzipTypes.swap(types);
+		else
+			loc.brotliTypes.swap(types);
+		return true;
+	}
+
+	if(key=="cgi_ignore_client_abort")
+	{
+		if(args.size()!=1)
+			return false;
+
+		if(args[0]!="on"&& args[0]!="off")
+			return false;
+
+		loc.cgiIgnoreClientAbort=(args[0]=="on");
+		return true;
+	}
+
+	if(key=="cgi_rlimit_cpu"||key=="cgi_rlimit_as"||key=="cgi_rlimit_nofile")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		std::size_t n=static_cast<std::size_t>(std::atoll(args[0].c_str()));
+
+		if(key=="cgi_rlimit_cpu")
+			loc.cgiRlimitCpu=n;
+		else if(key=="cgi_rlimit_as")
+			loc.cgiRlimitAs=n;
+		else
+		{
+			// stdin/stdout/stderr plus whatever the interpreter opens itself
+			if(n!=0&&n<8)
+				return false;
+			loc.cgiRlimitNofile=n;
+		}
+		return true;
+	}
+
+	if(key=="cgi_nice")
+	{
+		if(args.size()!=1)
+			return false;
+
+		std::string v=args[0];
+		if(!v.empty()&&v[0]=='-')
+			v.erase(0,1);
+		if(!isNumber(v))
+			return false;
+
+		int n=std::atoi(args[0].c_str());
+		if(n<-20||n>19)
+			return false;
+
+		loc.cgiNice=n;
+		return true;
+	}
+
+	return false;
+}
+
+bool ConfigParser::applyUpstreamDirective(UpstreamConfig& up,const std::string& key,const std::vector<std::string>& args)
+{
+	if(key=="server")
+	{
+		if(args.size()!=1)
+			return false;
+
+		const std::string& a=args[0];
+		std::size_t colon=a.rfind(':');
+		if(colon==std::string::npos||colon==0||parsePort(a)==0)
+			return false;
+
+		up.servers.push_back(a);
+		return true;
+	}
+
+	if(key=="least_conn")
+	{
+		if(!args.empty())
+			return false;
+
+		up.leastConn=true;
+		return true;
+	}
+
+	if(key=="keepalive")
+	{
+		if(args.size()!=1||!isNumber(args[0]))
+			return false;
+
+		long n=std::atol(args[0].c_str());
+		if(n<0||n>1024)
+			return false;
+
+		up.keepalive=static_cast<std::size_t>(n);
+		return true;
+	}
+
 	return false;
 }
 
@@ -295,15 +756,37 @@ static std::string normalizePrefix(const std::string& in)
 	return p;
 }
 
-LocationConfig* ConfigParser::getOrCreateLocation(ServerConfig& srv, const std::string& prefix)
+// "/a" and "^~ /a" are the same location
+static bool samePrefixKind(LocationConfig::Match a, LocationConfig::Match b)
 {
-	std::string norm = normalizePrefix(prefix);
+	if (a == LocationConfig::PREFIX_NO_REGEX)
+		a = LocationConfig::PREFIX;
+	if (b == LocationConfig::PREFIX_NO_REGEX)
+		b = LocationConfig::PREFIX;
+	return a == b;
+}
+
+LocationConfig* ConfigParser::getOrCreateLocation(ServerConfig& srv, const std::string& prefix, LocationConfig::Match match)
+{
+	// only prefix locations lose their trailing slashes
+	std::string norm = prefix;
+	if (match == LocationConfig::PREFIX || match == LocationConfig::PREFIX_NO_REGEX)
+		norm = normalizePrefix(prefix);
 
 	for (std::size_t i = 0; i < srv.locations.size(); ++i)
 	{
+		if (!samePrefixKind(srv.locations[i].match, match))
+			continue;
+
 		// also compare normalized stored prefix (just in case)
-		if (normalizePrefix(srv.locations[i].prefix) == norm)
+		std::string stored = srv.locations[i].prefix;
+		if (match == LocationConfig::PREFIX || match == LocationConfig::PREFIX_NO_REGEX)
+			stored = normalizePrefix(stored);
+
+		if (stored == norm)
 		{
+			// "location ^~ /" reopening the built-in "/" takes its modifier
+			srv.locations[i].match = match;
 			srv.locations[i].prefix = norm;
 			return &srv.locations[i];
 		}
@@ -311,6 +794,7 @@ LocationConfig* ConfigParser::getOrCreateLocation(ServerConfig& srv, const std::
 
 	LocationConfig loc;
 	loc.prefix = norm;
+	loc.match = match;
 	srv.locations.push_back(loc);
 	return &srv.locations[srv.locations.size() - 1];
 }
@@ -23,9 +23,14 @@ std::string ConfigParser::stripComments(const std::string& s)
 	out.reserve(s.size());
 
 	std::size_t i=0;
+	bool quoted=false;
 	while(i<s.size())
 	{
-		if(s[i]=='#')
+		if(s[i]=='"')
+		{
+			quoted=!quoted;
+		}
+		if(s[i]=='#'&&!quoted)
 		{
 			while(i<s.size()&& s[i]!='\n')
 			{
@@ -64,6 +69,26 @@ std::vector<ConfigParser::Token> ConfigParser::tokenize(const std::string& s)
 			continue;
 		}
 
+		// "..." is one token, for regex locations holding { } ; or spaces
+		if(c=='"')
+		{
+			if(cur.empty())
+			{
+				curLine=line;
+			}
+			++i;
+			while(i<s.size()&& s[i]!='"')
+			{
+				if(s[i]=='\n')
+				{
+					++line;
+				}
+				cur.push_back(s[i]);
+				++i;
+			}
+			continue;
+		}
+
 		if(c=='{'||c=='}'||c==';')
 		{
 			if(!cur.empty())
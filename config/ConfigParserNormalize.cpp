@@ -1,4 +1,5 @@
 #include "ConfigParser.hpp"
+#include "VHostTable.hpp"
 
 #include <algorithm>
 #include <set>
@@ -51,6 +52,8 @@ bool ConfigParser::normalizeAll(std::vector<ServerConfig>& out)
 				std::string n = toLowerStr(srv.serverNames[i]);
 				if (n.empty())
 					continue;
+				if (!VHostTable::validName(n))
+					return setError(0, "Invalid server_name " + n);
 				if (seen.insert(n).second)
 					names.push_back(n);
 			}
@@ -64,18 +67,40 @@ bool ConfigParser::normalizeAll(std::vector<ServerConfig>& out)
 		{
 			LocationConfig& loc = srv.locations[i];
 
-			loc.prefix = normalizePrefix(loc.prefix);
+			bool regex = (loc.match == LocationConfig::REGEX || loc.match == LocationConfig::REGEX_CASELESS);
 
-			if (loc.prefix.empty() || loc.prefix[0] != '/')
+			if (loc.match == LocationConfig::PREFIX || loc.match == LocationConfig::PREFIX_NO_REGEX)
+				loc.prefix = normalizePrefix(loc.prefix);
+
+			if (!regex && (loc.prefix.empty() || loc.prefix[0] != '/'))
 			{
 				return setError(0, "Invalid location prefix: " + loc.prefix);
 			}
 
-			if (loc.prefix == "/")
+			if (loc.prefix == "/" && (loc.match == LocationConfig::PREFIX || loc.match == LocationConfig::PREFIX_NO_REGEX))
 				hasRootLoc = true;
 
+			if (loc.root.empty())
+				loc.root = srv.root;
 			if (loc.index.empty())
 				loc.index = srv.index;
+
+			for (std::map<std::string, CgiPoolConfig>::const_iterator it = loc.cgiPools.begin();
+				 it != loc.cgiPools.end(); ++it)
+			{
+				if (srv.cgi.find(it->first) == srv.cgi.end())
+					return setError(0, "cgi_pool " + it->first + " in location " + loc.prefix + " has no matching cgi directive");
+			}
+
+			// proxy_pass host:port without an upstream block of that name
+			if (!loc.proxyPass.empty() && srv.upstreams.find(loc.proxyPass) == srv.upstreams.end())
+			{
+				std::size_t colon = loc.proxyPass.rfind(':');
+				if (colon == std::string::npos || colon == 0 || parsePort(loc.proxyPass) == 0)
+					return setError(0, "proxy_pass " + loc.proxyPass + " in location " + loc.prefix + " is neither host:port nor an upstream");
+
+				srv.upstreams[loc.proxyPass].servers.push_back(loc.proxyPass);
+			}
 		}
 
 		// SAFER DEFAULT:
@@ -85,7 +110,7 @@ bool ConfigParser::normalizeAll(std::vector<ServerConfig>& out)
 		{
 			LocationConfig loc;
 			loc.prefix = "/";
-			loc.root = "";
+			loc.root = srv.root;
 			loc.index = srv.index;
 			loc.autoindex = false;
 
@@ -101,17 +126,26 @@ bool ConfigParser::normalizeAll(std::vector<ServerConfig>& out)
 			srv.locations.push_back(loc);
 		}
 
-		// sort by longest prefix first (more specific location wins)
+		// sort by longest prefix first (more specific location wins); regex
+		// locations go last and keep their order, the first match winning
 		std::stable_sort(
 			srv.locations.begin(),
 			srv.locations.end(),
 			[](const LocationConfig& a, const LocationConfig& b)
 			{
+				bool ra = (a.match == LocationConfig::REGEX || a.match == LocationConfig::REGEX_CASELESS);
+				bool rb = (b.match == LocationConfig::REGEX || b.match == LocationConfig::REGEX_CASELESS);
+				if (ra || rb)
+					return !ra && rb;
 				if (a.prefix.size() != b.prefix.size())
 					return a.prefix.size() > b.prefix.size();
 				return a.prefix < b.prefix;
 			}
 		);
+
+		srv.locationTrie.build(srv.locations);
+		if (!srv.locationRegex.build(srv.locations))
+			return setError(0, "Regex locations too complex to compile");
 	}
 
 	return true;
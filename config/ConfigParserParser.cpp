@@ -1,5 +1,7 @@
 #include "ConfigParser.hpp"
 
+#include <cctype>
+
 static std::string joinArgs(const std::vector<std::string>& args)
 {
 	std::string s;
@@ -49,6 +51,10 @@ bool ConfigParser::parseServer(const std::vector<Token>& t,std::size_t& i,Server
 	}
 	++i;
 
+	// the first types { } of a server replaces the built-in table, later
+	// ones add to it
+	bool typesSeen=false;
+
 	while(i<t.size()&& t[i].text!="}")
 	{
 		if(t[i].text=="location")
@@ -60,6 +66,25 @@ bool ConfigParser::parseServer(const std::vector<Token>& t,std::size_t& i,Server
 			continue;
 		}
 
+		if(t[i].text=="types")
+		{
+			if(!parseTypes(t,i,out,!typesSeen))
+			{
+				return false;
+			}
+			typesSeen=true;
+			continue;
+		}
+
+		if(t[i].text=="upstream")
+		{
+			if(!parseUpstream(t,i,out))
+			{
+				return false;
+			}
+			continue;
+		}
+
 		if(!parseDirective(t,i,out,0))
 		{
 			return false;
@@ -92,10 +117,38 @@ bool ConfigParser::parseLocation(const std::vector<Token>& t,std::size_t& i,Serv
 		return setError(0,"Unexpected end of file after location");
 	}
 
+	LocationConfig::Match match=LocationConfig::PREFIX;
+	if(t[i].text=="="||t[i].text=="^~"||t[i].text=="~"||t[i].text=="~*")
+	{
+		if(t[i].text=="=")
+			match=LocationConfig::EXACT;
+		else if(t[i].text=="^~")
+			match=LocationConfig::PREFIX_NO_REGEX;
+		else if(t[i].text=="~")
+			match=LocationConfig::REGEX;
+		else
+			match=LocationConfig::REGEX_CASELESS;
+		++i;
+
+		if(i>=t.size())
+		{
+			return setError(0,"Unexpected end of file after location modifier");
+		}
+	}
+
 	std::string prefix=t[i].text;
 	std::size_t prefixLine=t[i].line;
 	++i;
 
+	if(match==LocationConfig::REGEX||match==LocationConfig::REGEX_CASELESS)
+	{
+		std::string err;
+		if(!LocationRegex::check(prefix,match==LocationConfig::REGEX_CASELESS,err))
+		{
+			return setError(prefixLine,"Invalid regex in location "+prefix+": "+err);
+		}
+	}
+
 	if(i>=t.size())
 	{
 		return setError(0,"Unexpected end of file after location prefix");
@@ -107,7 +160,7 @@ bool ConfigParser::parseLocation(const std::vector<Token>& t,std::size_t& i,Serv
 	}
 	++i;
 
-	LocationConfig* loc=getOrCreateLocation(srv,prefix);
+	LocationConfig* loc=getOrCreateLocation(srv,prefix,match);
 	if(loc==0)
 	{
 		return setError(prefixLine,"Failed to create location "+prefix);
@@ -134,6 +187,130 @@ bool ConfigParser::parseLocation(const std::vector<Token>& t,std::size_t& i,Serv
 	return true;
 }
 
+bool ConfigParser::parseUpstream(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv)
+{
+	++i;
+
+	if(i>=t.size())
+	{
+		return setError(0,"Unexpected end of file after upstream");
+	}
+
+	std::string name=t[i].text;
+	std::size_t nameLine=t[i].line;
+	++i;
+
+	if(name=="{"||name==";"||name=="}")
+	{
+		return setError(nameLine,"Expected a name after upstream");
+	}
+	if(srv.upstreams.find(name)!=srv.upstreams.end())
+	{
+		return setError(nameLine,"Duplicate upstream "+name);
+	}
+
+	if(i>=t.size()||t[i].text!="{")
+	{
+		return setError(nameLine,"Expected '{' after upstream "+name);
+	}
+	++i;
+
+	UpstreamConfig& up=srv.upstreams[name];
+
+	while(i<t.size()&& t[i].text!="}")
+	{
+		std::string key=t[i].text;
+		std::size_t keyLine=t[i].line;
+		++i;
+
+		std::vector<std::string> args;
+		while(i<t.size()&& t[i].text!=";"&& t[i].text!="{"&& t[i].text!="}")
+		{
+			args.push_back(t[i].text);
+			++i;
+		}
+
+		if(i>=t.size()||t[i].text!=";")
+		{
+			return setError(keyLine,"Expected ';' after directive "+key);
+		}
+		++i;
+
+		if(!applyUpstreamDirective(up,key,args))
+		{
+			return setError(keyLine,"Invalid directive '"+key+"' args '"+joinArgs(args)+"'");
+		}
+	}
+
+	if(i>=t.size())
+	{
+		return setError(nameLine,"Unexpected end of file in upstream "+name);
+	}
+	++i;
+
+	if(up.servers.empty())
+	{
+		return setError(nameLine,"upstream "+name+" has no server");
+	}
+	return true;
+}
+
+// types { text/html html htm; image/svg+xml svg svgz; }
+bool ConfigParser::parseTypes(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv,bool replace)
+{
+	std::size_t typesLine=t[i].line;
+	++i;
+
+	if(i>=t.size()||t[i].text!="{")
+	{
+		return setError(typesLine,"Expected '{' after types");
+	}
+	++i;
+
+	if(replace)
+	{
+		srv.mimeTypes.clear();
+	}
+
+	while(i<t.size()&& t[i].text!="}")
+	{
+		std::string type=t[i].text;
+		std::size_t typeLine=t[i].line;
+		++i;
+
+		if(type=="{"||type==";"||type.find('/')==std::string::npos)
+		{
+			return setError(typeLine,"Expected a MIME type in types, got '"+type+"'");
+		}
+
+		std::size_t exts=0;
+		while(i<t.size()&& t[i].text!=";"&& t[i].text!="{"&& t[i].text!="}")
+		{
+			std::string ext=t[i].text;
+			for(std::size_t k=0;k<ext.size();++k)
+			{
+				ext[k]=static_cast<char>(std::tolower(static_cast<unsigned char>(ext[k])));
+			}
+			srv.mimeTypes.add(ext,type);
+			++exts;
+			++i;
+		}
+
+		if(i>=t.size()||t[i].text!=";"||exts==0)
+		{
+			return setError(typeLine,"Expected 'type extension ...;' in types");
+		}
+		++i;
+	}
+
+	if(i>=t.size())
+	{
+		return setError(typesLine,"Unexpected end of file in types");
+	}
+	++i;
+	return true;
+}
+
 bool ConfigParser::parseDirective(const std::vector<Token>& t,std::size_t& i,ServerConfig& srv,LocationConfig* loc)
 {
 	if(i>=t.size())
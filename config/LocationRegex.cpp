@@ -0,0 +1,844 @@
+#include "LocationRegex.hpp"
+#include "ServerConfig.hpp"
+
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// a pattern that needs more NFA states than this is refused
+static const std::size_t MAX_NFA_STATES = 20000;
+// DFA states for a server's patterns together; past it, one DFA each
+static const std::size_t MAX_DFA_STATES = 4096;
+static const int MAX_REPEAT = 255;
+
+// Thompson NFA of one or more patterns, built by RegexParser
+struct RegexNfa
+{
+	struct State
+	{
+		// a byte in set moves to next; otherwise eps are the moves
+		bool hasSet;
+		unsigned char set[32];
+		int next;
+		std::vector<int> eps;
+		// location index when this state accepts, -1 otherwise
+		long accept;
+		bool needEnd;
+
+		State() : hasSet(false), next(-1), eps(), accept(-1), needEnd(false)
+		{
+			std::memset(set, 0, sizeof(set));
+		}
+	};
+
+	std::vector<State> states;
+
+	int add()
+	{
+		states.push_back(State());
+		return static_cast<int>(states.size() - 1);
+	}
+
+	void link(int from, int to)
+	{
+		states[from].eps.push_back(to);
+	}
+};
+
+static void setBit(unsigned char* set, unsigned char c)
+{
+	set[c >> 3] |= static_cast<unsigned char>(1u << (c & 7));
+}
+
+static bool hasBit(const unsigned char* set, unsigned char c)
+{
+	return (set[c >> 3] & (1u << (c & 7))) != 0;
+}
+
+static void setRange(unsigned char* set, int lo, int hi)
+{
+	for (int c = lo; c <= hi; ++c)
+		setBit(set, static_cast<unsigned char>(c));
+}
+
+static void negate(unsigned char* set)
+{
+	for (int i = 0; i < 32; ++i)
+		set[i] = static_cast<unsigned char>(~set[i]);
+}
+
+static void foldCase(unsigned char* set)
+{
+	for (int c = 'a'; c <= 'z'; ++c)
+	{
+		int u = c - 'a' + 'A';
+		if (hasBit(set, static_cast<unsigned char>(c)) || hasBit(set, static_cast<unsigned char>(u)))
+		{
+			setBit(set, static_cast<unsigned char>(c));
+			setBit(set, static_cast<unsigned char>(u));
+		}
+	}
+}
+
+static int hexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Recursive descent over one pattern, emitting NFA fragments as it goes.
+// A fragment runs from start to end, end being an epsilon state with no
+// moves yet. {n,m} repeats its atom by parsing it again n or m times.
+class RegexParser
+{
+public:
+	RegexParser(RegexNfa& nfa, const std::string& p, bool caseless)
+		: _nfa(nfa)
+		, _p(p)
+		, _caseless(caseless)
+		, _pos(0)
+		, _end(p.size())
+		, _error()
+	{
+	}
+
+	// appends the pattern to the NFA; start is where matching begins and
+	// anchored tells whether that is only at the start of the path
+	bool compile(long accept, int& start, bool& anchored)
+	{
+		anchored = false;
+		bool needEnd = false;
+
+		if (!_p.empty() && _p[0] == '^')
+		{
+			anchored = true;
+			_pos = 1;
+		}
+
+		// a trailing '$' that no backslash escapes
+		if (_end > _pos && _p[_end - 1] == '$')
+		{
+			std::size_t slashes = 0;
+			while (_end - 1 - slashes > _pos && _p[_end - 2 - slashes] == '\\')
+				++slashes;
+			if (slashes % 2 == 0)
+			{
+				needEnd = true;
+				--_end;
+			}
+		}
+
+		Frag f;
+		if (!parseAlt(f))
+			return false;
+		if (_pos != _end)
+			return fail("unmatched )");
+
+		int acc = _nfa.add();
+		_nfa.states[acc].accept = accept;
+		_nfa.states[acc].needEnd = needEnd;
+		_nfa.link(f.end, acc);
+		start = f.start;
+		return true;
+	}
+
+	const std::string& error() const
+	{
+		return _error;
+	}
+
+private:
+	struct Frag
+	{
+		int start;
+		int end;
+	};
+
+	RegexNfa& _nfa;
+	const std::string& _p;
+	bool _caseless;
+	std::size_t _pos;
+	std::size_t _end;
+	std::string _error;
+
+	bool fail(const std::string& msg)
+	{
+		if (_error.empty())
+			_error = msg + " at offset " + std::to_string(_pos);
+		return false;
+	}
+
+	bool tooLarge()
+	{
+		return _nfa.states.size() > MAX_NFA_STATES;
+	}
+
+	Frag empty()
+	{
+		Frag f;
+		f.start = _nfa.add();
+		f.end = f.start;
+		return f;
+	}
+
+	Frag byteSet(const unsigned char* set)
+	{
+		Frag f;
+		f.start = _nfa.add();
+		f.end = _nfa.add();
+		RegexNfa::State& s = _nfa.states[f.start];
+		s.hasSet = true;
+		std::memcpy(s.set, set, sizeof(s.set));
+		s.next = f.end;
+		return f;
+	}
+
+	Frag star(Frag a)
+	{
+		Frag f;
+		f.start = _nfa.add();
+		f.end = _nfa.add();
+		_nfa.link(f.start, a.start);
+		_nfa.link(f.start, f.end);
+		_nfa.link(a.end, a.start);
+		_nfa.link(a.end, f.end);
+		return f;
+	}
+
+	Frag optional(Frag a)
+	{
+		Frag f;
+		f.start = _nfa.add();
+		f.end = _nfa.add();
+		_nfa.link(f.start, a.start);
+		_nfa.link(f.start, f.end);
+		_nfa.link(a.end, f.end);
+		return f;
+	}
+
+	bool parseAlt(Frag& out)
+	{
+		Frag f;
+		if (!parseConcat(f))
+			return false;
+		if (_pos >= _end || _p[_pos] != '|')
+		{
+			out = f;
+			return true;
+		}
+
+		Frag alt;
+		alt.start = _nfa.add();
+		alt.end = _nfa.add();
+		_nfa.link(alt.start, f.start);
+		_nfa.link(f.end, alt.end);
+
+		while (_pos < _end && _p[_pos] == '|')
+		{
+			++_pos;
+			if (!parseConcat(f))
+				return false;
+			_nfa.link(alt.start, f.start);
+			_nfa.link(f.end, alt.end);
+		}
+		out = alt;
+		return true;
+	}
+
+	bool parseConcat(Frag& out)
+	{
+		Frag f = empty();
+		while (_pos < _end && _p[_pos] != '|' && _p[_pos] != ')')
+		{
+			Frag g;
+			if (!parseRepeat(g))
+				return false;
+			_nfa.link(f.end, g.start);
+			f.end = g.end;
+		}
+		out = f;
+		return true;
+	}
+
+	// digits at i, up to past MAX_REPEAT; false when there are none
+	bool parseCount(std::size_t& i, int& n)
+	{
+		std::size_t from = i;
+		n = 0;
+		while (i < _end && std::isdigit(static_cast<unsigned char>(_p[i])) && n <= MAX_REPEAT)
+		{
+			n = n * 10 + (_p[i] - '0');
+			++i;
+		}
+		return i > from;
+	}
+
+	// {n}, {n,} or {n,m}; false leaves _pos alone, '{' then being a literal
+	bool parseBraces(int& lo, int& hi)
+	{
+		std::size_t i = _pos + 1;
+		if (!parseCount(i, lo))
+			return false;
+		hi = lo;
+
+		if (i < _end && _p[i] == ',')
+		{
+			++i;
+			if (!parseCount(i, hi))
+				hi = -1;
+		}
+		if (i >= _end || _p[i] != '}')
+			return false;
+		_pos = i + 1;
+		return true;
+	}
+
+	bool parseRepeat(Frag& out)
+	{
+		std::size_t atomPos = _pos;
+		Frag a;
+		if (!parseAtom(a))
+			return false;
+
+		if (_pos >= _end)
+		{
+			out = a;
+			return true;
+		}
+
+		char c = _p[_pos];
+		int lo = 0;
+		int hi = -1;
+		if (c == '*')
+			++_pos;
+		else if (c == '+')
+		{
+			lo = 1;
+			++_pos;
+		}
+		else if (c == '?')
+		{
+			hi = 1;
+			++_pos;
+		}
+		else if (c != '{' || !parseBraces(lo, hi))
+		{
+			out = a;
+			return true;
+		}
+
+		if (lo > MAX_REPEAT || hi > MAX_REPEAT || (hi >= 0 && hi < lo))
+			return fail("bad repeat count");
+
+		// lazy a*? matches the same paths as a*
+		if (_pos < _end && _p[_pos] == '?')
+			++_pos;
+		if (_pos < _end && (_p[_pos] == '*' || _p[_pos] == '+' || _p[_pos] == '?' || _p[_pos] == '{'))
+		{
+			int l = 0;
+			int h = 0;
+			std::size_t save = _pos;
+			if (_p[_pos] != '{' || parseBraces(l, h))
+				return fail("nested quantifier");
+			_pos = save;
+		}
+
+		std::size_t after = _pos;
+
+		// a{lo,hi} is lo copies of a, then hi - lo optional ones (a* past lo
+		// when there is no hi); a itself is the first copy
+		std::vector<Frag> copies;
+		copies.push_back(a);
+		int needed = (hi < 0 ? lo + 1 : hi);
+		if (needed == 0)
+			needed = 1;
+		while (static_cast<int>(copies.size()) < needed)
+		{
+			_pos = atomPos;
+			Frag again;
+			if (!parseAtom(again))
+				return false;
+			copies.push_back(again);
+			if (tooLarge())
+				return fail("pattern too large");
+		}
+		_pos = after;
+
+		Frag f = empty();
+		for (std::size_t k = 0; k < copies.size(); ++k)
+		{
+			Frag g = copies[k];
+			if (static_cast<int>(k) >= lo)
+				g = (hi < 0 ? star(g) : optional(g));
+			_nfa.link(f.end, g.start);
+			f.end = g.end;
+		}
+		// a{0} matches only the empty string
+		if (hi == 0)
+			f = empty();
+		out = f;
+		return true;
+	}
+
+	bool parseAtom(Frag& out)
+	{
+		if (tooLarge())
+			return fail("pattern too large");
+
+		char c = _p[_pos];
+		unsigned char set[32];
+		std::memset(set, 0, sizeof(set));
+
+		if (c == '(')
+		{
+			++_pos;
+			if (_p.compare(_pos, 2, "?:") == 0)
+				_pos += 2;
+			else if (_p.compare(_pos, 2, "?<") == 0 || _p.compare(_pos, 3, "?P<") == 0)
+			{
+				// named group: only the name is skipped, nothing is captured
+				std::size_t close = _p.find('>', _pos);
+				std::size_t name = _pos + (_p[_pos + 1] == 'P' ? 3 : 2);
+				if (close == std::string::npos || close >= _end || close == name
+					|| _p[name] == '=' || _p[name] == '!')
+					return fail("unsupported group");
+				_pos = close + 1;
+			}
+			else if (_pos < _end && _p[_pos] == '?')
+				return fail("unsupported group");
+
+			if (!parseAlt(out))
+				return false;
+			if (_pos >= _end || _p[_pos] != ')')
+				return fail("missing )");
+			++_pos;
+			return true;
+		}
+		if (c == ')')
+			return fail("unmatched )");
+		if (c == '*' || c == '+' || c == '?')
+			return fail("nothing to repeat");
+		if (c == '^' || c == '$')
+			return fail("^ and $ are only supported at the ends of the pattern");
+
+		if (c == '[')
+		{
+			if (!parseClass(set))
+				return false;
+		}
+		else if (c == '.')
+		{
+			setRange(set, 0, 255);
+			set['\n' >> 3] &= static_cast<unsigned char>(~(1u << ('\n' & 7)));
+			++_pos;
+		}
+		else if (c == '\\')
+		{
+			int single = -1;
+			if (!parseEscape(set, single))
+				return false;
+		}
+		else
+		{
+			setBit(set, static_cast<unsigned char>(c));
+			++_pos;
+		}
+
+		if (_caseless)
+			foldCase(set);
+		out = byteSet(set);
+		return true;
+	}
+
+	// at a backslash; fills the empty set, and single too for a single byte
+	bool parseEscape(unsigned char* set, int& single)
+	{
+		++_pos;
+		if (_pos >= _p.size())
+			return fail("trailing backslash");
+
+		char c = _p[_pos++];
+		single = -1;
+
+		switch (c)
+		{
+		case 'd':
+		case 'D':
+			setRange(set, '0', '9');
+			break;
+		case 'w':
+		case 'W':
+			setRange(set, '0', '9');
+			setRange(set, 'a', 'z');
+			setRange(set, 'A', 'Z');
+			setBit(set, '_');
+			break;
+		case 's':
+		case 'S':
+			setBit(set, ' ');
+			setRange(set, '\t', '\r');
+			break;
+		case 't':
+			single = '\t';
+			break;
+		case 'n':
+			single = '\n';
+			break;
+		case 'r':
+			single = '\r';
+			break;
+		case 'f':
+			single = '\f';
+			break;
+		case 'v':
+			single = '\v';
+			break;
+		case 'x':
+		{
+			if (_pos + 1 >= _p.size() || hexValue(_p[_pos]) < 0 || hexValue(_p[_pos + 1]) < 0)
+				return fail("bad \\x escape");
+			single = hexValue(_p[_pos]) * 16 + hexValue(_p[_pos + 1]);
+			_pos += 2;
+			break;
+		}
+		default:
+			// \b, \1, \A ... would need more than a DFA over the path
+			if (std::isalnum(static_cast<unsigned char>(c)))
+				return fail(std::string("unsupported escape \\") + c);
+			single = static_cast<unsigned char>(c);
+			break;
+		}
+
+		if (single >= 0)
+			setBit(set, static_cast<unsigned char>(single));
+		else if (std::isupper(static_cast<unsigned char>(c)))
+			negate(set);
+		return true;
+	}
+
+	bool parseClass(unsigned char* set)
+	{
+		++_pos;
+		bool negated = false;
+		if (_pos < _end && _p[_pos] == '^')
+		{
+			negated = true;
+			++_pos;
+		}
+
+		bool first = true;
+		while (_pos < _end && (_p[_pos] != ']' || first))
+		{
+			first = false;
+
+			int lo = -1;
+			if (_p[_pos] == '\\')
+			{
+				unsigned char esc[32];
+				std::memset(esc, 0, sizeof(esc));
+				if (!parseEscape(esc, lo))
+					return false;
+				for (int k = 0; k < 32; ++k)
+					set[k] |= esc[k];
+				if (lo < 0)
+					continue;
+			}
+			else if (_p.compare(_pos, 2, "[:") == 0)
+				return fail("POSIX classes are not supported");
+			else
+				lo = static_cast<unsigned char>(_p[_pos++]);
+
+			if (_pos + 1 < _end && _p[_pos] == '-' && _p[_pos + 1] != ']')
+			{
+				++_pos;
+				int hi = -1;
+				if (_p[_pos] == '\\')
+				{
+					unsigned char ignored[32];
+					std::memset(ignored, 0, sizeof(ignored));
+					if (!parseEscape(ignored, hi))
+						return false;
+					if (hi < 0)
+						return fail("bad range in []");
+				}
+				else
+					hi = static_cast<unsigned char>(_p[_pos++]);
+				if (hi < lo)
+					return fail("bad range in []");
+				setRange(set, lo, hi);
+			}
+			else
+				setBit(set, static_cast<unsigned char>(lo));
+		}
+		if (_pos >= _end)
+			return fail("missing ]");
+		++_pos;
+
+		// case folds before the negation, as in PCRE
+		if (_caseless)
+			foldCase(set);
+		if (negated)
+			negate(set);
+		return true;
+	}
+};
+
+static bool isRegexLocation(const LocationConfig& loc)
+{
+	return loc.match == LocationConfig::REGEX || loc.match == LocationConfig::REGEX_CASELESS;
+}
+
+LocationRegex::Dfa::Dfa()
+	: classes(0)
+	, next()
+	, now()
+	, atEnd()
+	, dead(-1)
+	, first(-1)
+{
+	std::memset(classOf, 0, sizeof(classOf));
+}
+
+LocationRegex::LocationRegex()
+	: _dfas()
+{
+}
+
+bool LocationRegex::check(const std::string& pattern, bool caseless, std::string& error)
+{
+	RegexNfa nfa;
+	RegexParser parser(nfa, pattern, caseless);
+	int start = 0;
+	bool anchored = false;
+	if (!parser.compile(0, start, anchored))
+	{
+		error = parser.error();
+		return false;
+	}
+	return true;
+}
+
+// states reachable from set through epsilon moves; only the ones that
+// matter to a DFA state (byte moves and accepts) are kept, sorted
+static void closure(const RegexNfa& nfa, std::vector<int>& set, std::vector<unsigned>& mark, unsigned gen)
+{
+	std::vector<int> stack(set);
+	set.clear();
+	while (!stack.empty())
+	{
+		int s = stack.back();
+		stack.pop_back();
+		if (mark[s] == gen)
+			continue;
+		mark[s] = gen;
+
+		const RegexNfa::State& st = nfa.states[s];
+		if (st.hasSet || st.accept >= 0)
+			set.push_back(s);
+		for (std::size_t k = 0; k < st.eps.size(); ++k)
+			stack.push_back(st.eps[k]);
+	}
+	std::sort(set.begin(), set.end());
+}
+
+bool LocationRegex::compile(const std::vector<LocationConfig>& locations,
+	const std::vector<std::size_t>& which, Dfa& out)
+{
+	// state 0 starts the anchored patterns once; the others restart from
+	// loop after every byte, which is the unanchored search
+	RegexNfa nfa;
+	int root = nfa.add();
+	int loop = nfa.add();
+	int any = nfa.add();
+	nfa.link(root, loop);
+	nfa.link(loop, any);
+	nfa.states[any].hasSet = true;
+	setRange(nfa.states[any].set, 0, 255);
+	nfa.states[any].next = loop;
+
+	for (std::size_t k = 0; k < which.size(); ++k)
+	{
+		const LocationConfig& loc = locations[which[k]];
+		RegexParser parser(nfa, loc.prefix, loc.match == LocationConfig::REGEX_CASELESS);
+		int start = 0;
+		bool anchored = false;
+		if (!parser.compile(static_cast<long>(which[k]), start, anchored))
+			return false;
+		nfa.link(anchored ? root : loop, start);
+	}
+
+	// bytes that no byte set tells apart share a class
+	int classOf[256];
+	std::fill(classOf, classOf + 256, 0);
+	int classes = 1;
+	for (std::size_t s = 0; s < nfa.states.size(); ++s)
+	{
+		if (!nfa.states[s].hasSet || s == static_cast<std::size_t>(any))
+			continue;
+		std::map<std::pair<int, bool>, int> split;
+		for (int c = 0; c < 256; ++c)
+		{
+			std::pair<int, bool> key(classOf[c], hasBit(nfa.states[s].set, static_cast<unsigned char>(c)));
+			std::map<std::pair<int, bool>, int>::iterator it = split.find(key);
+			if (it == split.end())
+				it = split.insert(std::make_pair(key, static_cast<int>(split.size()))).first;
+			classOf[c] = it->second;
+		}
+		classes = static_cast<int>(split.size());
+	}
+
+	std::vector<int> sample(classes, 0);
+	for (int c = 255; c >= 0; --c)
+		sample[classOf[c]] = c;
+
+	std::vector<unsigned> mark(nfa.states.size(), 0);
+	unsigned gen = 0;
+
+	std::map<std::vector<int>, int> ids;
+	std::vector<std::vector<int> > pending;
+
+	std::vector<int> init(1, root);
+	closure(nfa, init, mark, ++gen);
+	ids[init] = 0;
+	pending.push_back(init);
+
+	Dfa dfa;
+	dfa.classes = static_cast<std::size_t>(classes);
+	for (int c = 0; c < 256; ++c)
+		dfa.classOf[c] = static_cast<unsigned char>(classOf[c]);
+	dfa.first = static_cast<long>(which[0]);
+
+	for (std::size_t d = 0; d < pending.size(); ++d)
+	{
+		if (pending.size() > MAX_DFA_STATES)
+			return false;
+
+		// copy: pending grows below
+		std::vector<int> cur = pending[d];
+
+		long now = -1;
+		long atEnd = -1;
+		for (std::size_t k = 0; k < cur.size(); ++k)
+		{
+			const RegexNfa::State& st = nfa.states[cur[k]];
+			if (st.accept < 0)
+				continue;
+			long& slot = (st.needEnd ? atEnd : now);
+			if (slot < 0 || st.accept < slot)
+				slot = st.accept;
+		}
+		if (now >= 0 && (atEnd < 0 || now < atEnd))
+			atEnd = now;
+		dfa.now.push_back(now);
+		dfa.atEnd.push_back(atEnd);
+		if (cur.empty())
+			dfa.dead = static_cast<int>(d);
+
+		for (int cls = 0; cls < classes; ++cls)
+		{
+			unsigned char c = static_cast<unsigned char>(sample[cls]);
+			std::vector<int> nxt;
+			for (std::size_t k = 0; k < cur.size(); ++k)
+			{
+				const RegexNfa::State& st = nfa.states[cur[k]];
+				if (st.hasSet && hasBit(st.set, c))
+					nxt.push_back(st.next);
+			}
+			closure(nfa, nxt, mark, ++gen);
+
+			std::map<std::vector<int>, int>::iterator it = ids.find(nxt);
+			if (it == ids.end())
+			{
+				it = ids.insert(std::make_pair(nxt, static_cast<int>(pending.size()))).first;
+				pending.push_back(nxt);
+			}
+			dfa.next.push_back(it->second);
+		}
+	}
+
+	out = dfa;
+	return true;
+}
+
+bool LocationRegex::build(const std::vector<LocationConfig>& locations)
+{
+	_dfas.clear();
+
+	std::vector<std::size_t> regex;
+	for (std::size_t i = 0; i < locations.size(); ++i)
+	{
+		if (isRegexLocation(locations[i]))
+			regex.push_back(i);
+	}
+	if (regex.empty())
+		return true;
+
+	Dfa all;
+	if (compile(locations, regex, all))
+	{
+		_dfas.push_back(all);
+		return true;
+	}
+
+	// too many states together: one DFA per pattern, tried in order
+	for (std::size_t k = 0; k < regex.size(); ++k)
+	{
+		Dfa one;
+		if (!compile(locations, std::vector<std::size_t>(1, regex[k]), one))
+		{
+			_dfas.clear();
+			return false;
+		}
+		_dfas.push_back(one);
+	}
+	return true;
+}
+
+long LocationRegex::run(const Dfa& dfa, const std::string& path)
+{
+	const int* next = &dfa.next[0];
+	std::size_t classes = dfa.classes;
+
+	std::size_t s = 0;
+	long best = dfa.now[0];
+	for (std::size_t i = 0; i < path.size(); ++i)
+	{
+		if (best == dfa.first || static_cast<int>(s) == dfa.dead)
+			return best;
+
+		s = static_cast<std::size_t>(next[s * classes + dfa.classOf[static_cast<unsigned char>(path[i])]]);
+		long a = dfa.now[s];
+		if (a >= 0 && (best < 0 || a < best))
+			best = a;
+	}
+
+	long a = dfa.atEnd[s];
+	if (a >= 0 && (best < 0 || a < best))
+		best = a;
+	return best;
+}
+
+long LocationRegex::match(const std::string& path) const
+{
+	for (std::size_t k = 0; k < _dfas.size(); ++k)
+	{
+		long r = run(_dfas[k], path);
+		if (r >= 0)
+			return r;
+	}
+	return -1;
+}
+
+std::size_t LocationRegex::states() const
+{
+	std::size_t n = 0;
+	for (std::size_t k = 0; k < _dfas.size(); ++k)
+		n += _dfas[k].now.size();
+	return n;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+struct LocationConfig;
+
+// Regex locations (location ~ / ~*), compiled when the config is loaded.
+// The patterns of a server all go into one DFA, so a request path is read
+// once whatever their number, and the DFA reports the first pattern in
+// declaration order that matches, as nginx's scan of them would.
+// The syntax is the part of PCRE location patterns use: literals, '.',
+// [] classes, \d \w \s and their negations, groups (also (?: and named
+// ones), |, * + ? {n,m}, ^ at the start and $ at the end. Groups do not
+// capture.
+class LocationRegex
+{
+public:
+	LocationRegex();
+
+	// false, with error set, when pattern is outside the supported syntax
+	static bool check(const std::string& pattern, bool caseless, std::string& error);
+
+	// false when a single pattern needs more DFA states than allowed
+	bool build(const std::vector<LocationConfig>& locations);
+
+	// index of the first regex location matching path, -1 if none
+	long match(const std::string& path) const;
+
+	// DFA states in total, for the startup log
+	std::size_t states() const;
+
+private:
+	struct Dfa
+	{
+		std::size_t classes;
+		unsigned char classOf[256];
+		// next[state * classes + class]
+		std::vector<int> next;
+		// lowest location matched once a state is reached / at the end of
+		// the path in it ($ patterns), -1 for none
+		std::vector<long> now;
+		std::vector<long> atEnd;
+		// state with no way to match anything more, -1 if there is none
+		int dead;
+		// lowest location of the DFA: nothing better can come once seen
+		long first;
+
+		Dfa();
+	};
+
+	// one DFA for the server, or one per pattern, tried in order, when
+	// together they would be too large
+	std::vector<Dfa> _dfas;
+
+	static bool compile(const std::vector<LocationConfig>& locations,
+		const std::vector<std::size_t>& which, Dfa& out);
+	static long run(const Dfa& dfa, const std::string& path);
+};
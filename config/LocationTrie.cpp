@@ -0,0 +1,146 @@
+#include "LocationTrie.hpp"
+#include "ServerConfig.hpp"
+
+#include <cstring>
+
+static const std::size_t NO_NODE = static_cast<std::size_t>(-1);
+
+LocationTrie::LocationTrie()
+	: _nodes(1)
+	, _exact()
+{
+}
+
+// <0, 0, >0 like strcmp, for a segment that is not NUL-terminated
+static int compareSegment(const std::string& key, const char* seg, std::size_t len)
+{
+	std::size_t n = key.size();
+	if (n > len)
+		n = len;
+
+	int c = std::memcmp(key.data(), seg, n);
+	if (c != 0)
+		return c;
+	if (key.size() < len)
+		return -1;
+	if (key.size() > len)
+		return 1;
+	return 0;
+}
+
+std::size_t LocationTrie::findChild(std::size_t node, const char* seg, std::size_t len) const
+{
+	const std::vector<std::pair<std::string, std::size_t> >& ch = _nodes[node].children;
+
+	std::size_t lo = 0;
+	std::size_t hi = ch.size();
+	while (lo < hi)
+	{
+		std::size_t mid = lo + (hi - lo) / 2;
+		int c = compareSegment(ch[mid].first, seg, len);
+		if (c == 0)
+			return ch[mid].second;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NO_NODE;
+}
+
+void LocationTrie::build(const std::vector<LocationConfig>& locations)
+{
+	_nodes.assign(1, Node());
+	_exact.clear();
+
+	for (std::size_t i = 0; i < locations.size(); ++i)
+	{
+		const std::string& prefix = locations[i].prefix;
+		if (prefix.empty() || prefix[0] != '/')
+			continue;
+
+		if (locations[i].match == LocationConfig::EXACT)
+		{
+			std::size_t at = 0;
+			while (at < _exact.size() && _exact[at].first < prefix)
+				++at;
+			if (at == _exact.size() || _exact[at].first != prefix)
+				_exact.insert(_exact.begin() + static_cast<std::ptrdiff_t>(at), std::make_pair(prefix, static_cast<long>(i)));
+			continue;
+		}
+		if (locations[i].match != LocationConfig::PREFIX && locations[i].match != LocationConfig::PREFIX_NO_REGEX)
+			continue;
+
+		std::size_t node = 0;
+		std::size_t pos = 1;
+		while (pos < prefix.size())
+		{
+			std::size_t end = prefix.find('/', pos);
+			if (end == std::string::npos)
+				end = prefix.size();
+
+			std::string seg = prefix.substr(pos, end - pos);
+
+			std::size_t next = findChild(node, seg.data(), seg.size());
+			if (next == NO_NODE)
+			{
+				next = _nodes.size();
+				_nodes.push_back(Node());
+
+				std::vector<std::pair<std::string, std::size_t> >& ch = _nodes[node].children;
+				std::size_t at = 0;
+				while (at < ch.size() && ch[at].first < seg)
+					++at;
+				ch.insert(ch.begin() + static_cast<std::ptrdiff_t>(at), std::make_pair(seg, next));
+			}
+			node = next;
+			pos = end + 1;
+		}
+
+		// same prefix twice: the first one wins, as with the old scan
+		if (_nodes[node].location < 0)
+			_nodes[node].location = static_cast<long>(i);
+	}
+}
+
+long LocationTrie::match(const std::string& path) const
+{
+	long best = _nodes[0].location;
+	if (path.empty() || path[0] != '/')
+		return best;
+
+	std::size_t node = 0;
+	std::size_t pos = 1;
+	while (pos < path.size())
+	{
+		std::size_t end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.size();
+
+		node = findChild(node, path.data() + pos, end - pos);
+		if (node == NO_NODE)
+			break;
+		if (_nodes[node].location >= 0)
+			best = _nodes[node].location;
+		pos = end + 1;
+	}
+	return best;
+}
+
+long LocationTrie::matchExact(const std::string& path) const
+{
+	std::size_t lo = 0;
+	std::size_t hi = _exact.size();
+	while (lo < hi)
+	{
+		std::size_t mid = lo + (hi - lo) / 2;
+		int c = compareSegment(_exact[mid].first, path.data(), path.size());
+		if (c == 0)
+			return _exact[mid].second;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
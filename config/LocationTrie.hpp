@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+struct LocationConfig;
+
+// Longest-prefix location lookup, compiled from a server's locations when
+// the config is loaded. One node per path segment ("/api/v1" is api -> v1),
+// so a lookup walks the request path once whatever the number of
+// locations, and "/api" still matches "/api" and "/api/x" but not "/apix".
+// Nodes refer to locations by index: the trie survives copies of the
+// ServerConfig it belongs to. "location = path" ones sit beside it in a
+// sorted list; regex locations are LocationRegex's.
+class LocationTrie
+{
+public:
+	LocationTrie();
+
+	void build(const std::vector<LocationConfig>& locations);
+
+	// index of the longest matching prefix, -1 if none; a path that does
+	// not start with '/' only matches location "/"
+	long match(const std::string& path) const;
+
+	// index of the "= path" location for exactly path, -1 if none
+	long matchExact(const std::string& path) const;
+
+private:
+	struct Node
+	{
+		long location;
+		// sorted by segment
+		std::vector<std::pair<std::string, std::size_t> > children;
+
+		Node() : location(-1), children() {}
+	};
+
+	std::vector<Node> _nodes;
+	// sorted by path
+	std::vector<std::pair<std::string, long> > _exact;
+
+	std::size_t findChild(std::size_t node, const char* seg, std::size_t len) const;
+};
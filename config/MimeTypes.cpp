@@ -0,0 +1,178 @@
+#include "MimeTypes.hpp"
+
+#include <cstring>
+
+struct MimeDefault
+{
+	const char* ext;
+	const char* type;
+};
+
+static constexpr MimeDefault MIME_DEFAULTS[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "shtml", "text/html" },
+	{ "css", "text/css" },
+	{ "xml", "text/xml" },
+	{ "txt", "text/plain" },
+	{ "csv", "text/csv" },
+	{ "md", "text/markdown" },
+	{ "js", "application/javascript" },
+	{ "mjs", "application/javascript" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "wasm", "application/wasm" },
+	{ "pdf", "application/pdf" },
+	{ "rss", "application/rss+xml" },
+	{ "atom", "application/atom+xml" },
+	{ "zip", "application/zip" },
+	{ "gz", "application/gzip" },
+	{ "tar", "application/x-tar" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "webp", "image/webp" },
+	{ "avif", "image/avif" },
+	{ "svg", "image/svg+xml" },
+	{ "svgz", "image/svg+xml" },
+	{ "ico", "image/x-icon" },
+	{ "bmp", "image/bmp" },
+	{ "tif", "image/tiff" },
+	{ "tiff", "image/tiff" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf", "font/ttf" },
+	{ "otf", "font/otf" },
+	{ "eot", "application/vnd.ms-fontobject" },
+	{ "mp4", "video/mp4" },
+	{ "m4v", "video/mp4" },
+	{ "webm", "video/webm" },
+	{ "mpeg", "video/mpeg" },
+	{ "mpg", "video/mpeg" },
+	{ "mov", "video/quicktime" },
+	{ "mp3", "audio/mpeg" },
+	{ "m4a", "audio/mp4" },
+	{ "ogg", "audio/ogg" },
+	{ "wav", "audio/wav" },
+	// the subject's tester: youpi.bad_extension is HTML, youpi.bla text
+	{ "bad_extension", "text/html" },
+	{ "bla", "text/plain" },
+	{ "py", "text/plain" },
+};
+
+static unsigned char lower(char c)
+{
+	unsigned char u = static_cast<unsigned char>(c);
+	if (u >= 'A' && u <= 'Z')
+		return static_cast<unsigned char>(u - 'A' + 'a');
+	return u;
+}
+
+MimeTypes::MimeTypes()
+	: _slots()
+	, _used(0)
+{
+	for (std::size_t i = 0; i < sizeof(MIME_DEFAULTS) / sizeof(MIME_DEFAULTS[0]); ++i)
+		add(MIME_DEFAULTS[i].ext, MIME_DEFAULTS[i].type);
+}
+
+void MimeTypes::clear()
+{
+	_slots.clear();
+	_used = 0;
+}
+
+std::size_t MimeTypes::size() const
+{
+	return _used;
+}
+
+std::size_t MimeTypes::hash(const char* s, std::size_t len)
+{
+	// FNV-1a over the lowercased bytes
+	std::size_t h = static_cast<std::size_t>(14695981039346656037ULL);
+	for (std::size_t i = 0; i < len; ++i)
+	{
+		h ^= lower(s[i]);
+		h *= static_cast<std::size_t>(1099511628211ULL);
+	}
+	return h;
+}
+
+void MimeTypes::add(const std::string& ext, const std::string& type)
+{
+	if (ext.empty())
+		return;
+
+	if ((_used + 1) * 2 > _slots.size())
+	{
+		std::vector<Slot> old;
+		old.swap(_slots);
+		_slots.assign(old.empty() ? 64 : old.size() * 2, Slot());
+		_used = 0;
+		for (std::size_t i = 0; i < old.size(); ++i)
+		{
+			if (!old[i].ext.empty())
+				add(old[i].ext, old[i].type);
+		}
+	}
+
+	std::size_t h = hash(ext.data(), ext.size());
+	std::size_t mask = _slots.size() - 1;
+	std::size_t i = h & mask;
+	while (!_slots[i].ext.empty())
+	{
+		if (_slots[i].hash == h && _slots[i].ext == ext)
+		{
+			_slots[i].type = type;
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	_slots[i].ext = ext;
+	_slots[i].type = type;
+	_slots[i].hash = h;
+	++_used;
+}
+
+const std::string* MimeTypes::find(const char* ext, std::size_t len) const
+{
+	if (_slots.empty())
+		return 0;
+
+	std::size_t h = hash(ext, len);
+	std::size_t mask = _slots.size() - 1;
+	std::size_t i = h & mask;
+	while (!_slots[i].ext.empty())
+	{
+		const Slot& s = _slots[i];
+		if (s.hash == h && s.ext.size() == len)
+		{
+			std::size_t k = 0;
+			while (k < len && static_cast<unsigned char>(s.ext[k]) == lower(ext[k]))
+				++k;
+			if (k == len)
+				return &s.type;
+		}
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+const std::string& MimeTypes::lookup(const std::string& path) const
+{
+	static const std::string plain("text/plain");
+	static const std::string octet("application/octet-stream");
+
+	std::size_t slash = path.rfind('/');
+	std::size_t from = (slash == std::string::npos ? 0 : slash + 1);
+	std::size_t dot = path.rfind('.');
+	if (dot == std::string::npos || dot < from)
+		return plain;
+
+	const std::string* type = find(path.data() + dot + 1, path.size() - dot - 1);
+	if (type == 0)
+		return octet;
+	return *type;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Extension -> Content-Type, one table per server used by static files,
+// error pages and X-Sendfile alike. It starts as the built-in table; a
+// types { } block (or include mime.types) replaces it, as in nginx. The
+// extensions sit in an open-addressing hash table and are hashed and
+// compared in place, case-insensitively: a lookup allocates nothing.
+class MimeTypes
+{
+public:
+	// the built-in table
+	MimeTypes();
+
+	void clear();
+	// ext lowercase; a later type for the same extension replaces it
+	void add(const std::string& ext, const std::string& type);
+	std::size_t size() const;
+
+	// type for the extension of the last segment of path; a name with no
+	// extension is text/plain, an unknown one application/octet-stream
+	const std::string& lookup(const std::string& path) const;
+
+private:
+	struct Slot
+	{
+		std::string ext;
+		std::string type;
+		std::size_t hash;
+
+		Slot() : ext(), type(), hash(0) {}
+	};
+
+	// power of two in size, at most half full; an empty ext is a free slot
+	std::vector<Slot> _slots;
+	std::size_t _used;
+
+	static std::size_t hash(const char* s, std::size_t len);
+	const std::string* find(const char* ext, std::size_t len) const;
+};
@@ -3,10 +3,60 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include "LocationTrie.hpp"
+#include "LocationRegex.hpp"
+#include "MimeTypes.hpp"
+
+struct CgiPoolConfig
+{
+	std::size_t workers;
+	std::size_t maxRequests;
+	std::string bootstrap;
+
+	CgiPoolConfig()
+		: workers(0)
+		, maxRequests(0)
+		, bootstrap()
+	{
+	}
+};
+
+// upstream <name> { server host:port; ... }: proxy_pass targets. A plain
+// proxy_pass http://host:port gets an implicit one-server group.
+struct UpstreamConfig
+{
+	std::vector<std::string> servers;
+	bool leastConn;
+
+	// idle keep-alive connections kept per server address
+	std::size_t keepalive;
+
+	UpstreamConfig()
+		: servers()
+		, leastConn(false)
+		, keepalive(8)
+	{
+	}
+};
 
 struct LocationConfig
 {
+	// location [= | ^~ | ~ | ~*] prefix. For the regex kinds prefix holds
+	// the pattern; those and "=" map the whole request path under root,
+	// where a prefix location maps what follows the prefix
+	enum Match
+	{
+		PREFIX,
+		PREFIX_NO_REGEX,
+		EXACT,
+		REGEX,
+		REGEX_CASELESS
+	};
+
 	std::string prefix;
+	Match match;
+	// the server's root / index when the location sets none (done at load)
 	std::string root;
 	std::string index;
 	bool autoindex;
@@ -20,8 +70,70 @@ struct LocationConfig
 	int returnCode;
 	std::string returnUrl;
 
+	// only reachable through a CGI's X-Accel-Redirect / X-Sendfile
+	bool internal;
+
+	// serve a fresh file.gz / file.br sibling to clients that accept it
+	bool gzipStatic;
+	bool brotliStatic;
+
+	// on-the-fly compression of 200/403/404 responses whose Content-Type
+	// is text/html or listed in *Types ("*" = any) and whose body has at
+	// least *MinLength bytes
+	bool gzip;
+	int gzipCompLevel;
+	std::size_t gzipMinLength;
+	std::vector<std::string> gzipTypes;
+	bool brotli;
+	int brotliCompLevel;
+	std::size_t brotliMinLength;
+	std::vector<std::string> brotliTypes;
+
+	std::string fastcgiPass;
+	std::size_t fastcgiPoolSize;
+	std::size_t fastcgiMultiplex;
+
+	// proxy_pass: name of an upstream group of the server; timeouts in
+	// seconds. Buffering collects up to proxyBufferSize bytes of the body
+	// before answering, past that (or with buffering off) it is streamed.
+	std::string proxyPass;
+	std::size_t proxyConnectTimeout;
+	std::size_t proxySendTimeout;
+	std::size_t proxyReadTimeout;
+	bool proxyBuffering;
+	std::size_t proxyBufferSize;
+
+	// extension -> pre-forked interpreter pool
+	std::map<std::string, CgiPoolConfig> cgiPools;
+
+	// 0 = only the server-wide cgi_max_concurrent applies
+	std::size_t cgiMaxConcurrent;
+
+	// spawn the CGI right after the headers and pipe the body as it arrives
+	bool cgiStreamBody;
+
+	// CGI response cache: default TTL in seconds (0 = off) and the request
+	// headers (lowercase) that take part in the key
+	std::size_t cgiCacheValid;
+	std::vector<std::string> cgiCacheKeyHeaders;
+
+	// identical concurrent CGI requests wait for the one in flight,
+	// at most cgiCacheLockTimeout seconds before spawning on their own
+	bool cgiCacheLock;
+	std::size_t cgiCacheLockTimeout;
+
+	// keep the CGI running when the client closes (or half-closes) its end
+	bool cgiIgnoreClientAbort;
+
+	// applied to each fork-per-request CGI child before exec; 0 = inherit
+	std::size_t cgiRlimitCpu;
+	std::size_t cgiRlimitAs;
+	std::size_t cgiRlimitNofile;
+	int cgiNice;
+
 	LocationConfig()
 		: prefix("/")
+		, match(PREFIX)
 		, root("")
 		, index("")
 		, autoindex(false)
@@ -32,6 +144,64 @@ struct LocationConfig
 		, hasReturn(false)
 		, returnCode(0)
 		, returnUrl("")
+		, internal(false)
+		, gzipStatic(false)
+		, brotliStatic(false)
+		, gzip(false)
+		, gzipCompLevel(1)
+		, gzipMinLength(20)
+		, gzipTypes()
+		, brotli(false)
+		, brotliCompLevel(6)
+		, brotliMinLength(20)
+		, brotliTypes()
+		, fastcgiPass("")
+		, fastcgiPoolSize(8)
+		, fastcgiMultiplex(1)
+		, proxyPass("")
+		, proxyConnectTimeout(5)
+		, proxySendTimeout(60)
+		, proxyReadTimeout(60)
+		, proxyBuffering(true)
+		, proxyBufferSize(1024 * 1024)
+		, cgiPools()
+		, cgiMaxConcurrent(0)
+		, cgiStreamBody(false)
+		, cgiCacheValid(0)
+		, cgiCacheKeyHeaders()
+		, cgiCacheLock(false)
+		, cgiCacheLockTimeout(5)
+		, cgiIgnoreClientAbort(false)
+		, cgiRlimitCpu(0)
+		, cgiRlimitAs(0)
+		, cgiRlimitNofile(0)
+		, cgiNice(0)
+	{
+	}
+};
+
+// An error response made ready at config load (HttpError::prepare): the
+// error_page file or the built-in page, read once and shared by every
+// copy of the config, and the whole response serialized for a close and
+// a keep-alive connection.
+struct PreparedError
+{
+	std::string reason;
+	std::string contentType;
+	// from an error_page file: the body whatever the reason phrase
+	bool custom;
+	std::shared_ptr<const std::string> body;
+	// 0 for a status with no standard reason phrase
+	std::shared_ptr<const std::string> close;
+	std::shared_ptr<const std::string> keepAlive;
+
+	PreparedError()
+		: reason()
+		, contentType()
+		, custom(false)
+		, body()
+		, close()
+		, keepAlive()
 	{
 	}
 };
@@ -47,13 +217,41 @@ struct ServerConfig
 	std::size_t clientMaxBodySize;
 
 	std::map<int, std::string> errorPages;
+	std::map<int, PreparedError> preparedErrors;
 	std::map<std::string, std::string> cgi;
 
+	// Content-Type by extension: built-in, or the server's types { }
+	MimeTypes mimeTypes;
+
+	// fork-per-request CGI admission: 0 = unlimited
+	std::size_t cgiMaxConcurrent;
+	std::size_t cgiQueueSize;
+	std::size_t cgiQueueTimeout;
+
+	// CGI stdout kept in memory up to cgiOutputBufferSize, the rest goes to
+	// an unlinked file in cgiTempPath; cgiMaxOutputSize (0 = unlimited)
+	// fails the request with 502
+	std::size_t cgiOutputBufferSize;
+	std::size_t cgiMaxOutputSize;
+	std::string cgiTempPath;
+
+	// CGI stderr, line by line; empty = server log. At most
+	// cgiStderrLimit bytes per request, the rest is counted
+	std::string cgiErrorLog;
+	std::size_t cgiStderrLimit;
+
 	bool sessionEnabled;
 	std::size_t sessionTimeout;
 	std::string sessionStorePath;
 
+	std::map<std::string, UpstreamConfig> upstreams;
+
+	// longest prefix first, then the regex ones in declaration order;
+	// locationTrie and locationRegex index them and are rebuilt whenever
+	// the list changes
 	std::vector<LocationConfig> locations;
+	LocationTrie locationTrie;
+	LocationRegex locationRegex;
 
 	ServerConfig()
 		: listenPort(8080)
@@ -63,11 +261,24 @@ struct ServerConfig
 		, uploadDir("www/uploads")
 		, clientMaxBodySize(1000000)
 		, errorPages()
+		, preparedErrors()
 		, cgi()
+		, mimeTypes()
+		, cgiMaxConcurrent(0)
+		, cgiQueueSize(64)
+		, cgiQueueTimeout(10)
+		, cgiOutputBufferSize(1024 * 1024)
+		, cgiMaxOutputSize(0)
+		, cgiTempPath("/tmp")
+		, cgiErrorLog("")
+		, cgiStderrLimit(64 * 1024)
 		, sessionEnabled(false)
 		, sessionTimeout(0)
 		, sessionStorePath("")
+		, upstreams()
 		, locations()
+		, locationTrie()
+		, locationRegex()
 	{
 		LocationConfig loc;
 		loc.prefix="/";
@@ -81,5 +292,6 @@ struct ServerConfig
 		loc.allowDelete=true;
 
 		locations.push_back(loc);
+		locationTrie.build(locations);
 	}
 };
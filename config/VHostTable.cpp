@@ -0,0 +1,285 @@
+#include "VHostTable.hpp"
+
+#include <cstring>
+
+static const std::size_t NO_NODE = static_cast<std::size_t>(-1);
+
+static unsigned char lower(char c)
+{
+	unsigned char u = static_cast<unsigned char>(c);
+	if (u >= 'A' && u <= 'Z')
+		return static_cast<unsigned char>(u - 'A' + 'a');
+	return u;
+}
+
+// <0, 0, >0 like strcmp, key lowercase, label in any case
+static int compareLabel(const std::string& key, const char* label, std::size_t len)
+{
+	std::size_t n = key.size() < len ? key.size() : len;
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		unsigned char a = static_cast<unsigned char>(key[i]);
+		unsigned char b = lower(label[i]);
+		if (a != b)
+			return a < b ? -1 : 1;
+	}
+	if (key.size() < len)
+		return -1;
+	if (key.size() > len)
+		return 1;
+	return 0;
+}
+
+VHostTable::VHostTable()
+	: _ports()
+{
+}
+
+void VHostTable::clear()
+{
+	_ports.clear();
+}
+
+bool VHostTable::validName(const std::string& name)
+{
+	std::size_t star = name.find('*');
+	if (star == std::string::npos)
+		return true;
+	if (name.find('*', star + 1) != std::string::npos)
+		return false;
+	if (star == 0)
+		return name.size() > 2 && name[1] == '.';
+	return star == name.size() - 1 && name.size() > 2 && name[star - 1] == '.';
+}
+
+std::size_t VHostTable::hash(const char* s, std::size_t len)
+{
+	// FNV-1a over the lowercased bytes
+	std::size_t h = static_cast<std::size_t>(14695981039346656037ULL);
+	for (std::size_t i = 0; i < len; ++i)
+	{
+		h ^= lower(s[i]);
+		h *= static_cast<std::size_t>(1099511628211ULL);
+	}
+	return h;
+}
+
+void VHostTable::addExact(Port& port, const std::string& name, std::size_t server)
+{
+	if ((port.used + 1) * 2 > port.slots.size())
+	{
+		std::vector<Slot> old;
+		old.swap(port.slots);
+		port.slots.assign(old.empty() ? 16 : old.size() * 2, Slot());
+		port.used = 0;
+		for (std::size_t i = 0; i < old.size(); ++i)
+		{
+			if (old[i].server >= 0)
+				addExact(port, old[i].name, static_cast<std::size_t>(old[i].server));
+		}
+	}
+
+	std::size_t h = hash(name.data(), name.size());
+	std::size_t mask = port.slots.size() - 1;
+	std::size_t i = h & mask;
+	while (port.slots[i].server >= 0)
+	{
+		if (port.slots[i].hash == h && port.slots[i].name == name)
+			return;
+		i = (i + 1) & mask;
+	}
+	port.slots[i].name = name;
+	port.slots[i].hash = h;
+	port.slots[i].server = static_cast<long>(server);
+	++port.used;
+}
+
+std::size_t VHostTable::findChild(const std::vector<Node>& nodes, std::size_t node, const char* label, std::size_t len)
+{
+	const std::vector<std::pair<std::string, std::size_t> >& ch = nodes[node].children;
+
+	std::size_t lo = 0;
+	std::size_t hi = ch.size();
+	while (lo < hi)
+	{
+		std::size_t mid = lo + (hi - lo) / 2;
+		int c = compareLabel(ch[mid].first, label, len);
+		if (c == 0)
+			return ch[mid].second;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NO_NODE;
+}
+
+std::size_t VHostTable::childFor(std::vector<Node>& nodes, std::size_t node, const std::string& label)
+{
+	std::size_t next = findChild(nodes, node, label.data(), label.size());
+	if (next != NO_NODE)
+		return next;
+
+	next = nodes.size();
+	nodes.push_back(Node());
+
+	std::vector<std::pair<std::string, std::size_t> >& ch = nodes[node].children;
+	std::size_t at = 0;
+	while (at < ch.size() && ch[at].first < label)
+		++at;
+	ch.insert(ch.begin() + static_cast<std::ptrdiff_t>(at), std::make_pair(label, next));
+	return next;
+}
+
+void VHostTable::add(unsigned short port, const std::string& name, std::size_t server)
+{
+	if (name.empty() || !validName(name))
+		return;
+
+	Port& p = _ports[port];
+	long srv = static_cast<long>(server);
+
+	// "*.example.com" / ".example.com": com -> example in the suffix trie
+	if (name[0] == '*' || name[0] == '.')
+	{
+		std::size_t from = (name[0] == '*' ? 2 : 1);
+		std::size_t node = 0;
+		std::size_t end = name.size();
+		while (end > from)
+		{
+			std::size_t dot = name.rfind('.', end - 1);
+			std::size_t start = (dot == std::string::npos || dot < from) ? from : dot + 1;
+			node = childFor(p.suffix, node, name.substr(start, end - start));
+			if (start == from)
+				break;
+			end = dot;
+		}
+
+		long& slot = (name[0] == '*' ? p.suffix[node].wildcard : p.suffix[node].dotted);
+		if (slot < 0)
+			slot = srv;
+		return;
+	}
+
+	// "www.example.*": www -> example in the prefix trie
+	if (name[name.size() - 1] == '*')
+	{
+		std::size_t node = 0;
+		std::size_t pos = 0;
+		std::size_t stop = name.size() - 2;
+		while (pos < stop)
+		{
+			std::size_t dot = name.find('.', pos);
+			if (dot == std::string::npos || dot > stop)
+				dot = stop;
+			node = childFor(p.prefix, node, name.substr(pos, dot - pos));
+			pos = dot + 1;
+		}
+		if (p.prefix[node].wildcard < 0)
+			p.prefix[node].wildcard = srv;
+		return;
+	}
+
+	addExact(p, name, server);
+}
+
+long VHostTable::findExact(const Port& port, const char* host, std::size_t len)
+{
+	if (port.slots.empty())
+		return -1;
+
+	std::size_t h = hash(host, len);
+	std::size_t mask = port.slots.size() - 1;
+	std::size_t i = h & mask;
+	while (port.slots[i].server >= 0)
+	{
+		const Slot& s = port.slots[i];
+		if (s.hash == h && compareLabel(s.name, host, len) == 0)
+			return s.server;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+long VHostTable::findSuffix(const Port& port, const char* host, std::size_t len)
+{
+	if (port.suffix[0].children.empty())
+		return -1;
+
+	long best = -1;
+	std::size_t node = 0;
+	std::size_t end = len;
+	while (end > 0)
+	{
+		std::size_t start = end;
+		while (start > 0 && host[start - 1] != '.')
+			--start;
+
+		node = findChild(port.suffix, node, host + start, end - start);
+		if (node == NO_NODE)
+			break;
+
+		const Node& n = port.suffix[node];
+		if (start > 0)
+		{
+			// more labels to the left
+			if (n.wildcard >= 0)
+				best = n.wildcard;
+			else if (n.dotted >= 0)
+				best = n.dotted;
+		}
+		else if (n.dotted >= 0)
+			best = n.dotted;
+
+		if (start == 0)
+			break;
+		end = start - 1;
+	}
+	return best;
+}
+
+long VHostTable::findPrefix(const Port& port, const char* host, std::size_t len)
+{
+	if (port.prefix[0].children.empty())
+		return -1;
+
+	long best = -1;
+	std::size_t node = 0;
+	std::size_t pos = 0;
+	while (pos < len)
+	{
+		std::size_t dot = pos;
+		while (dot < len && host[dot] != '.')
+			++dot;
+
+		node = findChild(port.prefix, node, host + pos, dot - pos);
+		if (node == NO_NODE || dot == len)
+			break;
+
+		// "www.example.*" wants at least one label after "example"
+		if (port.prefix[node].wildcard >= 0)
+			best = port.prefix[node].wildcard;
+		pos = dot + 1;
+	}
+	return best;
+}
+
+long VHostTable::find(unsigned short port, const char* host, std::size_t len) const
+{
+	// "example.com." is "example.com"
+	if (len > 0 && host[len - 1] == '.')
+		--len;
+	if (len == 0)
+		return -1;
+
+	std::map<unsigned short, Port>::const_iterator it = _ports.find(port);
+	if (it == _ports.end())
+		return -1;
+
+	long s = findExact(it->second, host, len);
+	if (s < 0)
+		s = findSuffix(it->second, host, len);
+	if (s < 0)
+		s = findPrefix(it->second, host, len);
+	return s;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+// server_name lookup, built when the config is loaded. Per listening port,
+// exact names sit in an open-addressing hash table, "*.example.com" and
+// ".example.com" in a trie of labels read from the right, "www.example.*"
+// in one read from the left. The Host bytes are hashed and compared in
+// place, case-insensitively, so a lookup allocates nothing.
+// Order is nginx's: exact name, longest "*." wildcard, longest ".*"
+// wildcard; within one kind the first server declaring a name keeps it.
+class VHostTable
+{
+public:
+	VHostTable();
+
+	void clear();
+
+	// name is lowercase, as left by the config parser
+	void add(unsigned short port, const std::string& name, std::size_t server);
+
+	// server for host (no port, any case) on port, -1 if no name matches
+	long find(unsigned short port, const char* host, std::size_t len) const;
+
+	// a name add() can take: no '*' but a leading "*." or a trailing ".*"
+	static bool validName(const std::string& name);
+
+private:
+	struct Slot
+	{
+		std::string name;
+		std::size_t hash;
+		long server;
+
+		Slot() : name(), hash(0), server(-1) {}
+	};
+
+	struct Node
+	{
+		// "*.<labels to here>" (one label or more below) and
+		// ".<labels to here>" (this node too); for the prefix trie only
+		// wildcard is used, "<labels to here>.*"
+		long wildcard;
+		long dotted;
+		// sorted by label
+		std::vector<std::pair<std::string, std::size_t> > children;
+
+		Node() : wildcard(-1), dotted(-1), children() {}
+	};
+
+	struct Port
+	{
+		// power of two in size, at most half full
+		std::vector<Slot> slots;
+		std::size_t used;
+		std::vector<Node> suffix;
+		std::vector<Node> prefix;
+
+		Port() : slots(), used(0), suffix(1), prefix(1) {}
+	};
+
+	std::map<unsigned short, Port> _ports;
+
+	static std::size_t hash(const char* s, std::size_t len);
+	static void addExact(Port& port, const std::string& name, std::size_t server);
+	static std::size_t childFor(std::vector<Node>& nodes, std::size_t node, const std::string& label);
+	static std::size_t findChild(const std::vector<Node>& nodes, std::size_t node, const char* label, std::size_t len);
+	static long findExact(const Port& port, const char* host, std::size_t len);
+	static long findSuffix(const Port& port, const char* host, std::size_t len);
+	static long findPrefix(const Port& port, const char* host, std::size_t len);
+};
@@ -0,0 +1,158 @@
+#include "cgi/CgiCache.hpp"
+
+#include <cctype>
+#include <cstdio>
+
+static std::string envValue(const std::vector<std::string>& env, const std::string& name)
+{
+	for (std::size_t i = 0; i < env.size(); ++i)
+	{
+		const std::string& e = env[i];
+		if (e.size() > name.size() && e[name.size()] == '=' && e.compare(0, name.size(), name) == 0)
+			return e.substr(name.size() + 1);
+	}
+	return "";
+}
+
+static std::string headerEnvName(const std::string& header)
+{
+	std::string r = "HTTP_";
+	for (std::size_t i = 0; i < header.size(); ++i)
+	{
+		unsigned char c = static_cast<unsigned char>(header[i]);
+		if (c == '-')
+			r.push_back('_');
+		else
+			r.push_back(static_cast<char>(std::toupper(c)));
+	}
+	return r;
+}
+
+// FNV-1a, 64 bit
+static std::string hashBody(const std::string& body)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < body.size(); ++i)
+	{
+		h ^= static_cast<unsigned char>(body[i]);
+		h *= 1099511628211ULL;
+	}
+
+	char buf[17];
+	std::snprintf(buf, sizeof(buf), "%016llx", h);
+	return std::string(buf);
+}
+
+CgiCache::CgiCache()
+	: _entries()
+	, _hits(0)
+	, _misses(0)
+	, _stale(0)
+{
+}
+
+std::string CgiCache::makeKey(
+	const std::string& scriptPath,
+	const std::string& method,
+	const std::vector<std::string>& env,
+	const std::string& body,
+	const std::vector<std::string>& keyHeaders
+)
+{
+	std::string key;
+	key.reserve(128);
+
+	key += scriptPath;
+	key.push_back('\0');
+	key += method;
+	key.push_back('\0');
+	key += envValue(env, "QUERY_STRING");
+	key.push_back('\0');
+	key += std::to_string(body.size());
+	key.push_back(':');
+	key += hashBody(body);
+
+	for (std::size_t i = 0; i < keyHeaders.size(); ++i)
+	{
+		key.push_back('\0');
+		key += envValue(env, headerEnvName(keyHeaders[i]));
+	}
+
+	return key;
+}
+
+CgiCache::Lookup CgiCache::lookup(const std::string& key, HttpResponse& out)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	if (it == _entries.end())
+	{
+		++_misses;
+		return MISS;
+	}
+
+	if (std::chrono::steady_clock::now() >= it->second.expires)
+	{
+		_entries.erase(it);
+		++_stale;
+		return STALE;
+	}
+
+	out = it->second.response;
+	++_hits;
+	return HIT;
+}
+
+void CgiCache::store(const std::string& key, const HttpResponse& res, std::size_t ttlSeconds)
+{
+	if (ttlSeconds == 0 || res.body.size() > MAX_BODY)
+		return;
+
+	if (_entries.size() >= MAX_ENTRIES && _entries.find(key) == _entries.end())
+		evict();
+
+	Entry& e = _entries[key];
+	e.response = res;
+	e.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttlSeconds);
+}
+
+// Drop everything expired; if that frees nothing, the entry closest to expiry.
+void CgiCache::evict()
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::map<std::string, Entry>::iterator oldest = _entries.end();
+
+	for (std::map<std::string, Entry>::iterator it = _entries.begin(); it != _entries.end(); )
+	{
+		if (now >= it->second.expires)
+		{
+			_entries.erase(it++);
+			continue;
+		}
+		if (oldest == _entries.end() || it->second.expires < oldest->second.expires)
+			oldest = it;
+		++it;
+	}
+
+	if (_entries.size() >= MAX_ENTRIES && oldest != _entries.end())
+		_entries.erase(oldest);
+}
+
+std::size_t CgiCache::hits() const
+{
+	return _hits;
+}
+
+std::size_t CgiCache::misses() const
+{
+	return _misses;
+}
+
+std::size_t CgiCache::stale() const
+{
+	return _stale;
+}
+
+std::size_t CgiCache::size() const
+{
+	return _entries.size();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstddef>
+#include "http/HttpResponse.hpp"
+
+// In-memory cache of CGI responses (cgi_cache_valid).
+class CgiCache
+{
+public:
+	enum Lookup
+	{
+		MISS,
+		HIT,
+		STALE
+	};
+
+	static const std::size_t MAX_ENTRIES = 1024;
+	static const std::size_t MAX_BODY = 1024 * 1024;
+
+	CgiCache();
+
+	// script + method + query + body hash + the configured request headers
+	static std::string makeKey(
+		const std::string& scriptPath,
+		const std::string& method,
+		const std::vector<std::string>& env,
+		const std::string& body,
+		const std::vector<std::string>& keyHeaders
+	);
+
+	Lookup lookup(const std::string& key, HttpResponse& out);
+	void store(const std::string& key, const HttpResponse& res, std::size_t ttlSeconds);
+
+	std::size_t hits() const;
+	std::size_t misses() const;
+	std::size_t stale() const;
+	std::size_t size() const;
+
+private:
+	struct Entry
+	{
+		HttpResponse response;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	std::map<std::string, Entry> _entries;
+	std::size_t _hits;
+	std::size_t _misses;
+	std::size_t _stale;
+
+	void evict();
+};
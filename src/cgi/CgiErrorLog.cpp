@@ -0,0 +1,84 @@
+#include "cgi/CgiErrorLog.hpp"
+#include "core/Logger.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+CgiErrorLog::CgiErrorLog()
+	: _fd(-1)
+	, _path()
+	, _pending()
+	, _dropped(0)
+{
+}
+
+CgiErrorLog::~CgiErrorLog()
+{
+	flush();
+	if (_fd >= 0)
+		::close(_fd);
+}
+
+bool CgiErrorLog::open(const std::string& path)
+{
+	_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+	if (_fd < 0)
+		return false;
+
+	_path = path;
+	return true;
+}
+
+bool CgiErrorLog::isOpen() const
+{
+	return _fd >= 0;
+}
+
+void CgiErrorLog::write(const std::string& line)
+{
+	if (_pending.size() + line.size() + 1 > MAX_PENDING)
+	{
+		++_dropped;
+		return;
+	}
+
+	_pending += line;
+	_pending.push_back('\n');
+
+	if (_pending.size() >= FLUSH_AT)
+		flush();
+}
+
+void CgiErrorLog::flush()
+{
+	if (_fd < 0)
+		return;
+
+	if (_dropped > 0 && _pending.size() + 64 <= MAX_PENDING)
+	{
+		_pending += "[webserv] " + std::to_string(_dropped) + " line(s) dropped, log writer behind\n";
+		_dropped = 0;
+	}
+
+	std::size_t off = 0;
+	while (off < _pending.size())
+	{
+		ssize_t n = ::write(_fd, _pending.data() + off, _pending.size() - off);
+		if (n > 0)
+		{
+			off += static_cast<std::size_t>(n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+
+		Logger::error("cgi_error_log write failed: " + _path);
+		off = _pending.size();
+		break;
+	}
+
+	_pending.erase(0, off);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// cgi_error_log: append-only file fed with CGI stderr lines. Lines are
+// batched in memory and written with non-blocking write() from the event
+// loop, so a chatty script never stalls it on a log write.
+class CgiErrorLog
+{
+public:
+	static const std::size_t FLUSH_AT = 64 * 1024;
+	static const std::size_t MAX_PENDING = 1024 * 1024;
+
+	CgiErrorLog();
+	~CgiErrorLog();
+
+	bool open(const std::string& path);
+	bool isOpen() const;
+
+	void write(const std::string& line);
+	void flush();
+
+private:
+	int _fd;
+	std::string _path;
+	std::string _pending;
+	std::size_t _dropped;
+
+	CgiErrorLog(const CgiErrorLog&);
+	CgiErrorLog& operator=(const CgiErrorLog&);
+};
+
+// The stderr of one backend (forked script, pool worker, FastCGI request)
+// on its way to the cgi_error_log of serverIndex, line by line and capped
+// at cgi_stderr_limit bytes.
+struct CgiStderrStream
+{
+	std::size_t serverIndex;
+	std::string prefix;    // "[pid 12 req 3] "
+	std::string partial;   // unfinished line
+	std::size_t logged;
+	std::size_t dropped;
+
+	CgiStderrStream()
+		: serverIndex(0)
+		, prefix()
+		, partial()
+		, logged(0)
+		, dropped(0)
+	{
+	}
+};
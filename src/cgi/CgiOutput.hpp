@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// CGI stdout on its way to the client, from a forked script or a FastCGI
+// request. Up to cgi_output_buffer_size it stays in buffer; past it buffer
+// keeps only the CGI header block and the body goes to spillFd (unlinked
+// temp file). outputSize counts it all against cgi_max_output_size.
+struct CgiOutput
+{
+	std::string buffer;
+	int spillFd;
+	std::size_t spillSize;
+	std::size_t outputSize;
+
+	CgiOutput()
+		: buffer()
+		, spillFd(-1)
+		, spillSize(0)
+		, outputSize(0)
+	{
+	}
+};
@@ -1,24 +1,44 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <chrono>
 #include <cstddef>
 #include <sys/types.h>
 
+#include "http/HttpParser.hpp"
+#include "cgi/CgiErrorLog.hpp"
+#include "cgi/CgiOutput.hpp"
+
+struct LocationConfig;
+
 struct CgiProcess
 {
 	pid_t pid;
 	int clientFd;
+	unsigned long long requestId;   // prefixes its stderr lines
+
+	std::size_t serverIndex;
+	const LocationConfig* location;
 
 	int stdinFd;
 	int stdoutFd;
 	int stderrFd;
+	int pidFd;   // pidfd_open(): readable once the child exits, -1 if unsupported
 
 	std::string stdinBuffer;
 	std::size_t stdinOffset;
 
-	std::string stdoutBuffer;
-	std::string stderrBuffer;
+	// cgi_stream_body: stdin stays open until the whole body has arrived
+	bool stdinStreaming;
+	bool streamChunked;
+	std::size_t streamLeft;
+	std::size_t streamReceived;
+	bool clientPaused;
+	ChunkedDecoder decoder;
+
+	CgiOutput output;
+	CgiStderrStream stderrLog;
 
 	std::string method;
 	std::string version;
@@ -29,19 +49,31 @@ struct CgiProcess
 
 	bool exited;
 	int exitStatus;
+	bool timedOut;   // SIGKILLed by checkCgiTimeouts
+	bool killedByServer;   // any SIGKILL of ours, so it is not blamed on a limit
 
 	std::chrono::steady_clock::time_point startTime;
 
 	CgiProcess()
 		: pid(-1)
 		, clientFd(-1)
+		, requestId(0)
+		, serverIndex(0)
+		, location(0)
 		, stdinFd(-1)
 		, stdoutFd(-1)
 		, stderrFd(-1)
+		, pidFd(-1)
 		, stdinBuffer()
 		, stdinOffset(0)
-		, stdoutBuffer()
-		, stderrBuffer()
+		, stdinStreaming(false)
+		, streamChunked(false)
+		, streamLeft(0)
+		, streamReceived(0)
+		, clientPaused(false)
+		, decoder()
+		, output()
+		, stderrLog()
 		, method()
 		, version()
 		, stdinClosed(false)
@@ -49,7 +81,48 @@ struct CgiProcess
 		, stderrClosed(false)
 		, exited(false)
 		, exitStatus(0)
+		, timedOut(false)
+		, killedByServer(false)
 		, startTime(std::chrono::steady_clock::now())
 	{
 	}
 };
+
+// A CGI request that has not been forked yet (waiting for a cgi_max_concurrent slot).
+struct CgiLaunch
+{
+	int clientFd;
+	std::size_t serverIndex;
+	const LocationConfig* location;
+
+	std::string interpreter;
+	std::string scriptPath;
+	std::vector<std::string> env;
+	std::string body;
+
+	std::string method;
+	std::string version;
+
+	bool streamBody;
+	bool bodyChunked;
+	std::size_t bodyLength;
+
+	std::chrono::steady_clock::time_point queuedAt;
+
+	CgiLaunch()
+		: clientFd(-1)
+		, serverIndex(0)
+		, location(0)
+		, interpreter()
+		, scriptPath()
+		, env()
+		, body()
+		, method()
+		, version()
+		, streamBody(false)
+		, bodyChunked(false)
+		, bodyLength(0)
+		, queuedAt(std::chrono::steady_clock::now())
+	{
+	}
+};
@@ -2,7 +2,10 @@
 #include "http/HttpRequest.hpp"
 
 #include <unistd.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <cstring>
@@ -68,6 +71,143 @@ static std::vector<char*> buildEnvp(const std::vector<std::string>& env)
 	return envp;
 }
 
+static bool openPipes(int inPipe[2], int outPipe[2], int errPipe[2])
+{
+	// O_CLOEXEC: a child must only keep the three ends dup2'ed onto 0/1/2,
+	// never the pipes of other CGI processes or pool workers.
+	if (::pipe2(inPipe, O_CLOEXEC) < 0)
+		return false;
+	if (::pipe2(outPipe, O_CLOEXEC) < 0)
+	{
+		closeIfValid(inPipe[0]);
+		closeIfValid(inPipe[1]);
+		return false;
+	}
+	if (::pipe2(errPipe, O_CLOEXEC) < 0)
+	{
+		closeIfValid(inPipe[0]);
+		closeIfValid(inPipe[1]);
+		closeIfValid(outPipe[0]);
+		closeIfValid(outPipe[1]);
+		return false;
+	}
+	return true;
+}
+
+static void closePipes(int inPipe[2], int outPipe[2], int errPipe[2])
+{
+	closeIfValid(inPipe[0]);
+	closeIfValid(inPipe[1]);
+	closeIfValid(outPipe[0]);
+	closeIfValid(outPipe[1]);
+	closeIfValid(errPipe[0]);
+	closeIfValid(errPipe[1]);
+}
+
+struct ChildSetup
+{
+	char* const* argv;
+	char* const* envp;
+	int stdinFd;
+	int stdoutFd;
+	int stderrFd;
+	const sigset_t* sigmask;
+	const CgiRunner::Limits* limits;
+};
+
+static bool setLimit(int resource, rlim_t soft, rlim_t hard)
+{
+	struct rlimit rl;
+	rl.rlim_cur = soft;
+	rl.rlim_max = hard;
+	return ::setrlimit(resource, &rl) == 0;
+}
+
+// The CPU hard limit is one second past the soft one: SIGXCPU first, so the
+// exit can be told apart from our own SIGKILL.
+static bool applyLimits(const CgiRunner::Limits& l)
+{
+	if (l.cpuSeconds > 0 && !setLimit(RLIMIT_CPU, l.cpuSeconds, l.cpuSeconds + 1))
+		return false;
+	if (l.addressSpace > 0 && !setLimit(RLIMIT_AS, l.addressSpace, l.addressSpace))
+		return false;
+	if (l.openFiles > 0 && !setLimit(RLIMIT_NOFILE, l.openFiles, l.openFiles))
+		return false;
+	if (l.nice != 0 && ::setpriority(PRIO_PROCESS, 0, l.nice) < 0)
+		return false;
+	return true;
+}
+
+// Runs in the clone()d child on spawnStack, sharing the parent's memory while
+// the parent is suspended: only raw syscalls here, nothing that allocates.
+static int childMain(void* arg)
+{
+	const ChildSetup* cs = static_cast<const ChildSetup*>(arg);
+
+	::dup2(cs->stdinFd, STDIN_FILENO);
+	::dup2(cs->stdoutFd, STDOUT_FILENO);
+	::dup2(cs->stderrFd, STDERR_FILENO);
+
+	// SIG_IGN survives execve; the script should see a normal SIGPIPE.
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	::sigaction(SIGPIPE, &sa, 0);
+
+	if (!applyLimits(*cs->limits))
+		::_exit(CgiRunner::LIMITS_FAILED);
+
+	::sigprocmask(SIG_SETMASK, cs->sigmask, 0);
+
+	::execve(cs->argv[0], cs->argv, cs->envp);
+	::_exit(127);
+}
+
+alignas(16) static char spawnStack[64 * 1024];
+
+// fork() would copy the page tables of the whole server, so spawn cost grew
+// with RSS (caches, big buffers). CLONE_VM|CLONE_VFORK runs the child in our
+// address space until execve, like posix_spawn, so the cost stays flat.
+// argv/envp are fully built here, before the clone.
+static pid_t launchChild(
+	const std::string& interpreter,
+	const std::string& scriptPath,
+	const std::vector<std::string>& env,
+	int stdinFd,
+	int stdoutFd,
+	int stderrFd,
+	const CgiRunner::Limits& limits
+)
+{
+	std::vector<char*> envp = buildEnvp(env);
+
+	char* argv[3];
+	argv[0] = const_cast<char*>(interpreter.c_str());
+	argv[1] = const_cast<char*>(scriptPath.c_str());
+	argv[2] = 0;
+
+	// Handlers must not run in the child on our memory before execve.
+	sigset_t all;
+	sigset_t old;
+	::sigfillset(&all);
+	::pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	ChildSetup cs;
+	cs.argv = argv;
+	cs.envp = envp.data();
+	cs.stdinFd = stdinFd;
+	cs.stdoutFd = stdoutFd;
+	cs.stderrFd = stderrFd;
+	cs.sigmask = &old;
+	cs.limits = &limits;
+
+	pid_t pid = ::clone(childMain, spawnStack + sizeof(spawnStack),
+		CLONE_VM | CLONE_VFORK | SIGCHLD, &cs);
+
+	::pthread_sigmask(SIG_SETMASK, &old, 0);
+	return pid;
+}
+
 static bool readAllFd(int fd, std::string& out)
 {
 	char buf[4096];
@@ -87,7 +227,7 @@ static bool readAllFd(int fd, std::string& out)
 	}
 }
 
-static void buildCgiEnv(
+void CgiRunner::buildEnv(
 	const std::string& scriptPath,
 	const HttpRequest& req,
 	const std::map<std::string, std::string>& envExtra,
@@ -147,6 +287,29 @@ bool CgiRunner::spawn(
 	const std::map<std::string, std::string>& envExtra,
 	Spawned& out
 )
+{
+	std::vector<std::string> env;
+	buildEnv(scriptPath, req, envExtra, env);
+	return spawnWithEnv(interpreter, scriptPath, env, Limits(), out);
+}
+
+bool CgiRunner::spawnWithEnv(
+	const std::string& interpreter,
+	const std::string& scriptPath,
+	const std::vector<std::string>& env,
+	Spawned& out
+)
+{
+	return spawnWithEnv(interpreter, scriptPath, env, Limits(), out);
+}
+
+bool CgiRunner::spawnWithEnv(
+	const std::string& interpreter,
+	const std::string& scriptPath,
+	const std::vector<std::string>& env,
+	const Limits& limits,
+	Spawned& out
+)
 {
 	int inPipe[2] = {-1, -1};
 	int outPipe[2] = {-1, -1};
@@ -157,62 +320,16 @@ bool CgiRunner::spawn(
 	out.stdoutFd = -1;
 	out.stderrFd = -1;
 
-	if (::pipe(inPipe) < 0)
-		return false;
-	if (::pipe(outPipe) < 0)
-	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		return false;
-	}
-	if (::pipe(errPipe) < 0)
-	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		closeIfValid(outPipe[0]);
-		closeIfValid(outPipe[1]);
+	if (!openPipes(inPipe, outPipe, errPipe))
 		return false;
-	}
 
-	pid_t pid = ::fork();
+	pid_t pid = launchChild(interpreter, scriptPath, env, inPipe[0], outPipe[1], errPipe[1], limits);
 	if (pid < 0)
 	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		closeIfValid(outPipe[0]);
-		closeIfValid(outPipe[1]);
-		closeIfValid(errPipe[0]);
-		closeIfValid(errPipe[1]);
+		closePipes(inPipe, outPipe, errPipe);
 		return false;
 	}
 
-	if (pid == 0)
-	{
-		::dup2(inPipe[0], STDIN_FILENO);
-		::dup2(outPipe[1], STDOUT_FILENO);
-		::dup2(errPipe[1], STDERR_FILENO);
-
-		::close(inPipe[0]);
-		::close(inPipe[1]);
-		::close(outPipe[0]);
-		::close(outPipe[1]);
-		::close(errPipe[0]);
-		::close(errPipe[1]);
-
-		std::vector<std::string> env;
-		buildCgiEnv(scriptPath, req, envExtra, env);
-
-		std::vector<char*> envp = buildEnvp(env);
-
-		char* argv[3];
-		argv[0] = const_cast<char*>(interpreter.c_str());
-		argv[1] = const_cast<char*>(scriptPath.c_str());
-		argv[2] = 0;
-
-		::execve(argv[0], argv, envp.data());
-		::_exit(127);
-	}
-
 	closeIfValid(inPipe[0]);
 	closeIfValid(outPipe[1]);
 	closeIfValid(errPipe[1]);
@@ -225,6 +342,25 @@ bool CgiRunner::spawn(
 	return true;
 }
 
+std::string CgiRunner::buildWorkerFrame(const std::vector<std::string>& env, std::size_t bodyLen)
+{
+	std::string block;
+	for (std::size_t i = 0; i < env.size(); ++i)
+	{
+		block += env[i];
+		block.push_back('\0');
+	}
+
+	std::string frame;
+	frame.reserve(32 + block.size());
+	frame += std::to_string(block.size());
+	frame += " ";
+	frame += std::to_string(bodyLen);
+	frame += "\n";
+	frame += block;
+	return frame;
+}
+
 bool CgiRunner::run(
 	const std::string& interpreter,
 	const std::string& scriptPath,
@@ -237,66 +373,23 @@ bool CgiRunner::run(
 	out.stderrData.clear();
 	out.exitCode = 1;
 
+	std::vector<std::string> env;
+	buildEnv(scriptPath, req, envExtra, env);
+
 	int inPipe[2] = {-1, -1};
 	int outPipe[2] = {-1, -1};
 	int errPipe[2] = {-1, -1};
 
-	if (::pipe(inPipe) < 0)
-		return false;
-	if (::pipe(outPipe) < 0)
-	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		return false;
-	}
-	if (::pipe(errPipe) < 0)
-	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		closeIfValid(outPipe[0]);
-		closeIfValid(outPipe[1]);
+	if (!openPipes(inPipe, outPipe, errPipe))
 		return false;
-	}
 
-	pid_t pid = ::fork();
+	pid_t pid = launchChild(interpreter, scriptPath, env, inPipe[0], outPipe[1], errPipe[1], Limits());
 	if (pid < 0)
 	{
-		closeIfValid(inPipe[0]);
-		closeIfValid(inPipe[1]);
-		closeIfValid(outPipe[0]);
-		closeIfValid(outPipe[1]);
-		closeIfValid(errPipe[0]);
-		closeIfValid(errPipe[1]);
+		closePipes(inPipe, outPipe, errPipe);
 		return false;
 	}
 
-	if (pid == 0)
-	{
-		::dup2(inPipe[0], STDIN_FILENO);
-		::dup2(outPipe[1], STDOUT_FILENO);
-		::dup2(errPipe[1], STDERR_FILENO);
-
-		::close(inPipe[0]);
-		::close(inPipe[1]);
-		::close(outPipe[0]);
-		::close(outPipe[1]);
-		::close(errPipe[0]);
-		::close(errPipe[1]);
-
-		std::vector<std::string> env;
-		buildCgiEnv(scriptPath, req, envExtra, env);
-
-		std::vector<char*> envp = buildEnvp(env);
-
-		char* argv[3];
-		argv[0] = const_cast<char*>(interpreter.c_str());
-		argv[1] = const_cast<char*>(scriptPath.c_str());
-		argv[2] = 0;
-
-		::execve(argv[0], argv, envp.data());
-		::_exit(127);
-	}
-
 	closeIfValid(inPipe[0]);
 	closeIfValid(outPipe[1]);
 	closeIfValid(errPipe[1]);
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <sys/types.h>
 
 struct HttpRequest;
@@ -18,6 +19,20 @@ public:
 		Result() : exitCode(0), stdoutData(), stderrData() {}
 	};
 
+	// setrlimit()/setpriority() in the child before exec; 0 = inherit
+	struct Limits
+	{
+		std::size_t cpuSeconds;
+		std::size_t addressSpace;
+		std::size_t openFiles;
+		int nice;
+
+		Limits() : cpuSeconds(0), addressSpace(0), openFiles(0), nice(0) {}
+	};
+
+	// exit status of a child whose limits could not be applied
+	static const int LIMITS_FAILED = 126;
+
 	struct Spawned
 	{
 		pid_t pid;
@@ -43,4 +58,32 @@ public:
 		const std::map<std::string, std::string>& envExtra,
 		Spawned& out
 	);
+
+	// Same as spawn(), with the environment already built by the caller.
+	static bool spawnWithEnv(
+		const std::string& interpreter,
+		const std::string& scriptPath,
+		const std::vector<std::string>& env,
+		Spawned& out
+	);
+
+	static bool spawnWithEnv(
+		const std::string& interpreter,
+		const std::string& scriptPath,
+		const std::vector<std::string>& env,
+		const Limits& limits,
+		Spawned& out
+	);
+
+	// Request frame for a cgi_pool worker: "<envLen> <bodyLen>\n" + NUL-separated env.
+	// The body itself is written right after it.
+	static std::string buildWorkerFrame(const std::vector<std::string>& env, std::size_t bodyLen);
+
+	// CGI/1.1 meta-variables as "KEY=value" (also used for FastCGI PARAMS)
+	static void buildEnv(
+		const std::string& scriptPath,
+		const HttpRequest& req,
+		const std::map<std::string, std::string>& envExtra,
+		std::vector<std::string>& envOut
+	);
 };
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <chrono>
+#include <cstddef>
+#include <sys/types.h>
+
+#include "cgi/CgiErrorLog.hpp"
+
+// One pre-forked interpreter waiting on its control pipe (cgi_pool).
+struct CgiWorker
+{
+	pid_t pid;
+	std::string poolKey;
+
+	int ctlFd;   // requests -> worker stdin
+	int outFd;   // replies  <- worker stdout
+	int errFd;   // stray output <- worker stderr
+	CgiStderrStream stderrLog;
+
+	bool busy;
+	std::size_t served;
+
+	int clientFd;
+	std::string method;
+	std::string version;
+
+	std::string outBuffer;   // frame header + env block
+	std::string outBody;     // request body, written right after outBuffer
+	std::size_t outOffset;   // across outBuffer then outBody
+	std::string inBuffer;
+
+	std::chrono::steady_clock::time_point startTime;
+
+	CgiWorker()
+		: pid(-1)
+		, poolKey()
+		, ctlFd(-1)
+		, outFd(-1)
+		, errFd(-1)
+		, stderrLog()
+		, busy(false)
+		, served(0)
+		, clientFd(-1)
+		, method()
+		, version()
+		, outBuffer()
+		, outBody()
+		, outOffset(0)
+		, inBuffer()
+		, startTime(std::chrono::steady_clock::now())
+	{
+	}
+};
+
+struct CgiPoolJob
+{
+	int clientFd;
+	std::string frame;
+	std::string body;
+	std::string method;
+	std::string version;
+	std::chrono::steady_clock::time_point queuedAt;
+
+	CgiPoolJob()
+		: clientFd(-1)
+		, frame()
+		, body()
+		, method()
+		, version()
+		, queuedAt(std::chrono::steady_clock::now())
+	{
+	}
+};
+
+struct CgiWorkerPool
+{
+	std::string interpreter;
+	std::string bootstrap;
+	std::size_t serverIndex;   // whose cgi_error_log gets the stderr
+	std::size_t size;
+	std::size_t maxRequests;
+
+	std::size_t workers;
+	std::size_t failedStarts;
+	bool disabled;
+
+	std::deque<CgiPoolJob> waiting;
+
+	CgiWorkerPool()
+		: interpreter()
+		, bootstrap()
+		, serverIndex(0)
+		, size(0)
+		, maxRequests(0)
+		, workers(0)
+		, failedStarts(0)
+		, disabled(false)
+		, waiting()
+	{
+	}
+};
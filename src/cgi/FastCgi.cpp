@@ -0,0 +1,138 @@
+#include "cgi/FastCgi.hpp"
+
+static const unsigned char FCGI_VERSION_1 = 1;
+static const unsigned char FCGI_RESPONDER = 1;
+static const unsigned char FCGI_KEEP_CONN = 1;
+static const std::size_t HEADER_LEN = 8;
+
+static void appendHeader(std::string& out, int type, unsigned short requestId, std::size_t contentLen, std::size_t paddingLen)
+{
+	char h[HEADER_LEN];
+
+	h[0] = static_cast<char>(FCGI_VERSION_1);
+	h[1] = static_cast<char>(type);
+	h[2] = static_cast<char>((requestId >> 8) & 0xFF);
+	h[3] = static_cast<char>(requestId & 0xFF);
+	h[4] = static_cast<char>((contentLen >> 8) & 0xFF);
+	h[5] = static_cast<char>(contentLen & 0xFF);
+	h[6] = static_cast<char>(paddingLen);
+	h[7] = 0;
+
+	out.append(h, HEADER_LEN);
+}
+
+static void appendLength(std::string& out, std::size_t len)
+{
+	if (len < 128)
+	{
+		out.push_back(static_cast<char>(len));
+		return;
+	}
+
+	out.push_back(static_cast<char>(((len >> 24) & 0x7F) | 0x80));
+	out.push_back(static_cast<char>((len >> 16) & 0xFF));
+	out.push_back(static_cast<char>((len >> 8) & 0xFF));
+	out.push_back(static_cast<char>(len & 0xFF));
+}
+
+void FastCgi::appendBeginRequest(std::string& out, unsigned short requestId, bool keepConn)
+{
+	appendHeader(out, BEGIN_REQUEST, requestId, 8, 0);
+
+	char body[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	body[1] = static_cast<char>(FCGI_RESPONDER);
+	if (keepConn)
+		body[2] = static_cast<char>(FCGI_KEEP_CONN);
+
+	out.append(body, sizeof(body));
+}
+
+void FastCgi::appendAbortRequest(std::string& out, unsigned short requestId)
+{
+	appendHeader(out, ABORT_REQUEST, requestId, 0, 0);
+}
+
+void FastCgi::appendStream(std::string& out, int type, unsigned short requestId, const char* data, std::size_t len)
+{
+	if (len == 0)
+	{
+		appendHeader(out, type, requestId, 0, 0);
+		return;
+	}
+
+	std::size_t off = 0;
+	while (off < len)
+	{
+		std::size_t n = len - off;
+		if (n > MAX_CONTENT)
+			n = MAX_CONTENT;
+
+		// keep records 8-byte aligned, as the spec recommends
+		std::size_t pad = (8 - (n % 8)) % 8;
+
+		appendHeader(out, type, requestId, n, pad);
+		out.append(data + off, n);
+		out.append(pad, '\0');
+		off += n;
+	}
+}
+
+std::string FastCgi::encodeParams(const std::vector<std::string>& env)
+{
+	std::string out;
+
+	for (std::size_t i = 0; i < env.size(); ++i)
+	{
+		const std::string& kv = env[i];
+		std::size_t eq = kv.find('=');
+		if (eq == std::string::npos || eq == 0)
+			continue;
+
+		std::size_t nameLen = eq;
+		std::size_t valueLen = kv.size() - eq - 1;
+
+		appendLength(out, nameLen);
+		appendLength(out, valueLen);
+		out.append(kv, 0, nameLen);
+		out.append(kv, eq + 1, valueLen);
+	}
+	return out;
+}
+
+bool FastCgi::takeRecord(std::string& buf, std::size_t& offset, Record& out)
+{
+	if (buf.size() < offset + HEADER_LEN)
+		return false;
+
+	const unsigned char* h = reinterpret_cast<const unsigned char*>(buf.data() + offset);
+
+	std::size_t contentLen = (static_cast<std::size_t>(h[4]) << 8) | h[5];
+	std::size_t paddingLen = h[6];
+	std::size_t total = HEADER_LEN + contentLen + paddingLen;
+
+	if (buf.size() < offset + total)
+		return false;
+
+	out.type = h[1];
+	out.requestId = static_cast<unsigned short>((h[2] << 8) | h[3]);
+	out.content.assign(buf, offset + HEADER_LEN, contentLen);
+
+	offset += total;
+	return true;
+}
+
+bool FastCgi::parseEndRequest(const std::string& content, int& appStatus, int& protocolStatus)
+{
+	if (content.size() < 8)
+		return false;
+
+	const unsigned char* b = reinterpret_cast<const unsigned char*>(content.data());
+
+	appStatus = static_cast<int>(
+		(static_cast<unsigned int>(b[0]) << 24) |
+		(static_cast<unsigned int>(b[1]) << 16) |
+		(static_cast<unsigned int>(b[2]) << 8) |
+		static_cast<unsigned int>(b[3]));
+	protocolStatus = b[4];
+	return true;
+}
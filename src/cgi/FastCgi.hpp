@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// FastCGI 1.0 wire format (records, name-value pairs).
+class FastCgi
+{
+public:
+	enum RecordType
+	{
+		BEGIN_REQUEST = 1,
+		ABORT_REQUEST = 2,
+		END_REQUEST = 3,
+		PARAMS = 4,
+		STDIN = 5,
+		STDOUT = 6,
+		STDERR = 7,
+		DATA = 8,
+		GET_VALUES = 9,
+		GET_VALUES_RESULT = 10,
+		UNKNOWN_TYPE = 11
+	};
+
+	enum ProtocolStatus
+	{
+		REQUEST_COMPLETE = 0,
+		CANT_MPX_CONN = 1,
+		OVERLOADED = 2,
+		UNKNOWN_ROLE = 3
+	};
+
+	static const std::size_t MAX_CONTENT = 65535;
+
+	struct Record
+	{
+		int type;
+		unsigned short requestId;
+		std::string content;
+
+		Record() : type(0), requestId(0), content() {}
+	};
+
+	// Responder role; keepConn asks the application not to close the connection.
+	static void appendBeginRequest(std::string& out, unsigned short requestId, bool keepConn);
+	static void appendAbortRequest(std::string& out, unsigned short requestId);
+
+	// Splits data into as many records as needed. Empty data -> one empty record (end of stream).
+	static void appendStream(std::string& out, int type, unsigned short requestId, const char* data, std::size_t len);
+
+	// "KEY=value" entries -> name-value pair block (PARAMS content).
+	static std::string encodeParams(const std::vector<std::string>& env);
+
+	// Takes one complete record from the front of buf. false if more bytes are needed.
+	static bool takeRecord(std::string& buf, std::size_t& offset, Record& out);
+
+	// END_REQUEST body
+	static bool parseEndRequest(const std::string& content, int& appStatus, int& protocolStatus);
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <cstddef>
+
+#include "cgi/CgiOutput.hpp"
+#include "cgi/CgiErrorLog.hpp"
+
+struct LocationConfig;
+
+// One persistent socket to a FastCGI application. Several requests may be
+// in flight on it at once (multiplexing), keyed by FastCGI request id.
+struct FastCgiConnection
+{
+	int fd;
+	std::string address;
+
+	bool connecting;
+	bool broken;
+
+	std::string outBuffer;
+	std::size_t outOffset;
+
+	std::string inBuffer;
+
+	// requestId -> clientFd (-1 once the client went away and the request was aborted)
+	std::map<unsigned short, int> active;
+	unsigned short nextId;
+
+	// when each aborted request was aborted: past FCGI_ABORT_GRACE without
+	// its END_REQUEST the connection is closed to free the slot
+	std::map<unsigned short, std::chrono::steady_clock::time_point> aborted;
+
+	std::chrono::steady_clock::time_point lastActivity;
+
+	FastCgiConnection()
+		: fd(-1)
+		, address()
+		, connecting(false)
+		, broken(false)
+		, outBuffer()
+		, outOffset(0)
+		, inBuffer()
+		, active()
+		, nextId(1)
+		, aborted()
+		, lastActivity(std::chrono::steady_clock::now())
+	{
+	}
+};
+
+// Per-client FastCGI request state while the client is in CGI_PENDING.
+struct FastCgiRequest
+{
+	int clientFd;
+	int connFd;
+	unsigned short requestId;
+	std::size_t serverIndex;
+	const LocationConfig* location;
+	bool retried;
+
+	std::string params;
+	std::string body;
+	std::size_t bodyOffset;
+	bool stdinDone;
+
+	// same limits as a forked script: cgi_output_buffer_size,
+	// cgi_max_output_size, cgi_error_log
+	CgiOutput output;
+	CgiStderrStream stderrLog;
+
+	std::string method;
+	std::string version;
+
+	std::chrono::steady_clock::time_point startTime;
+
+	FastCgiRequest()
+		: clientFd(-1)
+		, connFd(-1)
+		, requestId(0)
+		, serverIndex(0)
+		, location(0)
+		, retried(false)
+		, params()
+		, body()
+		, bodyOffset(0)
+		, stdinDone(false)
+		, output()
+		, stderrLog()
+		, method()
+		, version()
+		, startTime(std::chrono::steady_clock::now())
+	{
+	}
+};
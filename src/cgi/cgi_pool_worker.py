@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Persistent CGI worker for `cgi_pool`.
+#
+# The server starts this once per pool slot and feeds it requests over stdin:
+#     "<envLen> <bodyLen>\n" + NUL-separated KEY=VALUE pairs + body
+# and reads back on stdout:
+#     "<stdoutLen> <stderrLen> <exitCode>\n" + stdout + stderr
+#
+# The script named by SCRIPT_FILENAME runs in-process through runpy, so the
+# interpreter and already imported modules are reused. Scripts must talk
+# through sys.stdin/sys.stdout; raw writes to fd 1 or 2 end up in cgi_error_log
+# (the server log without one).
+# EOF on stdin means the server retired this worker.
+
+import io
+import os
+import runpy
+import sys
+import traceback
+
+
+def read_exact(stream, n):
+    data = b""
+    while len(data) < n:
+        chunk = stream.read(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def parse_env(block):
+    env = {}
+    for item in block.split(b"\0"):
+        if not item:
+            continue
+        key, _, value = item.partition(b"=")
+        env[key.decode("latin-1")] = value.decode("latin-1")
+    return env
+
+
+def run_one(env, body, base_env):
+    os.environ.clear()
+    os.environ.update(base_env)
+    os.environ.update(env)
+
+    out = io.BytesIO()
+    err = io.BytesIO()
+
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body), encoding="utf-8", errors="surrogateescape")
+    sys.stdout = io.TextIOWrapper(out, encoding="utf-8", errors="surrogateescape", write_through=True)
+    sys.stderr = io.TextIOWrapper(err, encoding="utf-8", errors="surrogateescape", write_through=True)
+
+    script = env.get("SCRIPT_FILENAME", "")
+    sys.argv = [script]
+    code = 0
+
+    try:
+        runpy.run_path(script, run_name="__main__")
+    except SystemExit as e:
+        if e.code is None:
+            code = 0
+        elif isinstance(e.code, int):
+            code = e.code
+        else:
+            sys.stderr.write(str(e.code) + "\n")
+            code = 1
+    except BaseException:
+        traceback.print_exc()
+        code = 1
+
+    sys.stdout.flush()
+    sys.stderr.flush()
+    return out.getvalue(), err.getvalue(), code
+
+
+def main():
+    control = sys.stdin.buffer
+    reply = os.fdopen(os.dup(1), "wb")
+    os.dup2(2, 1)
+
+    base_env = dict(os.environ)
+
+    while True:
+        line = control.readline()
+        if not line:
+            return 0
+
+        env_len, body_len = (int(x) for x in line.split())
+        env = parse_env(read_exact(control, env_len))
+        body = read_exact(control, body_len)
+
+        out, err, code = run_one(env, body, base_env)
+
+        reply.write(b"%d %d %d\n" % (len(out), len(err), code))
+        reply.write(out)
+        reply.write(err)
+        reply.flush()
+
+
+if __name__ == "__main__":
+    try:
+        sys.exit(main())
+    except EOFError:
+        sys.exit(0)
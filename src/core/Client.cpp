@@ -6,11 +6,21 @@ Client::Client()
 	, inBuffer()
 	, outBuffer()
 	, lastActivity(std::chrono::steady_clock::now())
-	, sessionId()
 	, serverConfigIndex(0)
 	, closeAfterWrite(false)
 	, outOffset(0)
+	, sendFd(-1)
+	, sendOffset(0)
+	, sendEnd(0)
+	, sendParts()
+	, sendPart(0)
+	, range()
+	, ifRange()
+	, location(0)
+	, acceptEncoding()
 	, listenPort(0)
+	, hostResolved(false)
+	, streamChecked(false)
 	, peerClosed(false)
 {
 }
@@ -2,7 +2,11 @@
 
 #include <string>
 #include <chrono>
+#include <sys/types.h>
 #include "core/ConnectionState.hpp"
+#include "http/HttpResponse.hpp"
+
+struct LocationConfig;
 
 struct Client
 {
@@ -12,13 +16,34 @@ struct Client
 	std::string outBuffer;
 	std::chrono::steady_clock::time_point lastActivity;
 
-	std::string sessionId;
 	std::size_t serverConfigIndex;
 
 	bool closeAfterWrite;
 	std::size_t outOffset;
 
+	// file body sent with sendfile() once outBuffer is drained; owned, -1 if none
+	int sendFd;
+	off_t sendOffset;
+	off_t sendEnd;
+	// multipart/byteranges: the parts after the range in progress, from
+	// sendParts[sendPart]; each goes out as its head, then its range
+	std::vector<BodyPart> sendParts;
+	std::size_t sendPart;
+
+	// Range / If-Range of the request waiting in CGI_PENDING
+	std::string range;
+	std::string ifRange;
+
+	// location and Accept-Encoding of that request, for gzip / brotli of
+	// the backend's response; location is 0 when it is not compressed
+	const LocationConfig* location;
+	std::string acceptEncoding;
+
 	unsigned short listenPort;
+	// serverConfigIndex already follows the Host of the current request
+	bool hostResolved;
+	// the handler looked at this request's headers for cgi_stream_body
+	bool streamChecked;
 
 	bool peerClosed;
 
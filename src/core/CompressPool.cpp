@@ -0,0 +1,141 @@
+#include "core/CompressPool.hpp"
+#include "core/Logger.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cerrno>
+
+CompressPool::CompressPool()
+	: _threads()
+	, _mutex()
+	, _cond()
+	, _queue()
+	, _done()
+	, _stopping(false)
+{
+	_pipe[0] = -1;
+	_pipe[1] = -1;
+}
+
+CompressPool::~CompressPool()
+{
+	stop();
+}
+
+bool CompressPool::start(std::size_t threads)
+{
+	if (running())
+		return true;
+
+	// both ends non-blocking: a full pipe already means "look at _done"
+	if (::pipe2(_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		_pipe[0] = -1;
+		_pipe[1] = -1;
+		return false;
+	}
+
+	_stopping = false;
+
+	// signals stay with the loop thread
+	sigset_t all;
+	sigset_t old;
+	::sigfillset(&all);
+	::pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (std::size_t i = 0; i < threads; ++i)
+		_threads.push_back(std::thread(&CompressPool::work, this));
+
+	::pthread_sigmask(SIG_SETMASK, &old, 0);
+
+	Logger::info("Compression pool started with " + std::to_string(threads) + " thread(s)");
+	return true;
+}
+
+void CompressPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_cond.notify_all();
+
+	for (std::size_t i = 0; i < _threads.size(); ++i)
+		_threads[i].join();
+	_threads.clear();
+	_queue.clear();
+	_done.clear();
+
+	if (_pipe[0] >= 0)
+		::close(_pipe[0]);
+	if (_pipe[1] >= 0)
+		::close(_pipe[1]);
+	_pipe[0] = -1;
+	_pipe[1] = -1;
+}
+
+bool CompressPool::running() const
+{
+	return !_threads.empty();
+}
+
+int CompressPool::fd() const
+{
+	return _pipe[0];
+}
+
+void CompressPool::submit(Job& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_queue.push_back(Job());
+		std::swap(_queue.back(), job);
+	}
+	_cond.notify_one();
+}
+
+void CompressPool::collect(std::vector<Job>& done)
+{
+	char buf[256];
+	while (::read(_pipe[0], buf, sizeof(buf)) > 0)
+	{
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	done.swap(_done);
+	_done.clear();
+}
+
+void CompressPool::work()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_stopping && _queue.empty())
+				_cond.wait(lock);
+			if (_stopping)
+				return;
+			std::swap(job, _queue.front());
+			_queue.pop_front();
+		}
+
+		if (!job.source.path.empty())
+			job.ok = Compression::compressFile(job.coding, job.level, job.source, job.output);
+		else
+			job.ok = Compression::compress(job.coding, job.level, job.input, job.output);
+		std::string().swap(job.input);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_done.push_back(Job());
+			std::swap(_done.back(), job);
+		}
+
+		char c = 1;
+		ssize_t n = ::write(_pipe[1], &c, 1);
+		(void)n;
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include "http/Compression.hpp"
+
+// Threads that compress response bodies too large to do on the event loop.
+// The loop polls fd(); it turns readable when finished jobs wait in
+// collect(). The threads touch nothing but the jobs handed to them.
+class CompressPool
+{
+public:
+	struct Job
+	{
+		unsigned long long id;
+		Compression::Coding coding;
+		int level;
+		// input, or the FILE body of the response when source.path is set
+		std::string input;
+		BodySource source;
+		std::string output;
+		bool ok;
+
+		Job()
+			: id(0)
+			, coding(Compression::NONE)
+			, level(0)
+			, input()
+			, source()
+			, output()
+			, ok(false)
+		{
+		}
+	};
+
+	CompressPool();
+	~CompressPool();
+
+	bool start(std::size_t threads);
+	void stop();
+	bool running() const;
+	int fd() const;
+
+	// job is moved into the queue
+	void submit(Job& job);
+	void collect(std::vector<Job>& done);
+
+private:
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::deque<Job> _queue;
+	std::vector<Job> _done;
+	bool _stopping;
+	int _pipe[2];
+
+	void work();
+
+	CompressPool(const CompressPool&);
+	CompressPool& operator=(const CompressPool&);
+};
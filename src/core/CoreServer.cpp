@@ -1,4 +1,5 @@
 #include "core/CoreServer.hpp"
+#include "http/HttpError.hpp"
 #include "core/EventLoop.hpp"
 #include "core/Logger.hpp"
 #include "http/IHttpHandler.hpp"
@@ -28,6 +29,38 @@ CoreServer::CoreServer(const std::string& configPath)
 	,_cgi()
 	,_cgiFdToPid()
 	,_cgiTimeout(std::chrono::seconds(30))
+	,_cgiQueues()
+	,_cgiActiveByServer()
+	,_cgiActiveByLocation()
+	,_cgiBusyResponses()
+	,_cgiStreamByClient()
+	,_cgiCache()
+	,_cgiCacheTickets()
+	,_cgiCacheStatsAt(std::chrono::steady_clock::now())
+	,_cgiCacheStatsSeen(0)
+	,_cgiFlights()
+	,_cgiErrorLogs()
+	,_cgiRequestSeq(0)
+	,_cgiPools()
+	,_cgiWorkers()
+	,_cgiWorkerFds()
+	,_fcgiConns()
+	,_fcgiRequests()
+	,_fcgiWaiting()
+	,_fcgiIdleTimeout(std::chrono::seconds(60))
+	,_proxyConns()
+	,_proxyRequests()
+	,_proxyIdle()
+	,_proxyBusy()
+	,_proxyDown()
+	,_proxyNext()
+	,_proxyIdleTimeout(std::chrono::seconds(60))
+	,_compressPool()
+	,_compressCache()
+	,_compressJobs()
+	,_compressByKey()
+	,_compressWaiters()
+	,_compressSeq(0)
 	,_readTimeout(std::chrono::seconds(30))
 	,_writeTimeout(std::chrono::seconds(30))
 	,_idleTimeout(std::chrono::seconds(120))
@@ -61,14 +94,51 @@ CoreServer::CoreServer(const std::string& configPath)
 			_defaultServerByPort[port]=i;
 		}
 
-		std::map<std::string,std::size_t>& hostMap=_serverByPortHost[port];
-
 		for(std::size_t j=0;j<srv.serverNames.size();++j)
 		{
-			const std::string& name=srv.serverNames[j];
-			if(!name.empty()&& hostMap.find(name)==hostMap.end())
+			_serverByPortHost.add(port,srv.serverNames[j],i);
+		}
+	}
+
+	_cgiQueues.resize(_serverConfigs.size());
+	_cgiActiveByServer.assign(_serverConfigs.size(),0);
+
+	for(std::size_t i=0;i<_serverConfigs.size();++i)
+	{
+		// error pages are read here once; errors never touch the disk after
+		HttpError::prepare(_serverConfigs[i]);
+
+		const ServerConfig& srv=_serverConfigs[i];
+
+		_cgiBusyResponses.push_back(buildCgiBusyResponse(srv));
+
+		if(srv.locationRegex.states()>0)
+		{
+			Logger::info("Regex locations of server "+std::to_string(i)+" compiled to "+std::to_string(srv.locationRegex.states())+" DFA states");
+		}
+
+		if(!srv.cgiErrorLog.empty())
+		{
+			if(!_cgiErrorLogs[i].open(srv.cgiErrorLog))
+			{
+				Logger::error("Cannot open cgi_error_log "+srv.cgiErrorLog+", CGI stderr goes to the server log");
+				_cgiErrorLogs.erase(i);
+			}
+		}
+
+		for(std::size_t j=0;j<srv.locations.size();++j)
+		{
+			const LocationConfig& loc=srv.locations[j];
+
+			for(std::map<std::string,CgiPoolConfig>::const_iterator it=loc.cgiPools.begin();it!=loc.cgiPools.end();++it)
 			{
-				hostMap[name]=i;
+				CgiWorkerPool pool;
+				pool.interpreter=srv.cgi.find(it->first)->second;
+				pool.bootstrap=it->second.bootstrap;
+				pool.serverIndex=i;
+				pool.size=it->second.workers;
+				pool.maxRequests=it->second.maxRequests;
+				_cgiPools[cgiPoolKey(i,j,it->first)]=pool;
 			}
 		}
 	}
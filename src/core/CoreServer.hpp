@@ -3,6 +3,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
 #include <chrono>
 #include <signal.h>
 #include <sys/types.h>
@@ -10,7 +11,17 @@
 
 #include "core/Client.hpp"
 #include "ServerConfig.hpp"
+#include "VHostTable.hpp"
 #include "cgi/CgiProcess.hpp"
+#include "cgi/FastCgiConnection.hpp"
+#include "core/ProxyConnection.hpp"
+#include "core/CompressPool.hpp"
+#include "cgi/CgiWorker.hpp"
+#include "cgi/CgiCache.hpp"
+#include "cgi/CgiErrorLog.hpp"
+#include "http/CompressCache.hpp"
+#include "http/HandlerResult.hpp"
+#include "http/CgiResponseParser.hpp"
 
 class EventLoop;
 class IHttpHandler;
@@ -35,6 +46,7 @@ public:
 	void handleNewConnection(EventLoop& loop,int listenFd);
 	void handleClientRead(EventLoop& loop,int fd);
 	void handleClientWrite(EventLoop& loop,int fd);
+	void handleClientHangup(EventLoop& loop,int fd);
 	void closeClient(EventLoop& loop,int fd);
 
 	void checkTimeouts(EventLoop& loop);
@@ -44,17 +56,39 @@ public:
 	const ServerConfig& getServerConfig(std::size_t index) const;
 	const std::vector<ServerConfig>& getServerConfigs() const;
 
-	void registerCgiProcess(pid_t pid,int clientFd,int stdinFd,int stdoutFd,int stderrFd,const std::string& stdinData);
+	void registerCgiProcess(pid_t pid,int clientFd,int stdinFd,int stdoutFd,int stderrFd,std::string& stdinData);
 	bool isCgiFd(int fd) const;
 	void handleCgiRead(EventLoop& loop,int fd);
 	void handleCgiWrite(EventLoop& loop,int fd);
 	void reapChildren(EventLoop& loop);
 
+	void startCgiPools(EventLoop& loop);
+	void submitCgiPoolJob(EventLoop& loop,const std::string& poolKey,CgiPoolJob& job);
+	bool isCgiPoolFd(int fd) const;
+	void handleCgiPoolRead(EventLoop& loop,int fd);
+	void handleCgiPoolWrite(EventLoop& loop,int fd);
+	static std::string cgiPoolKey(std::size_t serverIndex,std::size_t locIndex,const std::string& ext);
+
+	void startFastCgi(EventLoop& loop,int clientFd,FastCgiRequest& req);
+	bool isFastCgiFd(int fd) const;
+	void handleFastCgiRead(EventLoop& loop,int fd);
+	void handleFastCgiWrite(EventLoop& loop,int fd);
+
+	void startProxy(EventLoop& loop,int clientFd,ProxyRequest& req);
+	bool isProxyFd(int fd) const;
+	void handleProxyRead(EventLoop& loop,int fd);
+	void handleProxyWrite(EventLoop& loop,int fd);
+	void resumeProxyStream(EventLoop& loop,int clientFd);
+
+	void startCompressPool(EventLoop& loop);
+	bool isCompressFd(int fd) const;
+	void handleCompressDone(EventLoop& loop);
+
 	static void handleStopSignal(int signum);
 	static bool stopRequested();
 	void shutdown(EventLoop& loop);
 
-	void registerCgiProcess(EventLoop& loop,pid_t pid,int clientFd,int stdinFd,int stdoutFd,int stderrFd,const std::string& stdinData);
+	void registerCgiProcess(EventLoop& loop,pid_t pid,int clientFd,int stdinFd,int stdoutFd,int stderrFd,std::string& stdinData);
 
 private:
 	std::vector<ServerConfig> _serverConfigs;
@@ -64,13 +98,95 @@ private:
 	std::map<int,std::size_t> _listenFdToServerIndex;
 	std::map<int,unsigned short> _listenFdToPort;
 	std::map<unsigned short,std::size_t> _defaultServerByPort;
-	std::map<unsigned short,std::map<std::string,std::size_t> > _serverByPortHost;
+	VHostTable _serverByPortHost;
 
 	std::map<int,Client> _clients;
 	std::map<pid_t,CgiProcess> _cgi;
 	std::map<int,pid_t> _cgiFdToPid;
 	std::chrono::seconds _cgiTimeout;
 
+	// cgi_max_concurrent: per-server FIFO of requests waiting for a slot
+	std::vector<std::deque<CgiLaunch> > _cgiQueues;
+	std::vector<std::size_t> _cgiActiveByServer;
+	std::map<const LocationConfig*,std::size_t> _cgiActiveByLocation;
+	std::vector<std::string> _cgiBusyResponses;
+
+	// cgi_stream_body: client fd -> CGI still receiving its body
+	std::map<int,pid_t> _cgiStreamByClient;
+
+	// cgi_cache_valid: responses by key, and the key/TTL of each client
+	// whose CGI is running because of a miss
+	struct CgiCacheTicket
+	{
+		std::string key;
+		std::size_t ttl;
+	};
+	CgiCache _cgiCache;
+	std::map<int,CgiCacheTicket> _cgiCacheTickets;
+	std::chrono::steady_clock::time_point _cgiCacheStatsAt;
+	std::size_t _cgiCacheStatsSeen;
+
+	// cgi_cache_lock: one CGI per key in flight, identical requests wait
+	// for its response instead of spawning their own
+	struct CgiWaiter
+	{
+		int clientFd;
+		CgiLaunchSpec spec;
+		std::chrono::steady_clock::time_point since;
+	};
+	struct CgiFlight
+	{
+		int leaderFd;
+		const LocationConfig* location;
+		std::vector<CgiWaiter> waiters;
+	};
+	std::map<std::string,CgiFlight> _cgiFlights;
+
+	// cgi_error_log sinks by server index; servers without one log to Logger
+	std::map<std::size_t,CgiErrorLog> _cgiErrorLogs;
+	unsigned long long _cgiRequestSeq;
+
+	std::map<std::string,CgiWorkerPool> _cgiPools;
+	std::map<pid_t,CgiWorker> _cgiWorkers;
+	std::map<int,pid_t> _cgiWorkerFds;
+
+	std::map<int,FastCgiConnection> _fcgiConns;
+	std::map<int,FastCgiRequest> _fcgiRequests;
+	std::map<std::string,std::deque<int> > _fcgiWaiting;
+	std::chrono::seconds _fcgiIdleTimeout;
+
+	// proxy_pass: one request per connection at a time; finished keep-alive
+	// connections wait in _proxyIdle by server address
+	std::map<int,ProxyConnection> _proxyConns;
+	std::map<int,ProxyRequest> _proxyRequests;
+	std::map<std::string,std::vector<int> > _proxyIdle;
+	std::map<std::string,std::size_t> _proxyBusy;
+	std::map<std::string,std::chrono::steady_clock::time_point> _proxyDown;
+	std::map<const UpstreamConfig*,std::size_t> _proxyNext;
+	std::chrono::seconds _proxyIdleTimeout;
+
+	// gzip / brotli: bodies past COMPRESS_INLINE_MAX are compressed by
+	// _compressPool while the client waits in CGI_PENDING. A static file's
+	// variant is compressed once: concurrent misses share the job in flight
+	// (_compressByKey) and the result goes to _compressCache.
+	struct CompressWaiter
+	{
+		unsigned long long job;
+		HttpResponse response;
+	};
+	struct CompressJobState
+	{
+		std::string cacheKey;
+		Compression::Coding coding;
+		std::vector<int> clients;
+	};
+	CompressPool _compressPool;
+	CompressCache _compressCache;
+	std::map<unsigned long long,CompressJobState> _compressJobs;
+	std::map<std::string,unsigned long long> _compressByKey;
+	std::map<int,CompressWaiter> _compressWaiters;
+	unsigned long long _compressSeq;
+
 	std::chrono::seconds _readTimeout;
 	std::chrono::seconds _writeTimeout;
 	std::chrono::seconds _idleTimeout;
@@ -82,12 +198,81 @@ private:
 
 	void cleanupCgi(EventLoop& loop,pid_t pid);
 	void checkCgiTimeouts(EventLoop& loop);
+
+	void startCgiBackend(EventLoop& loop,int clientFd,CgiLaunchSpec& spec);
+	void submitCgi(EventLoop& loop,CgiLaunch& launch);
+	void launchCgi(EventLoop& loop,CgiLaunch& launch);
+	void dispatchCgiQueue(EventLoop& loop,std::size_t serverIndex);
+	bool cgiSlotFree(const CgiLaunch& launch) const;
+	void releaseCgiSlot(const CgiProcess& p);
+	void dropCgiLaunches(int clientFd);
+	void feedCgiStream(EventLoop& loop,int clientFd);
+	void abortCgiStream(EventLoop& loop,pid_t pid,int status,const std::string& reason);
+	void closeCgiStdin(EventLoop& loop,CgiProcess& p);
+	void rejectCgiBusy(EventLoop& loop,int clientFd);
+	void dispatchCgiBackend(EventLoop& loop,int clientFd,std::size_t serverIndex,CgiLaunchSpec& spec);
+	bool respondFromCgiCache(EventLoop& loop,int clientFd,const std::string& key,const CgiLaunchSpec& spec);
+	bool joinCgiFlight(int clientFd,const std::string& key,const LocationConfig& loc,CgiLaunchSpec& spec);
+	void fanOutCgiResponse(EventLoop& loop,int leaderFd,const HttpResponse& res,int bodyFd,std::size_t bodyLen,bool shareable);
+	void leaveCgiFlights(EventLoop& loop,int clientFd);
+	void checkCgiFlights(EventLoop& loop);
+	void startCgiWaiter(EventLoop& loop,const std::string& key,CgiWaiter& w);
+	void logCgiCacheStats(bool force);
+	std::string cgiLoadSummary(std::size_t serverIndex) const;
+	static std::string buildCgiBusyResponse(const ServerConfig& cfg);
+
+	bool spawnCgiWorker(EventLoop& loop,const std::string& poolKey);
+	void retireCgiWorker(EventLoop& loop,pid_t pid,bool killIt);
+	void topUpCgiPool(EventLoop& loop,const std::string& poolKey);
+	void dispatchCgiPool(EventLoop& loop,const std::string& poolKey);
+	void completeCgiWorkerJob(EventLoop& loop,pid_t pid);
+	void dropCgiPoolJobs(int clientFd);
+	void checkCgiPoolTimeouts(EventLoop& loop);
+
+	int dispatchFastCgi(EventLoop& loop,int clientFd);
+	void dispatchFastCgiWaiting(EventLoop& loop,const std::string& address);
+	int openFastCgiConnection(EventLoop& loop,const std::string& address);
+	void pumpFastCgiConnection(EventLoop& loop,FastCgiConnection& c);
+	void closeFastCgiConnection(EventLoop& loop,int connFd);
+	void abortFastCgiRequest(EventLoop& loop,int clientFd);
+	void dropFastCgiRequest(std::map<int,FastCgiRequest>::iterator it);
+	void checkFastCgiTimeouts(EventLoop& loop);
+
+	std::string pickProxyServer(const UpstreamConfig& up);
+	bool dispatchProxy(EventLoop& loop,ProxyRequest& req);
+	int takeProxyConnection(EventLoop& loop,const std::string& address);
+	void pumpProxyRequest(EventLoop& loop,ProxyRequest& req);
+	void processProxyResponse(EventLoop& loop,ProxyRequest& req);
+	void startProxyStream(EventLoop& loop,ProxyRequest& req);
+	void appendProxyStream(EventLoop& loop,ProxyRequest& req,const std::string& data);
+	void finishProxyResponse(EventLoop& loop,int clientFd,bool reusable);
+	void failProxyRequest(EventLoop& loop,int clientFd,int status,const std::string& reason);
+	void proxyConnectionLost(EventLoop& loop,int connFd);
+	void releaseProxyConnection(EventLoop& loop,int connFd,bool reusable);
+	void closeProxyConnection(EventLoop& loop,int connFd);
+	void abortProxyRequest(EventLoop& loop,int clientFd);
+	void checkProxyTimeouts(EventLoop& loop);
+
+	void queueResponse(Client& client,HttpResponse& res);
+	bool compressResponse(EventLoop& loop,int clientFd,HttpResponse& res,const std::string& method,const LocationConfig* loc,const std::string& acceptEncoding,const std::string& filePath);
+	void sendCompressed(EventLoop& loop,int clientFd,HttpResponse& res);
+
+	void respondFromCgiOutput(EventLoop& loop,int clientFd,const std::string& out,const std::string& method,const std::string& version);
+	void respondFromCgiSpill(EventLoop& loop,int clientFd,CgiOutput& out,const std::string& method,const std::string& version);
+	static bool bufferCgiOutput(CgiOutput& out,const ServerConfig& cfg,const char* data,std::size_t n,std::string& why);
+	void respondFromInternalFile(EventLoop& loop,int clientFd,HttpResponse& res,const CgiResponseParser::Meta& meta,const std::string& method);
+	void abortCgiOutput(EventLoop& loop,pid_t pid,const std::string& why);
+	std::string describeCgiFailure(const CgiProcess& p,int& status);
+	void forwardCgiStderr(CgiStderrStream& s,const char* data,std::size_t len);
+	void finishCgiStderr(CgiStderrStream& s);
+	void logCgiStderrLine(const CgiStderrStream& s,const std::string& line);
+	void respondGatewayError(EventLoop& loop,int clientFd,int status,const std::string& reason,const std::string& version);
 	bool initListenSockets();
 	int createListenSocket(unsigned short port);
 
 	unsigned short getListenPortForListenFd(int fd) const;
-	void updateServerIndexFromHost(Client& client);
-	std::size_t selectServerIndexByHost(unsigned short port,std::size_t defaultIndex,const std::string& host) const;
+	void updateServerIndexFromHost(Client& client,std::size_t headersEnd);
+	std::size_t selectServerIndexByHost(unsigned short port,std::size_t defaultIndex,const char* host,std::size_t hostLen) const;
 
 	void computeMaxClients();
 
@@ -4,14 +4,27 @@
 #include "http/CgiResponseParser.hpp"
 #include "http/HttpError.hpp"
 #include "http/HttpResponse.hpp"
+#include "http/HttpRouter.hpp"
+#include "http/StaticFile.hpp"
+#include "cgi/CgiRunner.hpp"
+#include "cgi/FastCgi.hpp"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <vector>
+#include <utility>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <poll.h>
+#include <strings.h>
+#include <cstring>
+
+// cgi_stream_body: stop reading the client while this much body is
+// waiting for the script to consume it.
+static const std::size_t CGI_STDIN_HIGH_WATER = 256 * 1024;
 
 static bool setNonBlockingFd(int fd)
 {
@@ -23,6 +36,153 @@ static bool setNonBlockingFd(int fd)
 	return true;
 }
 
+static bool hasHeader(const HttpResponse& res, const char* name)
+{
+	std::size_t len = std::strlen(name);
+	for (std::map<std::string, std::string>::const_iterator it = res.headers.begin(); it != res.headers.end(); ++it)
+	{
+		if (it->first.size() == len && ::strncasecmp(it->first.c_str(), name, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+// A response that may go to anyone asking the same thing: into the cache,
+// and to the clients waiting on cgi_cache_lock. Anything personal (a
+// cookie, Cache-Control private/no-store/no-cache) or not a plain 200 is
+// for its own client only.
+static bool cgiResponseShareable(const HttpResponse& res, const CgiResponseParser::Meta& meta)
+{
+	return res.status == 200 && meta.maxAge != 0 && !hasHeader(res, "set-cookie");
+}
+
+// a stderr "line" longer than this is logged in pieces
+static const std::size_t CGI_STDERR_LINE_MAX = 4096;
+
+static bool writeAllFd(int fd, const char* data, std::size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t w = ::write(fd, data, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		data += w;
+		n -= static_cast<std::size_t>(w);
+	}
+	return true;
+}
+
+// Same separator preference as CgiResponseParser::parse.
+static std::size_t cgiHeaderEnd(const std::string& out)
+{
+	std::size_t sep = out.find("\r\n\r\n");
+	if (sep != std::string::npos)
+		return sep + 4;
+
+	sep = out.find("\n\n");
+	if (sep != std::string::npos)
+		return sep + 2;
+
+	return std::string::npos;
+}
+
+static int openSpillFile(const std::string& dir)
+{
+	std::string path = dir + "/webserv-cgi-XXXXXX";
+	std::vector<char> tmpl(path.begin(), path.end());
+	tmpl.push_back('\0');
+
+	int fd = ::mkostemp(tmpl.data(), O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	// nothing to clean up later, the data lives as long as the fd
+	::unlink(tmpl.data());
+	return fd;
+}
+
+// Appends CGI stdout under the server's memory budget. false + why means
+// the request has to fail.
+bool CoreServer::bufferCgiOutput(CgiOutput& out, const ServerConfig& cfg, const char* data, std::size_t n, std::string& why)
+{
+	out.outputSize += n;
+	if (cfg.cgiMaxOutputSize > 0 && out.outputSize > cfg.cgiMaxOutputSize)
+	{
+		why = "output exceeds cgi_max_output_size";
+		return false;
+	}
+
+	if (out.spillFd >= 0)
+	{
+		if (!writeAllFd(out.spillFd, data, n))
+		{
+			why = "cannot write temp file";
+			return false;
+		}
+		out.spillSize += n;
+		return true;
+	}
+
+	out.buffer.append(data, n);
+	if (out.buffer.size() <= cfg.cgiOutputBufferSize)
+		return true;
+
+	std::size_t headerEnd = cgiHeaderEnd(out.buffer);
+	if (headerEnd == std::string::npos)
+	{
+		why = "header block exceeds cgi_output_buffer_size";
+		return false;
+	}
+
+	out.spillFd = openSpillFile(cfg.cgiTempPath);
+	if (out.spillFd < 0)
+	{
+		why = "cannot create temp file in " + cfg.cgiTempPath;
+		return false;
+	}
+
+	std::size_t bodyLen = out.buffer.size() - headerEnd;
+	if (!writeAllFd(out.spillFd, out.buffer.data() + headerEnd, bodyLen))
+	{
+		why = "cannot write temp file";
+		return false;
+	}
+	out.spillSize = bodyLen;
+
+	std::string(out.buffer, 0, headerEnd).swap(out.buffer);
+	return true;
+}
+
+static bool cgiCacheableMethod(const std::string& method)
+{
+	return method == "GET" || method == "HEAD" || method == "POST";
+}
+
+// two POSTs with the same body are still two requests: they never wait on
+// each other
+static bool cgiLockableMethod(const std::string& method)
+{
+	return method == "GET" || method == "HEAD";
+}
+
+// The exit of a CGI child is an event on its pidfd, so the response is
+// finalized in the same loop iteration instead of waiting for the periodic
+// reapChildren() in checkTimeouts(). Kernels without pidfd_open (< 5.3)
+// still get reaped there.
+static int openPidFd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	long fd = ::syscall(SYS_pidfd_open, pid, 0);
+	if (fd >= 0)
+		return static_cast<int>(fd);
+#else
+	(void)pid;
+#endif
+	return -1;
+}
+
 bool CoreServer::isCgiFd(int fd) const
 {
 	return (_cgiFdToPid.find(fd) != _cgiFdToPid.end());
@@ -31,12 +191,13 @@ bool CoreServer::isCgiFd(int fd) const
 void CoreServer::registerCgiProcess(
 	pid_t pid, int clientFd,
 	int stdinFd, int stdoutFd, int stderrFd,
-	const std::string& stdinData
+	std::string& stdinData
 )
 {
-	CgiProcess p;
+	CgiProcess& p = _cgi[pid];
 	p.pid = pid;
 	p.clientFd = clientFd;
+	p.stderrLog.prefix = "[pid " + std::to_string((long long)pid) + "] ";
 	p.stdinFd = stdinFd;
 	p.stdoutFd = stdoutFd;
 	p.stderrFd = stderrFd;
@@ -44,7 +205,7 @@ void CoreServer::registerCgiProcess(
 	p.stdinClosed = (p.stdinFd < 0);
 	p.stdoutClosed = (p.stdoutFd < 0);
 	p.stderrClosed = (p.stderrFd < 0);
-	p.stdinBuffer = stdinData;
+	p.stdinBuffer.swap(stdinData);
 	p.stdinOffset = 0;
 	p.startTime = std::chrono::steady_clock::now();
 
@@ -64,7 +225,9 @@ void CoreServer::registerCgiProcess(
 		_cgiFdToPid[p.stderrFd] = pid;
 	}
 
-	_cgi[pid] = p;
+	p.pidFd = openPidFd(pid);
+	if (p.pidFd >= 0)
+		_cgiFdToPid[p.pidFd] = pid;
 }
 
 void CoreServer::finalizeCgiIfDone(EventLoop& loop, pid_t pid)
@@ -87,43 +250,223 @@ void CoreServer::finalizeCgiIfDone(EventLoop& loop, pid_t pid)
 		return;
 	}
 
+	int failStatus = 0;
+	std::string why = describeCgiFailure(p, failStatus);
+	if (!why.empty())
+	{
+		Logger::warn("CGI pid " + std::to_string((long long)pid) + " " + why + " -> " + std::to_string(failStatus));
+
+		if (failStatus == 504)
+			respondGatewayError(loop, clientFd, 504, "Gateway Timeout", p.version);
+		else
+			respondGatewayError(loop, clientFd, 502, "Bad Gateway", p.version);
+	}
+	else if (p.output.spillFd >= 0)
+		respondFromCgiSpill(loop, clientFd, p.output, p.method, p.version);
+	else
+		respondFromCgiOutput(loop, clientFd, p.output.buffer, p.method, p.version);
+
+	cleanupCgi(loop, pid);
+}
+
+// Why a finished CGI must not be answered from its output, or "" if it can.
+// A normal non-zero exit still is: scripts print their own error pages.
+std::string CoreServer::describeCgiFailure(const CgiProcess& p, int& status)
+{
+	int st = p.exitStatus;
+	std::size_t cpu = 0;
+	std::size_t as = 0;
+	if (p.location != 0)
+	{
+		cpu = p.location->cgiRlimitCpu;
+		as = p.location->cgiRlimitAs;
+	}
+
+	if (p.timedOut)
+	{
+		status = 504;
+		return "timed out after " + std::to_string(_cgiTimeout.count()) + "s";
+	}
+
+	if (WIFEXITED(st))
+	{
+		if (WEXITSTATUS(st) == CgiRunner::LIMITS_FAILED && p.output.buffer.empty() && p.output.spillFd < 0)
+		{
+			status = 502;
+			return "could not apply cgi_rlimit_*/cgi_nice";
+		}
+		if (WEXITSTATUS(st) != 0 && as > 0)
+			Logger::warn("CGI pid " + std::to_string((long long)p.pid) + " exited with status "
+				+ std::to_string(WEXITSTATUS(st)) + ", cgi_rlimit_as " + std::to_string(as) + " in effect");
+		return "";
+	}
+
+	if (!WIFSIGNALED(st))
+		return "";
+
+	int sig = WTERMSIG(st);
+
+	// a SIGKILL we did not send, with a CPU limit set: the hard limit hit
+	if (sig == SIGXCPU || (sig == SIGKILL && cpu > 0 && !p.killedByServer))
+	{
+		status = 504;
+		return "exceeded cgi_rlimit_cpu " + std::to_string(cpu) + "s";
+	}
+
+	status = 502;
+	std::string why = "killed by signal " + std::to_string(sig) + " (" + ::strsignal(sig) + ")";
+	if (as > 0 && (sig == SIGSEGV || sig == SIGABRT || sig == SIGBUS))
+		why += ", cgi_rlimit_as " + std::to_string(as) + " in effect";
+	return why;
+}
+
+// The header block is in memory, the body in the spill file: send the
+// headers, then hand the file to the client for sendfile().
+void CoreServer::respondFromCgiSpill(
+	EventLoop& loop, int clientFd,
+	CgiOutput& out,
+	const std::string& method,
+	const std::string& version
+)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
 	Client& client = itCl->second;
 
-	if (!p.stderrBuffer.empty())
+	HttpResponse res;
+	if (!version.empty())
+		res.version = version;
+
+	CgiResponseParser::Meta meta;
+	if (!CgiResponseParser::parse(out.buffer, res, meta))
+	{
+		respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+		return;
+	}
+
+	for (std::map<std::string, std::string>::iterator it = res.headers.begin(); it != res.headers.end(); )
+	{
+		if (it->first.size() == 14 && ::strncasecmp(it->first.c_str(), "content-length", 14) == 0)
+			res.headers.erase(it++);
+		else
+			++it;
+	}
+	res.headers["Content-Length"] = std::to_string(out.spillSize);
+	res.headers["Connection"] = "close";
+
+	// too big for cgi_cache_valid; waiters of cgi_cache_lock share the file
+	fanOutCgiResponse(loop, clientFd, res, out.spillFd, out.spillSize, cgiResponseShareable(res, meta));
+	_cgiCacheTickets.erase(clientFd);
+
+	Logger::info("CGI response of " + std::to_string(out.spillSize) + " bytes for client fd "
+		+ std::to_string(clientFd) + " sent from temp file");
+
+	client.outBuffer = res.serialize();
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	if (method != "HEAD")
 	{
-		Logger::warn("CGI stderr (pid " + std::to_string((long long)pid) + "): " + p.stderrBuffer);
+		client.sendFd = out.spillFd;
+		client.sendOffset = 0;
+		client.sendEnd = static_cast<off_t>(out.spillSize);
+		out.spillFd = -1;
 	}
 
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+}
+
+void CoreServer::abortCgiOutput(EventLoop& loop, pid_t pid, const std::string& why)
+{
+	std::map<pid_t, CgiProcess>::iterator it = _cgi.find(pid);
+	if (it == _cgi.end())
+		return;
+
+	int clientFd = it->second.clientFd;
+	std::string version = it->second.version;
+
+	Logger::warn("CGI pid " + std::to_string((long long)pid) + " killed after "
+		+ std::to_string(it->second.output.outputSize) + " bytes of output: " + why);
+
+	it->second.killedByServer = true;
+	::kill(pid, SIGKILL);
+	cleanupCgi(loop, pid);
+
+	respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+}
+
+void CoreServer::respondFromCgiOutput(
+	EventLoop& loop, int clientFd,
+	const std::string& out,
+	const std::string& method,
+	const std::string& version
+)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+
 	HttpResponse res;
+	CgiResponseParser::Meta meta;
 
 	// БЕЗ тернарника:
-	if (!p.version.empty())
-		res.version = p.version;
+	if (!version.empty())
+		res.version = version;
 	else
 		res.version = "HTTP/1.1";
 
-	if (p.stdoutBuffer.empty())
+	if (out.empty())
 	{
 		HttpError::fill(res, getServerConfig(client.serverConfigIndex), 502, "Bad Gateway");
 		res.headers["Connection"] = "close";
 	}
 	else
 	{
-		if (!CgiResponseParser::parse(p.stdoutBuffer, res))
+		if (!CgiResponseParser::parse(out, res, meta))
 		{
 			HttpError::fill(res, getServerConfig(client.serverConfigIndex), 502, "Bad Gateway");
 			res.headers["Connection"] = "close";
 		}
+		else if (!meta.accelRedirect.empty() || !meta.sendfilePath.empty())
+		{
+			respondFromInternalFile(loop, clientFd, res, meta, method);
+			return;
+		}
 		else
 		{
 			res.headers["Connection"] = "close";
 
-			// HEAD: тело не отправляем
-			if (p.method == "HEAD")
-				res.body.clear();
+			// cgi_cache_valid miss: keep a copy unless the script opted out
+			std::map<int, CgiCacheTicket>::iterator itTicket = _cgiCacheTickets.find(clientFd);
+			if (itTicket != _cgiCacheTickets.end())
+			{
+				std::size_t ttl = itTicket->second.ttl;
+				if (meta.maxAge >= 0)
+					ttl = static_cast<std::size_t>(meta.maxAge);
+
+				if (itTicket->second.ttl > 0 && cgiResponseShareable(res, meta))
+					_cgiCache.store(itTicket->second.key, res, ttl);
+			}
+
 		}
 	}
 
+	fanOutCgiResponse(loop, clientFd, res, -1, 0, cgiResponseShareable(res, meta));
+	_cgiCacheTickets.erase(clientFd);
+
+	// HEAD: тело не отправляем
+	if (method == "HEAD")
+		res.body.clear();
+
+	if (compressResponse(loop, clientFd, res, method, client.location, client.acceptEncoding, ""))
+		return;
+
 	client.outBuffer = res.serialize();
 	client.state = ConnectionState::WRITING;
 	client.closeAfterWrite = true;
@@ -131,8 +474,185 @@ void CoreServer::finalizeCgiIfDone(EventLoop& loop, pid_t pid)
 
 	loop.setReadEnabled(clientFd, false);
 	loop.setWriteEnabled(clientFd, true);
+}
 
-	cleanupCgi(loop, pid);
+// X-Accel-Redirect / X-Sendfile: the script only authorized the transfer;
+// the file goes from the page cache to the socket with sendfile(). The
+// script's status and headers are kept, the body and length are the file's.
+void CoreServer::respondFromInternalFile(
+	EventLoop& loop, int clientFd,
+	HttpResponse& res,
+	const CgiResponseParser::Meta& meta,
+	const std::string& method
+)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+	const ServerConfig& cfg = getServerConfig(client.serverConfigIndex);
+
+	std::string path;
+	if (!meta.accelRedirect.empty())
+	{
+		if (!HttpRouter::resolveInternal(cfg, meta.accelRedirect, path))
+		{
+			Logger::warn("X-Accel-Redirect to " + meta.accelRedirect + " is not in an internal location");
+			respondGatewayError(loop, clientFd, 404, "Not Found", res.version);
+			return;
+		}
+	}
+	else
+	{
+		path = meta.sendfilePath;
+		if (!HttpRouter::sendfileAllowed(cfg, path))
+		{
+			Logger::warn("X-Sendfile " + path + " is outside the internal locations");
+			respondGatewayError(loop, clientFd, 404, "Not Found", res.version);
+			return;
+		}
+	}
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	{
+		if (fd >= 0)
+			::close(fd);
+		respondGatewayError(loop, clientFd, 404, "Not Found", res.version);
+		return;
+	}
+
+	for (std::map<std::string, std::string>::iterator it = res.headers.begin(); it != res.headers.end(); )
+	{
+		if (it->first.size() == 14 && ::strncasecmp(it->first.c_str(), "content-length", 14) == 0)
+			res.headers.erase(it++);
+		else
+			++it;
+	}
+	const std::string& contentType = cfg.mimeTypes.lookup(path);
+	std::string etag = StaticFile::etag(st);
+
+	if (!meta.hasContentType)
+		res.headers["Content-Type"] = contentType;
+	if (!hasHeader(res, "etag"))
+		res.headers["ETag"] = etag;
+	if (!hasHeader(res, "last-modified"))
+		res.headers["Last-Modified"] = StaticFile::httpDate(st.st_mtime);
+	res.headers["Accept-Ranges"] = "bytes";
+	res.headers["Content-Length"] = std::to_string((long long)st.st_size);
+	res.headers["Connection"] = "close";
+	res.body.clear();
+
+	// coalesced waiters get the whole file: their Range may differ
+	std::size_t size = static_cast<std::size_t>(st.st_size);
+	fanOutCgiResponse(loop, clientFd, res, fd, size, cgiResponseShareable(res, meta));
+	_cgiCacheTickets.erase(clientFd);
+
+	off_t sendOffset = 0;
+	off_t sendEnd = st.st_size;
+
+	std::vector<StaticFile::ByteRange> ranges;
+	std::vector<BodyPart> parts;
+	StaticFile::RangeResult rangeResult = StaticFile::RANGE_NONE;
+	if (method == "GET" && res.status == 200 && !client.range.empty()
+		&& StaticFile::ifRangeMatches(client.ifRange, etag, st.st_mtime))
+		rangeResult = StaticFile::parseRange(client.range, st.st_size, ranges);
+
+	if (rangeResult == StaticFile::RANGE_UNSATISFIABLE)
+	{
+		res.status = 416;
+		res.reason = "Range Not Satisfiable";
+		res.headers["Content-Range"] = "bytes */" + std::to_string((long long)st.st_size);
+		res.headers["Content-Length"] = "0";
+		sendEnd = 0;
+	}
+	else if (rangeResult == StaticFile::RANGE_OK && ranges.size() == 1)
+	{
+		res.status = 206;
+		res.reason = "Partial Content";
+		res.headers["Content-Range"] = StaticFile::contentRange(ranges[0], st.st_size);
+		res.headers["Content-Length"] = std::to_string((long long)(ranges[0].last - ranges[0].first + 1));
+		sendOffset = ranges[0].first;
+		sendEnd = ranges[0].last + 1;
+	}
+	else if (rangeResult == StaticFile::RANGE_OK)
+	{
+		std::string boundary = StaticFile::makeBoundary(etag);
+		std::string ct = contentType;
+		std::map<std::string, std::string>::iterator itCt = res.headers.find("Content-Type");
+		if (itCt != res.headers.end())
+			ct = itCt->second;
+
+		res.status = 206;
+		res.reason = "Partial Content";
+		res.headers["Content-Type"] = "multipart/byteranges; boundary=" + boundary;
+		StaticFile::multipartParts(ranges, st.st_size, ct, boundary, parts);
+		res.planParts(path, parts);
+		res.headers["Content-Length"] = std::to_string(res.bodyLength());
+		parts.swap(res.source.parts);
+
+		// the first part's head goes right after the headers
+		sendOffset = parts[0].offset;
+		sendEnd = parts[0].offset + parts[0].length;
+	}
+
+	client.outBuffer = res.serialize();
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	if (method != "HEAD" && sendOffset < sendEnd)
+	{
+		client.sendFd = fd;
+		client.sendOffset = sendOffset;
+		client.sendEnd = sendEnd;
+		if (!parts.empty())
+		{
+			client.outBuffer += parts[0].head;
+			client.sendParts.swap(parts);
+			client.sendPart = 1;
+		}
+	}
+	else
+		::close(fd);
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+}
+
+void CoreServer::respondGatewayError(
+	EventLoop& loop, int clientFd,
+	int status, const std::string& reason,
+	const std::string& version
+)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+
+	HttpResponse res;
+	if (!version.empty())
+		res.version = version;
+
+	HttpError::fill(res, getServerConfig(client.serverConfigIndex), status, reason);
+	res.headers["Connection"] = "close";
+
+	// the leader's failure is not the waiters': each tries for itself
+	fanOutCgiResponse(loop, clientFd, res, -1, 0, false);
+	_cgiCacheTickets.erase(clientFd);
+
+	const std::string* raw = HttpError::prepared(getServerConfig(client.serverConfigIndex), res);
+	client.outBuffer = (raw != 0 ? *raw : res.serialize());
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
 }
 
 void CoreServer::handleCgiRead(EventLoop& loop, int fd)
@@ -148,15 +668,50 @@ void CoreServer::handleCgiRead(EventLoop& loop, int fd)
 
 	CgiProcess& p = it->second;
 
-	char buf[4096];
+	if (fd == p.pidFd)
+	{
+		loop.removeFd(fd);
+		::close(fd);
+		_cgiFdToPid.erase(fd);
+		p.pidFd = -1;
+
+		int status = 0;
+		if (!p.exited && ::waitpid(pid, &status, WNOHANG) == pid)
+		{
+			p.exited = true;
+			p.exitStatus = status;
+		}
+
+		finalizeCgiIfDone(loop, pid);
+		return;
+	}
+
+	if (fd == p.stdinFd)
+	{
+		// POLLERR/POLLHUP on the write end: the script stopped reading
+		closeCgiStdin(loop, p);
+		finalizeCgiIfDone(loop, pid);
+		return;
+	}
+
+	char buf[65536];
 
 	ssize_t n = ::read(fd, buf, sizeof(buf));
 	if (n > 0)
 	{
+		std::size_t len = static_cast<std::size_t>(n);
+
 		if (fd == p.stdoutFd)
-			p.stdoutBuffer.append(buf, static_cast<std::size_t>(n));
+		{
+			std::string why;
+			if (!bufferCgiOutput(p.output, _serverConfigs[p.serverIndex], buf, len, why))
+			{
+				abortCgiOutput(loop, pid, why);
+				return;
+			}
+		}
 		else if (fd == p.stderrFd)
-			p.stderrBuffer.append(buf, static_cast<std::size_t>(n));
+			forwardCgiStderr(p.stderrLog, buf, len);
 	}
 	else
 	{
@@ -202,39 +757,48 @@ void CoreServer::handleCgiWrite(EventLoop& loop, int fd)
 
 		ssize_t n = ::write(fd, data, remain);
 		if (n > 0)
-		{
 			p.stdinOffset += static_cast<std::size_t>(n);
-		}
 		else
-		{
-			loop.setWriteEnabled(fd, false);
-			loop.removeFd(fd);
-			::close(fd);
-			_cgiFdToPid.erase(fd);
-
-			p.stdinFd = -1;
-			p.stdinClosed = true;
+			closeCgiStdin(loop, p);
+	}
 
+	if (p.stdinFd == fd && p.stdinOffset >= p.stdinBuffer.size())
+	{
+		if (p.stdinStreaming)
+		{
+			// the rest of the body is still on its way from the client
 			p.stdinBuffer.clear();
 			p.stdinOffset = 0;
+			loop.setWriteEnabled(fd, false);
 		}
+		else
+			closeCgiStdin(loop, p);
 	}
 
-	if (p.stdinFd == fd && p.stdinOffset >= p.stdinBuffer.size())
+	if (p.clientPaused && p.stdinBuffer.size() - p.stdinOffset < CGI_STDIN_HIGH_WATER / 2)
 	{
-		loop.setWriteEnabled(fd, false);
-		loop.removeFd(fd);
-		::close(fd);
-		_cgiFdToPid.erase(fd);
+		p.clientPaused = false;
+		loop.setReadEnabled(p.clientFd, true);
+	}
 
-		p.stdinFd = -1;
-		p.stdinClosed = true;
+	finalizeCgiIfDone(loop, pid);
+}
 
-		p.stdinBuffer.clear();
-		p.stdinOffset = 0;
+void CoreServer::closeCgiStdin(EventLoop& loop, CgiProcess& p)
+{
+	if (p.stdinFd >= 0)
+	{
+		loop.setWriteEnabled(p.stdinFd, false);
+		loop.removeFd(p.stdinFd);
+		::close(p.stdinFd);
+		_cgiFdToPid.erase(p.stdinFd);
 	}
 
-	finalizeCgiIfDone(loop, pid);
+	p.stdinFd = -1;
+	p.stdinClosed = true;
+
+	std::string().swap(p.stdinBuffer);
+	p.stdinOffset = 0;
 }
 
 void CoreServer::cleanupCgi(EventLoop& loop, pid_t pid)
@@ -266,8 +830,31 @@ void CoreServer::cleanupCgi(EventLoop& loop, pid_t pid)
 		_cgiFdToPid.erase(p.stderrFd);
 		p.stderrFd = -1;
 	}
+	if (p.pidFd >= 0)
+	{
+		loop.removeFd(p.pidFd);
+		::close(p.pidFd);
+		_cgiFdToPid.erase(p.pidFd);
+		p.pidFd = -1;
+	}
+	if (p.output.spillFd >= 0)
+	{
+		::close(p.output.spillFd);
+		p.output.spillFd = -1;
+	}
+
+	finishCgiStderr(p.stderrLog);
+
+	std::map<int, pid_t>::iterator itStream = _cgiStreamByClient.find(p.clientFd);
+	if (itStream != _cgiStreamByClient.end() && itStream->second == pid)
+		_cgiStreamByClient.erase(itStream);
+
+	std::size_t serverIndex = p.serverIndex;
+	releaseCgiSlot(p);
 
 	_cgi.erase(it);
+
+	dispatchCgiQueue(loop, serverIndex);
 }
 
 void CoreServer::reapChildren(EventLoop& loop)
@@ -306,7 +893,29 @@ void CoreServer::checkCgiTimeouts(EventLoop& loop)
 	}
 
 	for (std::size_t i = 0; i < toKill.size(); ++i)
+	{
+		CgiProcess& p = _cgi[toKill[i]];
+		p.timedOut = true;
+		p.killedByServer = true;
 		::kill(toKill[i], SIGKILL);
+	}
+
+	for (std::size_t s = 0; s < _cgiQueues.size(); ++s)
+	{
+		std::chrono::seconds wait(_serverConfigs[s].cgiQueueTimeout);
+		std::deque<CgiLaunch>& q = _cgiQueues[s];
+
+		while (!q.empty() && now - q.front().queuedAt > wait)
+		{
+			int clientFd = q.front().clientFd;
+			q.pop_front();
+
+			Logger::warn("CGI queue timeout on fd " + std::to_string(clientFd) + " (" + cgiLoadSummary(s) + ")");
+			rejectCgiBusy(loop, clientFd);
+		}
+	}
+
+	checkCgiFlights(loop);
 
 	reapChildren(loop);
 }
@@ -314,7 +923,7 @@ void CoreServer::checkCgiTimeouts(EventLoop& loop)
 void CoreServer::registerCgiProcess(
 	EventLoop& loop, pid_t pid, int clientFd,
 	int stdinFd, int stdoutFd, int stderrFd,
-	const std::string& stdinData
+	std::string& stdinData
 )
 {
 	registerCgiProcess(pid, clientFd, stdinFd, stdoutFd, stderrFd, stdinData);
@@ -325,4 +934,750 @@ void CoreServer::registerCgiProcess(
 		loop.addFd(stdoutFd, POLLIN);
 	if (stderrFd >= 0)
 		loop.addFd(stderrFd, POLLIN);
+
+	std::map<pid_t, CgiProcess>::iterator it = _cgi.find(pid);
+	if (it != _cgi.end() && it->second.pidFd >= 0)
+		loop.addFd(it->second.pidFd, POLLIN);
+}
+
+// ---------------- cgi_max_concurrent admission ----------------
+
+static const char* CGI_RETRY_AFTER = "1";
+
+std::string CoreServer::buildCgiBusyResponse(const ServerConfig& cfg)
+{
+	HttpResponse res;
+	HttpError::fill(res, cfg, 503, "Service Unavailable");
+	res.headers["Retry-After"] = CGI_RETRY_AFTER;
+	res.headers["Connection"] = "close";
+	return res.serialize();
+}
+
+std::string CoreServer::cgiLoadSummary(std::size_t serverIndex) const
+{
+	const ServerConfig& cfg = _serverConfigs[serverIndex];
+
+	std::string s = "in-flight " + std::to_string(_cgiActiveByServer[serverIndex]);
+	if (cfg.cgiMaxConcurrent > 0)
+		s += "/" + std::to_string(cfg.cgiMaxConcurrent);
+	s += ", queued " + std::to_string(_cgiQueues[serverIndex].size());
+	s += "/" + std::to_string(cfg.cgiQueueSize);
+	return s;
+}
+
+bool CoreServer::cgiSlotFree(const CgiLaunch& launch) const
+{
+	const ServerConfig& cfg = _serverConfigs[launch.serverIndex];
+
+	if (cfg.cgiMaxConcurrent > 0 && _cgiActiveByServer[launch.serverIndex] >= cfg.cgiMaxConcurrent)
+		return false;
+
+	if (launch.location != 0 && launch.location->cgiMaxConcurrent > 0)
+	{
+		std::map<const LocationConfig*, std::size_t>::const_iterator it = _cgiActiveByLocation.find(launch.location);
+		if (it != _cgiActiveByLocation.end() && it->second >= launch.location->cgiMaxConcurrent)
+			return false;
+	}
+
+	return true;
+}
+
+void CoreServer::releaseCgiSlot(const CgiProcess& p)
+{
+	if (p.serverIndex < _cgiActiveByServer.size() && _cgiActiveByServer[p.serverIndex] > 0)
+		--_cgiActiveByServer[p.serverIndex];
+
+	if (p.location != 0)
+	{
+		std::map<const LocationConfig*, std::size_t>::iterator it = _cgiActiveByLocation.find(p.location);
+		if (it != _cgiActiveByLocation.end())
+		{
+			if (it->second > 1)
+				--it->second;
+			else
+				_cgiActiveByLocation.erase(it);
+		}
+	}
+}
+
+void CoreServer::startCgiBackend(EventLoop& loop, int clientFd, CgiLaunchSpec& spec)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	std::size_t serverIndex = itCl->second.serverConfigIndex;
+	if (serverIndex >= _serverConfigs.size())
+		serverIndex = 0;
+
+	const ServerConfig& cfg = _serverConfigs[serverIndex];
+	if (spec.locationIndex >= cfg.locations.size())
+	{
+		respondGatewayError(loop, clientFd, 502, "Bad Gateway", spec.version);
+		return;
+	}
+
+	const LocationConfig& loc = cfg.locations[spec.locationIndex];
+	if ((loc.cgiCacheValid > 0 || loc.cgiCacheLock) && spec.backend != CgiLaunchSpec::PROXY
+		&& !spec.streamBody && cgiCacheableMethod(spec.method))
+	{
+		// HEAD is answered from the GET entry, the body dropped on the way
+		// out, but never fills it: what the backend sends for a HEAD may
+		// have no body. The key of its ticket and flight is its own, so no
+		// GET waits for a HEAD's response either.
+		bool head = (spec.method == "HEAD");
+		std::string key = CgiCache::makeKey(spec.scriptPath, spec.method, spec.env, spec.body, loc.cgiCacheKeyHeaders);
+
+		if (loc.cgiCacheValid > 0)
+		{
+			std::string getKey;
+			if (head)
+				getKey = CgiCache::makeKey(spec.scriptPath, "GET", spec.env, spec.body, loc.cgiCacheKeyHeaders);
+			if (respondFromCgiCache(loop, clientFd, head ? getKey : key, spec))
+				return;
+		}
+		if (loc.cgiCacheLock && cgiLockableMethod(spec.method) && joinCgiFlight(clientFd, key, loc, spec))
+			return;
+
+		CgiCacheTicket& t = _cgiCacheTickets[clientFd];
+		t.key.swap(key);
+		t.ttl = head ? 0 : loc.cgiCacheValid;
+	}
+
+	dispatchCgiBackend(loop, clientFd, serverIndex, spec);
+}
+
+void CoreServer::dispatchCgiBackend(EventLoop& loop, int clientFd, std::size_t serverIndex, CgiLaunchSpec& spec)
+{
+	const ServerConfig& cfg = _serverConfigs[serverIndex];
+
+	if (spec.backend == CgiLaunchSpec::PROXY)
+	{
+		const LocationConfig& loc = cfg.locations[spec.locationIndex];
+
+		ProxyRequest req;
+		req.location = &loc;
+		req.upstream = &cfg.upstreams.find(loc.proxyPass)->second;
+		req.method.swap(spec.method);
+		req.version.swap(spec.version);
+		req.out.swap(spec.proxyHead);
+		req.out.append(spec.body);
+		std::string().swap(spec.body);
+
+		startProxy(loop, clientFd, req);
+		return;
+	}
+
+	if (spec.backend == CgiLaunchSpec::FASTCGI)
+	{
+		FastCgiRequest req;
+		req.serverIndex = serverIndex;
+		req.location = &cfg.locations[spec.locationIndex];
+		req.method.swap(spec.method);
+		req.version.swap(spec.version);
+		req.params = FastCgi::encodeParams(spec.env);
+		req.body.swap(spec.body);
+
+		startFastCgi(loop, clientFd, req);
+		return;
+	}
+
+	if (spec.backend == CgiLaunchSpec::POOL)
+	{
+		CgiPoolJob job;
+		job.clientFd = clientFd;
+		job.method.swap(spec.method);
+		job.version.swap(spec.version);
+		job.frame = CgiRunner::buildWorkerFrame(spec.env, spec.body.size());
+		job.body.swap(spec.body);
+
+		submitCgiPoolJob(loop, cgiPoolKey(serverIndex, spec.locationIndex, spec.extension), job);
+		return;
+	}
+
+	CgiLaunch launch;
+	launch.clientFd = clientFd;
+	launch.serverIndex = serverIndex;
+	launch.location = &cfg.locations[spec.locationIndex];
+	launch.interpreter.swap(spec.interpreter);
+	launch.scriptPath.swap(spec.scriptPath);
+	launch.env.swap(spec.env);
+	launch.body.swap(spec.body);
+	launch.method.swap(spec.method);
+	launch.version.swap(spec.version);
+	launch.streamBody = spec.streamBody;
+	launch.bodyChunked = spec.bodyChunked;
+	launch.bodyLength = spec.bodyLength;
+
+	submitCgi(loop, launch);
+}
+
+void CoreServer::submitCgi(EventLoop& loop, CgiLaunch& launch)
+{
+	// Queued entries are re-checked every time a slot is released, so a
+	// request that fits now cannot overtake one that would fit as well.
+	if (cgiSlotFree(launch))
+	{
+		launchCgi(loop, launch);
+		return;
+	}
+
+	std::size_t s = launch.serverIndex;
+	std::deque<CgiLaunch>& q = _cgiQueues[s];
+
+	if (q.size() >= _serverConfigs[s].cgiQueueSize)
+	{
+		Logger::warn("CGI queue full, rejecting fd " + std::to_string(launch.clientFd) + " (" + cgiLoadSummary(s) + ")");
+		rejectCgiBusy(loop, launch.clientFd);
+		return;
+	}
+
+	q.push_back(std::move(launch));
+	q.back().queuedAt = std::chrono::steady_clock::now();
+
+	Logger::info("CGI queued fd " + std::to_string(q.back().clientFd) + " (" + cgiLoadSummary(s) + ")");
+}
+
+void CoreServer::launchCgi(EventLoop& loop, CgiLaunch& launch)
+{
+	CgiRunner::Spawned sp;
+	CgiRunner::Limits limits;
+	if (launch.location != 0)
+	{
+		limits.cpuSeconds = launch.location->cgiRlimitCpu;
+		limits.addressSpace = launch.location->cgiRlimitAs;
+		limits.openFiles = launch.location->cgiRlimitNofile;
+		limits.nice = launch.location->cgiNice;
+	}
+
+	if (!CgiRunner::spawnWithEnv(launch.interpreter, launch.scriptPath, launch.env, limits, sp))
+	{
+		Logger::error("CGI spawn failed for " + launch.scriptPath);
+		respondGatewayError(loop, launch.clientFd, 502, "Bad Gateway", launch.version);
+		return;
+	}
+
+	registerCgiProcess(loop, sp.pid, launch.clientFd, sp.stdinFd, sp.stdoutFd, sp.stderrFd, launch.body);
+
+	CgiProcess& p = _cgi[sp.pid];
+	p.requestId = ++_cgiRequestSeq;
+	p.method = launch.method;
+	p.version = launch.version;
+	p.serverIndex = launch.serverIndex;
+	p.stderrLog.serverIndex = launch.serverIndex;
+	p.stderrLog.prefix = "[pid " + std::to_string((long long)sp.pid) + " req " + std::to_string(p.requestId) + "] ";
+	p.location = launch.location;
+
+	++_cgiActiveByServer[launch.serverIndex];
+	if (launch.location != 0)
+		++_cgiActiveByLocation[launch.location];
+
+	if (launch.streamBody)
+	{
+		p.stdinStreaming = true;
+		p.streamChunked = launch.bodyChunked;
+		p.streamLeft = launch.bodyLength;
+		_cgiStreamByClient[launch.clientFd] = sp.pid;
+
+		// whatever arrived with the headers, then resume reading the socket
+		feedCgiStream(loop, launch.clientFd);
+	}
+}
+
+void CoreServer::dispatchCgiQueue(EventLoop& loop, std::size_t serverIndex)
+{
+	if (serverIndex >= _cgiQueues.size())
+		return;
+
+	std::deque<CgiLaunch>& q = _cgiQueues[serverIndex];
+	std::deque<CgiLaunch>::iterator it = q.begin();
+
+	while (it != q.end())
+	{
+		if (!cgiSlotFree(*it))
+		{
+			++it;
+			continue;
+		}
+
+		CgiLaunch launch = std::move(*it);
+		it = q.erase(it);
+
+		std::chrono::steady_clock::duration waited = std::chrono::steady_clock::now() - launch.queuedAt;
+		long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(waited).count();
+		Logger::info("CGI admitted fd " + std::to_string(launch.clientFd) + " after " + std::to_string(ms) + "ms in queue");
+
+		launchCgi(loop, launch);
+		it = q.begin();
+	}
+}
+
+void CoreServer::dropCgiLaunches(int clientFd)
+{
+	for (std::size_t s = 0; s < _cgiQueues.size(); ++s)
+	{
+		std::deque<CgiLaunch>& q = _cgiQueues[s];
+		for (std::deque<CgiLaunch>::iterator it = q.begin(); it != q.end(); )
+		{
+			if (it->clientFd == clientFd)
+				it = q.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+void CoreServer::rejectCgiBusy(EventLoop& loop, int clientFd)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+
+	std::size_t s = client.serverConfigIndex;
+	if (s >= _cgiBusyResponses.size())
+		s = 0;
+
+	client.outBuffer = _cgiBusyResponses[s];
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+}
+
+// ---------------- cgi_error_log ----------------
+
+void CoreServer::logCgiStderrLine(const CgiStderrStream& s, const std::string& line)
+{
+	std::string prefixed = s.prefix + line;
+
+	std::map<std::size_t, CgiErrorLog>::iterator it = _cgiErrorLogs.find(s.serverIndex);
+	if (it != _cgiErrorLogs.end())
+		it->second.write(prefixed);
+	else
+		Logger::warn("CGI stderr " + prefixed);
+}
+
+// Complete lines go out as they arrive; only the unfinished one is kept.
+void CoreServer::forwardCgiStderr(CgiStderrStream& s, const char* data, std::size_t len)
+{
+	std::size_t limit = _serverConfigs[s.serverIndex].cgiStderrLimit;
+
+	if (s.logged >= limit)
+	{
+		s.dropped += len;
+		return;
+	}
+
+	s.partial.append(data, len);
+
+	std::size_t start = 0;
+	while (start < s.partial.size() && s.logged < limit)
+	{
+		std::size_t eol = s.partial.find('\n', start);
+		std::size_t end = eol;
+		std::size_t next = eol + 1;
+
+		if (eol == std::string::npos)
+		{
+			if (s.partial.size() - start < CGI_STDERR_LINE_MAX)
+				break;
+			end = start + CGI_STDERR_LINE_MAX;
+			next = end;
+		}
+
+		std::size_t lineEnd = end;
+		if (lineEnd > start && s.partial[lineEnd - 1] == '\r')
+			--lineEnd;
+
+		logCgiStderrLine(s, s.partial.substr(start, lineEnd - start));
+		s.logged += next - start;
+		start = next;
+	}
+
+	s.partial.erase(0, start);
+
+	if (s.logged >= limit)
+	{
+		s.dropped += s.partial.size();
+		std::string().swap(s.partial);
+	}
+}
+
+void CoreServer::finishCgiStderr(CgiStderrStream& s)
+{
+	if (!s.partial.empty())
+	{
+		logCgiStderrLine(s, s.partial);
+		std::string().swap(s.partial);
+	}
+
+	if (s.dropped > 0)
+	{
+		logCgiStderrLine(s, "[" + std::to_string(s.dropped) + " bytes of stderr over cgi_stderr_limit dropped]");
+		s.dropped = 0;
+	}
+}
+
+// ---------------- cgi_cache_valid ----------------
+
+// A hit is answered without starting any backend.
+bool CoreServer::respondFromCgiCache(EventLoop& loop, int clientFd, const std::string& key, const CgiLaunchSpec& spec)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return false;
+
+	HttpResponse res;
+	if (_cgiCache.lookup(key, res) != CgiCache::HIT)
+		return false;
+
+	if (!spec.version.empty())
+		res.version = spec.version;
+	if (spec.method == "HEAD")
+		res.body.clear();
+
+	Client& client = itCl->second;
+	if (compressResponse(loop, clientFd, res, spec.method, client.location, client.acceptEncoding, ""))
+		return true;
+
+	client.outBuffer = res.serialize();
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+	return true;
+}
+
+// ---------------- cgi_cache_lock ----------------
+
+// The first request for a key leads; the rest park here until its response
+// is fanned out or cgi_cache_lock_timeout runs out.
+bool CoreServer::joinCgiFlight(int clientFd, const std::string& key, const LocationConfig& loc, CgiLaunchSpec& spec)
+{
+	std::map<std::string, CgiFlight>::iterator it = _cgiFlights.find(key);
+	if (it == _cgiFlights.end())
+	{
+		CgiFlight& f = _cgiFlights[key];
+		f.leaderFd = clientFd;
+		f.location = &loc;
+		return false;
+	}
+
+	CgiFlight& f = it->second;
+	f.waiters.push_back(CgiWaiter());
+
+	CgiWaiter& w = f.waiters.back();
+	w.clientFd = clientFd;
+	std::swap(w.spec, spec);
+	w.since = std::chrono::steady_clock::now();
+
+	Logger::info("CGI fd " + std::to_string(clientFd) + " waits for fd " + std::to_string(f.leaderFd)
+		+ " (" + std::to_string(f.waiters.size()) + " waiting)");
+	return true;
+}
+
+// shareable false: the response is the leader's alone, and the waiters
+// run their own requests, as on a cgi_cache_lock_timeout
+void CoreServer::fanOutCgiResponse(EventLoop& loop, int leaderFd, const HttpResponse& res, int bodyFd, std::size_t bodyLen, bool shareable)
+{
+	std::map<int, CgiCacheTicket>::iterator itTicket = _cgiCacheTickets.find(leaderFd);
+	if (itTicket == _cgiCacheTickets.end())
+		return;
+
+	std::map<std::string, CgiFlight>::iterator itFlight = _cgiFlights.find(itTicket->second.key);
+	if (itFlight == _cgiFlights.end() || itFlight->second.leaderFd != leaderFd)
+		return;
+
+	std::string key = itFlight->first;
+	std::vector<CgiWaiter> waiters;
+	waiters.swap(itFlight->second.waiters);
+	_cgiFlights.erase(itFlight);
+
+	if (!shareable)
+	{
+		for (std::size_t i = 0; i < waiters.size(); ++i)
+			startCgiWaiter(loop, key, waiters[i]);
+		if (!waiters.empty())
+			Logger::info("CGI response of fd " + std::to_string(leaderFd) + " not shared, "
+				+ std::to_string(waiters.size()) + " waiting client(s) run their own");
+		return;
+	}
+
+	for (std::size_t i = 0; i < waiters.size(); ++i)
+	{
+		const CgiWaiter& w = waiters[i];
+		std::map<int, Client>::iterator itCl = _clients.find(w.clientFd);
+		if (itCl == _clients.end())
+			continue;
+
+		HttpResponse copy = res;
+		if (!w.spec.version.empty())
+			copy.version = w.spec.version;
+		if (w.spec.method == "HEAD")
+			copy.body.clear();
+
+		Client& client = itCl->second;
+		if (bodyFd < 0 && compressResponse(loop, w.clientFd, copy, w.spec.method, client.location, client.acceptEncoding, ""))
+			continue;
+
+		client.outBuffer = copy.serialize();
+		client.state = ConnectionState::WRITING;
+		client.closeAfterWrite = true;
+		client.outOffset = 0;
+
+		// sendfile() keeps its own offset, so a dup of the spill file will do
+		if (bodyFd >= 0 && w.spec.method != "HEAD")
+		{
+			client.sendFd = ::fcntl(bodyFd, F_DUPFD_CLOEXEC, 0);
+			client.sendOffset = 0;
+			client.sendEnd = static_cast<off_t>(bodyLen);
+			if (client.sendFd < 0)
+			{
+				closeClient(loop, w.clientFd);
+				continue;
+			}
+		}
+
+		loop.setReadEnabled(w.clientFd, false);
+		loop.setWriteEnabled(w.clientFd, true);
+	}
+
+	if (!waiters.empty())
+		Logger::info("CGI response of fd " + std::to_string(leaderFd) + " shared with "
+			+ std::to_string(waiters.size()) + " waiting client(s)");
+}
+
+// A waiter that stops waiting runs the request itself, with a ticket of its
+// own so the result still reaches the cache (and its followers, if it leads).
+void CoreServer::startCgiWaiter(EventLoop& loop, const std::string& key, CgiWaiter& w)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(w.clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	std::size_t serverIndex = itCl->second.serverConfigIndex;
+	if (serverIndex >= _serverConfigs.size())
+		serverIndex = 0;
+
+	const ServerConfig& cfg = _serverConfigs[serverIndex];
+	if (w.spec.locationIndex >= cfg.locations.size())
+	{
+		respondGatewayError(loop, w.clientFd, 502, "Bad Gateway", w.spec.version);
+		return;
+	}
+
+	CgiCacheTicket& t = _cgiCacheTickets[w.clientFd];
+	t.key = key;
+	t.ttl = (w.spec.method == "HEAD") ? 0 : cfg.locations[w.spec.locationIndex].cgiCacheValid;
+
+	dispatchCgiBackend(loop, w.clientFd, serverIndex, w.spec);
+}
+
+// Client gone: drop it from every wait list; if it led a flight, the
+// oldest waiter takes over and spawns.
+void CoreServer::leaveCgiFlights(EventLoop& loop, int clientFd)
+{
+	std::string ledKey;
+	bool led = false;
+
+	for (std::map<std::string, CgiFlight>::iterator it = _cgiFlights.begin(); it != _cgiFlights.end(); ++it)
+	{
+		std::vector<CgiWaiter>& ws = it->second.waiters;
+		for (std::size_t i = 0; i < ws.size(); )
+		{
+			if (ws[i].clientFd == clientFd)
+				ws.erase(ws.begin() + static_cast<std::ptrdiff_t>(i));
+			else
+				++i;
+		}
+
+		if (it->second.leaderFd == clientFd)
+		{
+			ledKey = it->first;
+			led = true;
+		}
+	}
+
+	if (!led)
+		return;
+
+	std::map<std::string, CgiFlight>::iterator it = _cgiFlights.find(ledKey);
+	if (it->second.waiters.empty())
+	{
+		_cgiFlights.erase(it);
+		return;
+	}
+
+	CgiWaiter w;
+	std::swap(w, it->second.waiters.front());
+	it->second.waiters.erase(it->second.waiters.begin());
+	it->second.leaderFd = w.clientFd;
+
+	Logger::info("CGI leader fd " + std::to_string(clientFd) + " left, fd " + std::to_string(w.clientFd) + " takes over");
+	startCgiWaiter(loop, ledKey, w);
+}
+
+void CoreServer::checkCgiFlights(EventLoop& loop)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::vector<std::pair<std::string, CgiWaiter> > expired;
+
+	for (std::map<std::string, CgiFlight>::iterator it = _cgiFlights.begin(); it != _cgiFlights.end(); ++it)
+	{
+		std::chrono::seconds wait(it->second.location->cgiCacheLockTimeout);
+		std::vector<CgiWaiter>& ws = it->second.waiters;
+
+		// waiters are in arrival order
+		std::size_t n = 0;
+		while (n < ws.size() && now - ws[n].since > wait)
+			++n;
+
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			expired.push_back(std::make_pair(it->first, CgiWaiter()));
+			std::swap(expired.back().second, ws[i]);
+		}
+		ws.erase(ws.begin(), ws.begin() + static_cast<std::ptrdiff_t>(n));
+	}
+
+	for (std::size_t i = 0; i < expired.size(); ++i)
+	{
+		Logger::warn("CGI cache lock timeout on fd " + std::to_string(expired[i].second.clientFd) + ", spawning on its own");
+		startCgiWaiter(loop, expired[i].first, expired[i].second);
+	}
+}
+
+// Once a minute when anything changed, and on shutdown.
+void CoreServer::logCgiCacheStats(bool force)
+{
+	std::size_t seen = _cgiCache.hits() + _cgiCache.misses() + _cgiCache.stale();
+	if (seen == _cgiCacheStatsSeen)
+		return;
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!force && now - _cgiCacheStatsAt < std::chrono::seconds(60))
+		return;
+
+	_cgiCacheStatsAt = now;
+	_cgiCacheStatsSeen = seen;
+
+	Logger::info("CGI cache: hits " + std::to_string(_cgiCache.hits())
+		+ ", misses " + std::to_string(_cgiCache.misses())
+		+ ", stale " + std::to_string(_cgiCache.stale())
+		+ ", entries " + std::to_string(_cgiCache.size()));
+}
+
+// ---------------- cgi_stream_body ----------------
+
+void CoreServer::feedCgiStream(EventLoop& loop, int clientFd)
+{
+	std::map<int, pid_t>::iterator itStream = _cgiStreamByClient.find(clientFd);
+	if (itStream == _cgiStreamByClient.end())
+		return;
+
+	pid_t pid = itStream->second;
+	std::map<pid_t, CgiProcess>::iterator it = _cgi.find(pid);
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (it == _cgi.end() || itCl == _clients.end())
+		return;
+
+	CgiProcess& p = it->second;
+	Client& client = itCl->second;
+
+	if (p.stdinOffset >= CGI_STDIN_HIGH_WATER)
+	{
+		p.stdinBuffer.erase(0, p.stdinOffset);
+		p.stdinOffset = 0;
+	}
+
+	std::size_t before = p.stdinBuffer.size();
+	bool done = false;
+
+	if (p.streamChunked)
+	{
+		HttpParser::Result r = p.decoder.feed(client.inBuffer, p.stdinBuffer);
+		if (r == HttpParser::BAD_REQUEST)
+		{
+			abortCgiStream(loop, pid, 400, "Bad Request");
+			return;
+		}
+		done = (r == HttpParser::OK);
+	}
+	else
+	{
+		std::size_t n = client.inBuffer.size();
+		if (n > p.streamLeft)
+			n = p.streamLeft;
+
+		p.stdinBuffer.append(client.inBuffer, 0, n);
+		client.inBuffer.erase(0, n);
+		p.streamLeft -= n;
+		done = (p.streamLeft == 0);
+	}
+
+	std::size_t added = p.stdinBuffer.size() - before;
+	p.streamReceived += added;
+
+	if (p.streamReceived > getServerConfig(p.serverIndex).clientMaxBodySize)
+	{
+		abortCgiStream(loop, pid, 413, "Payload Too Large");
+		return;
+	}
+
+	if (p.stdinFd < 0)
+	{
+		// the script closed its stdin: keep draining the socket, drop the data
+		p.stdinBuffer.clear();
+		p.stdinOffset = 0;
+	}
+	else if (added > 0)
+		loop.setWriteEnabled(p.stdinFd, true);
+
+	if (done)
+	{
+		p.stdinStreaming = false;
+		p.clientPaused = false;
+		_cgiStreamByClient.erase(clientFd);
+		loop.setReadEnabled(clientFd, false);
+
+		if (p.stdinFd >= 0 && p.stdinOffset >= p.stdinBuffer.size())
+			closeCgiStdin(loop, p);
+
+		finalizeCgiIfDone(loop, pid);
+		return;
+	}
+
+	if (client.peerClosed)
+	{
+		Logger::info("Client fd " + std::to_string(clientFd) + " closed during CGI upload");
+		closeClient(loop, clientFd);
+		return;
+	}
+
+	p.clientPaused = (p.stdinBuffer.size() - p.stdinOffset >= CGI_STDIN_HIGH_WATER);
+	loop.setReadEnabled(clientFd, !p.clientPaused);
+}
+
+void CoreServer::abortCgiStream(EventLoop& loop, pid_t pid, int status, const std::string& reason)
+{
+	std::map<pid_t, CgiProcess>::iterator it = _cgi.find(pid);
+	if (it == _cgi.end())
+		return;
+
+	int clientFd = it->second.clientFd;
+	std::string version = it->second.version;
+
+	Logger::warn("CGI upload on fd " + std::to_string(clientFd) + " aborted: " + std::to_string(status) + " " + reason);
+
+	it->second.killedByServer = true;
+	::kill(pid, SIGKILL);
+	cleanupCgi(loop, pid);
+
+	respondGatewayError(loop, clientFd, status, reason, version);
 }
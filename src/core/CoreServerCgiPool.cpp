@@ -0,0 +1,464 @@
+#include "core/CoreServer.hpp"
+#include "core/EventLoop.hpp"
+#include "core/Logger.hpp"
+#include "cgi/CgiRunner.hpp"
+
+#include <unistd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+#include <utility>
+#include <signal.h>
+#include <poll.h>
+
+// a pool whose workers keep dying before their first request is switched off
+static const std::size_t MAX_FAILED_STARTS = 3;
+
+static bool setNonBlockingFd(int fd)
+{
+	int flags = ::fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return false;
+	if (::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return false;
+	return true;
+}
+
+// "<stdoutLen> <stderrLen> <exitCode>\n" + stdout + stderr
+static bool takeWorkerReply(std::string& buf, std::string& out, std::string& err, int& code)
+{
+	std::size_t nl = buf.find('\n');
+	if (nl == std::string::npos)
+		return false;
+
+	const char* p = buf.c_str();
+	char* end = 0;
+
+	unsigned long long outLen = std::strtoull(p, &end, 10);
+	unsigned long long errLen = std::strtoull(end, &end, 10);
+	code = static_cast<int>(std::strtol(end, &end, 10));
+
+	std::size_t total = nl + 1 + static_cast<std::size_t>(outLen) + static_cast<std::size_t>(errLen);
+	if (buf.size() < total)
+		return false;
+
+	out.assign(buf, nl + 1, static_cast<std::size_t>(outLen));
+	err.assign(buf, nl + 1 + static_cast<std::size_t>(outLen), static_cast<std::size_t>(errLen));
+	buf.erase(0, total);
+	return true;
+}
+
+std::string CoreServer::cgiPoolKey(std::size_t serverIndex, std::size_t locIndex, const std::string& ext)
+{
+	return std::to_string(serverIndex) + "/" + std::to_string(locIndex) + "/" + ext;
+}
+
+bool CoreServer::isCgiPoolFd(int fd) const
+{
+	return (_cgiWorkerFds.find(fd) != _cgiWorkerFds.end());
+}
+
+void CoreServer::startCgiPools(EventLoop& loop)
+{
+	for (std::map<std::string, CgiWorkerPool>::iterator it = _cgiPools.begin(); it != _cgiPools.end(); ++it)
+	{
+		topUpCgiPool(loop, it->first);
+		Logger::info("CGI pool " + it->first + ": " + std::to_string(it->second.workers) + " workers");
+	}
+}
+
+bool CoreServer::spawnCgiWorker(EventLoop& loop, const std::string& poolKey)
+{
+	CgiWorkerPool& pool = _cgiPools[poolKey];
+
+	std::vector<std::string> env;
+	CgiRunner::Spawned sp;
+
+	if (!CgiRunner::spawnWithEnv(pool.interpreter, pool.bootstrap, env, sp))
+	{
+		Logger::error("CGI pool " + poolKey + ": cannot start worker");
+		return false;
+	}
+
+	CgiWorker w;
+	w.pid = sp.pid;
+	w.poolKey = poolKey;
+	w.ctlFd = sp.stdinFd;
+	w.outFd = sp.stdoutFd;
+	w.errFd = sp.stderrFd;
+	w.stderrLog.serverIndex = pool.serverIndex;
+	w.stderrLog.prefix = "[pool " + poolKey + " pid " + std::to_string((long long)w.pid) + "] ";
+
+	setNonBlockingFd(w.ctlFd);
+	setNonBlockingFd(w.outFd);
+	setNonBlockingFd(w.errFd);
+
+	_cgiWorkerFds[w.ctlFd] = w.pid;
+	_cgiWorkerFds[w.outFd] = w.pid;
+	_cgiWorkerFds[w.errFd] = w.pid;
+
+	loop.addFd(w.ctlFd, 0);
+	loop.addFd(w.outFd, POLLIN);
+	loop.addFd(w.errFd, POLLIN);
+
+	_cgiWorkers[w.pid] = w;
+	++pool.workers;
+	return true;
+}
+
+void CoreServer::topUpCgiPool(EventLoop& loop, const std::string& poolKey)
+{
+	std::map<std::string, CgiWorkerPool>::iterator it = _cgiPools.find(poolKey);
+	if (it == _cgiPools.end())
+		return;
+
+	while (!it->second.disabled && it->second.workers < it->second.size)
+	{
+		if (!spawnCgiWorker(loop, poolKey))
+			break;
+	}
+}
+
+void CoreServer::retireCgiWorker(EventLoop& loop, pid_t pid, bool killIt)
+{
+	std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.find(pid);
+	if (it == _cgiWorkers.end())
+		return;
+
+	CgiWorker& w = it->second;
+	finishCgiStderr(w.stderrLog);
+
+	int fds[3] = {w.ctlFd, w.outFd, w.errFd};
+	for (int i = 0; i < 3; ++i)
+	{
+		if (fds[i] < 0)
+			continue;
+		loop.removeFd(fds[i]);
+		::close(fds[i]);
+		_cgiWorkerFds.erase(fds[i]);
+	}
+
+	// without killIt the worker sees EOF on its control pipe and exits on its own
+	if (killIt)
+		::kill(pid, SIGKILL);
+
+	std::map<std::string, CgiWorkerPool>::iterator itp = _cgiPools.find(w.poolKey);
+	if (itp != _cgiPools.end() && itp->second.workers > 0)
+		--itp->second.workers;
+
+	_cgiWorkers.erase(it);
+}
+
+void CoreServer::submitCgiPoolJob(EventLoop& loop, const std::string& poolKey, CgiPoolJob& job)
+{
+	std::map<std::string, CgiWorkerPool>::iterator it = _cgiPools.find(poolKey);
+	if (it == _cgiPools.end() || it->second.disabled)
+	{
+		respondGatewayError(loop, job.clientFd, 502, "Bad Gateway", job.version);
+		return;
+	}
+
+	it->second.waiting.push_back(std::move(job));
+	it->second.waiting.back().queuedAt = std::chrono::steady_clock::now();
+
+	topUpCgiPool(loop, poolKey);
+	dispatchCgiPool(loop, poolKey);
+}
+
+void CoreServer::dispatchCgiPool(EventLoop& loop, const std::string& poolKey)
+{
+	std::map<std::string, CgiWorkerPool>::iterator itp = _cgiPools.find(poolKey);
+	if (itp == _cgiPools.end())
+		return;
+
+	CgiWorkerPool& pool = itp->second;
+
+	for (std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.begin(); it != _cgiWorkers.end() && !pool.waiting.empty(); ++it)
+	{
+		CgiWorker& w = it->second;
+		if (w.busy || w.poolKey != poolKey || w.ctlFd < 0)
+			continue;
+
+		CgiPoolJob& job = pool.waiting.front();
+
+		w.busy = true;
+		w.clientFd = job.clientFd;
+		w.method = job.method;
+		w.version = job.version;
+		w.outBuffer.swap(job.frame);
+		w.outBody.swap(job.body);
+		w.outOffset = 0;
+		w.inBuffer.clear();
+		w.startTime = std::chrono::steady_clock::now();
+
+		pool.waiting.pop_front();
+
+		loop.setWriteEnabled(w.ctlFd, true);
+	}
+}
+
+void CoreServer::handleCgiPoolWrite(EventLoop& loop, int fd)
+{
+	std::map<int, pid_t>::iterator itFd = _cgiWorkerFds.find(fd);
+	if (itFd == _cgiWorkerFds.end())
+		return;
+
+	std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.find(itFd->second);
+	if (it == _cgiWorkers.end())
+		return;
+
+	CgiWorker& w = it->second;
+	if (fd != w.ctlFd)
+		return;
+
+	std::size_t total = w.outBuffer.size() + w.outBody.size();
+
+	if (w.outOffset < total)
+	{
+		struct iovec iov[2];
+		int cnt = 0;
+
+		if (w.outOffset < w.outBuffer.size())
+		{
+			iov[cnt].iov_base = const_cast<char*>(w.outBuffer.data() + w.outOffset);
+			iov[cnt].iov_len = w.outBuffer.size() - w.outOffset;
+			++cnt;
+		}
+		std::size_t bodyOff = 0;
+		if (w.outOffset > w.outBuffer.size())
+			bodyOff = w.outOffset - w.outBuffer.size();
+		if (bodyOff < w.outBody.size())
+		{
+			iov[cnt].iov_base = const_cast<char*>(w.outBody.data() + bodyOff);
+			iov[cnt].iov_len = w.outBody.size() - bodyOff;
+			++cnt;
+		}
+
+		ssize_t n = ::writev(fd, iov, cnt);
+		if (n > 0)
+		{
+			w.outOffset += static_cast<std::size_t>(n);
+		}
+		else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			pid_t pid = w.pid;
+			int clientFd = w.clientFd;
+			std::string version = w.version;
+			std::string poolKey = w.poolKey;
+
+			Logger::error("CGI pool " + poolKey + ": worker " + std::to_string((long long)pid) + " control pipe broken");
+			retireCgiWorker(loop, pid, true);
+			if (clientFd >= 0)
+				respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+			topUpCgiPool(loop, poolKey);
+			dispatchCgiPool(loop, poolKey);
+			return;
+		}
+	}
+
+	if (w.outOffset >= total)
+	{
+		std::string().swap(w.outBuffer);
+		std::string().swap(w.outBody);
+		w.outOffset = 0;
+		loop.setWriteEnabled(fd, false);
+	}
+}
+
+void CoreServer::handleCgiPoolRead(EventLoop& loop, int fd)
+{
+	std::map<int, pid_t>::iterator itFd = _cgiWorkerFds.find(fd);
+	if (itFd == _cgiWorkerFds.end())
+		return;
+
+	pid_t pid = itFd->second;
+	std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.find(pid);
+	if (it == _cgiWorkers.end())
+		return;
+
+	CgiWorker& w = it->second;
+
+	if (fd == w.ctlFd)
+	{
+		// POLLERR/POLLHUP on the write end: the worker is gone
+		handleCgiPoolWrite(loop, fd);
+		return;
+	}
+
+	char buf[16384];
+	ssize_t n = ::read(fd, buf, sizeof(buf));
+
+	if (n > 0 && fd == w.errFd)
+	{
+		forwardCgiStderr(w.stderrLog, buf, static_cast<std::size_t>(n));
+		return;
+	}
+
+	if (n > 0)
+	{
+		w.inBuffer.append(buf, static_cast<std::size_t>(n));
+		if (w.busy)
+			completeCgiWorkerJob(loop, pid);
+		return;
+	}
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (fd == w.errFd)
+	{
+		loop.removeFd(fd);
+		::close(fd);
+		_cgiWorkerFds.erase(fd);
+		w.errFd = -1;
+		return;
+	}
+
+	// stdout closed: the worker died
+	std::string poolKey = w.poolKey;
+	int clientFd = w.busy ? w.clientFd : -1;
+	std::string version = w.version;
+
+	CgiWorkerPool& pool = _cgiPools[poolKey];
+	if (w.served == 0)
+	{
+		++pool.failedStarts;
+		if (pool.failedStarts >= MAX_FAILED_STARTS && !pool.disabled)
+		{
+			pool.disabled = true;
+			Logger::error("CGI pool " + poolKey + ": workers exit on startup, pool disabled");
+		}
+	}
+
+	Logger::warn("CGI pool " + poolKey + ": worker " + std::to_string((long long)pid) + " exited");
+	retireCgiWorker(loop, pid, true);
+
+	if (clientFd >= 0)
+		respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+
+	if (pool.disabled)
+	{
+		while (!pool.waiting.empty())
+		{
+			CgiPoolJob job = pool.waiting.front();
+			pool.waiting.pop_front();
+			respondGatewayError(loop, job.clientFd, 502, "Bad Gateway", job.version);
+		}
+		return;
+	}
+
+	topUpCgiPool(loop, poolKey);
+	dispatchCgiPool(loop, poolKey);
+}
+
+void CoreServer::completeCgiWorkerJob(EventLoop& loop, pid_t pid)
+{
+	std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.find(pid);
+	if (it == _cgiWorkers.end())
+		return;
+
+	CgiWorker& w = it->second;
+
+	std::string out;
+	std::string err;
+	int code = 0;
+
+	if (!takeWorkerReply(w.inBuffer, out, err, code))
+		return;
+
+	// the script's stderr of this request, then whatever the worker wrote
+	// itself; cgi_stderr_limit counts per request
+	if (!err.empty())
+	{
+		CgiStderrStream s;
+		s.serverIndex = w.stderrLog.serverIndex;
+		s.prefix = "[pool " + w.poolKey + " pid " + std::to_string((long long)pid) + " req " + std::to_string(++_cgiRequestSeq) + "] ";
+		forwardCgiStderr(s, err.data(), err.size());
+		finishCgiStderr(s);
+	}
+	finishCgiStderr(w.stderrLog);
+	w.stderrLog.logged = 0;
+
+	if (w.clientFd >= 0)
+		respondFromCgiOutput(loop, w.clientFd, out, w.method, w.version);
+
+	std::string poolKey = w.poolKey;
+	CgiWorkerPool& pool = _cgiPools[poolKey];
+	pool.failedStarts = 0;
+
+	w.busy = false;
+	w.clientFd = -1;
+	++w.served;
+
+	if (pool.maxRequests > 0 && w.served >= pool.maxRequests)
+	{
+		retireCgiWorker(loop, pid, false);
+		topUpCgiPool(loop, poolKey);
+	}
+
+	dispatchCgiPool(loop, poolKey);
+}
+
+void CoreServer::dropCgiPoolJobs(int clientFd)
+{
+	for (std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.begin(); it != _cgiWorkers.end(); ++it)
+	{
+		// the running script is left to finish, its reply is discarded
+		if (it->second.clientFd == clientFd)
+			it->second.clientFd = -1;
+	}
+
+	for (std::map<std::string, CgiWorkerPool>::iterator it = _cgiPools.begin(); it != _cgiPools.end(); ++it)
+	{
+		std::deque<CgiPoolJob>& q = it->second.waiting;
+		for (std::deque<CgiPoolJob>::iterator itq = q.begin(); itq != q.end();)
+		{
+			if (itq->clientFd == clientFd)
+				itq = q.erase(itq);
+			else
+				++itq;
+		}
+	}
+}
+
+void CoreServer::checkCgiPoolTimeouts(EventLoop& loop)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::vector<pid_t> stuck;
+	for (std::map<pid_t, CgiWorker>::iterator it = _cgiWorkers.begin(); it != _cgiWorkers.end(); ++it)
+	{
+		if (it->second.busy && now - it->second.startTime > _cgiTimeout)
+			stuck.push_back(it->first);
+	}
+
+	for (std::size_t i = 0; i < stuck.size(); ++i)
+	{
+		CgiWorker& w = _cgiWorkers[stuck[i]];
+		int clientFd = w.clientFd;
+		std::string version = w.version;
+		std::string poolKey = w.poolKey;
+
+		Logger::warn("CGI pool " + poolKey + ": worker " + std::to_string((long long)stuck[i]) + " timed out");
+		retireCgiWorker(loop, stuck[i], true);
+
+		if (clientFd >= 0)
+			respondGatewayError(loop, clientFd, 504, "Gateway Timeout", version);
+
+		topUpCgiPool(loop, poolKey);
+		dispatchCgiPool(loop, poolKey);
+	}
+
+	for (std::map<std::string, CgiWorkerPool>::iterator it = _cgiPools.begin(); it != _cgiPools.end(); ++it)
+	{
+		std::deque<CgiPoolJob>& q = it->second.waiting;
+		while (!q.empty() && now - q.front().queuedAt > _cgiTimeout)
+		{
+			CgiPoolJob job = q.front();
+			q.pop_front();
+			respondGatewayError(loop, job.clientFd, 504, "Gateway Timeout", job.version);
+		}
+	}
+}
@@ -2,12 +2,12 @@
 #include "core/EventLoop.hpp"
 #include "core/Logger.hpp"
 #include "http/IHttpHandler.hpp"
-#include "cgi/CgiRunner.hpp"
 #include "http/CgiResponseParser.hpp"
 #include "http/HttpError.hpp"
 #include "http/HttpResponse.hpp"
 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -19,8 +19,18 @@
 
 static const std::size_t MAX_HEADER_BYTES = 64 * 1024;
 
+// one sendfile() per writable event, so a big file does not starve others
+static const std::size_t SENDFILE_CHUNK = 1024 * 1024;
+
 // ---------------- small helpers ----------------
 
+static bool ignoresClientAbort(const ServerConfig& cfg, const CgiLaunchSpec& spec)
+{
+	if (spec.locationIndex >= cfg.locations.size())
+		return false;
+	return cfg.locations[spec.locationIndex].cgiIgnoreClientAbort;
+}
+
 static std::string toLowerStr(const std::string& s)
 {
 	std::string r = s;
@@ -108,13 +118,6 @@ static bool extractContentLength(const std::string& headersBlock, std::size_t& o
 }
 
 // ONLY for pre-check before full parsing: "Host:" presence (case-insensitive)
-static bool hasHostHeader(const std::string& headersBlock)
-{
-	std::string low = toLowerStr(headersBlock);
-	// host header is after request line -> search for CRLF + "host:"
-	return (low.find("\r\nhost:") != std::string::npos);
-}
-
 // ---------------- response helpers ----------------
 
 static std::string makePlainResponse(
@@ -155,13 +158,18 @@ static std::string makePlainResponse(
 	return res;
 }
 
-static void failClose(EventLoop& loop, int fd, Client& client,
-					  const std::string& version, const std::string& method,
+// Rejects a request before it is parsed, and closes: the server's error
+// response serialized at config load, or a plain one when it has none.
+static void failClose(EventLoop& loop, int fd, Client& client, const ServerConfig& cfg,
 					  int status, const std::string& reason, const std::string& body)
 {
 	std::string().swap(client.inBuffer);
 
-	client.outBuffer = makePlainResponse(version, method, status, reason, body);
+	const std::string* raw = HttpError::serialized(cfg, status, false);
+	if (raw != 0)
+		client.outBuffer = *raw;
+	else
+		client.outBuffer = makePlainResponse("HTTP/1.1", "GET", status, reason, body);
 	client.state = ConnectionState::WRITING;
 	client.closeAfterWrite = true;
 	client.outOffset = 0;
@@ -170,73 +178,6 @@ static void failClose(EventLoop& loop, int fd, Client& client,
 	loop.setWriteEnabled(fd, true);
 }
 
-// Backward-compatible overload: when we haven't parsed method/version yet.
-static void failClose(EventLoop& loop, int fd, Client& client,
-					  int status, const std::string& reason, const std::string& body)
-{
-	failClose(loop, fd, client, "HTTP/1.1", "GET", status, reason, body);
-}
-
-// ---------------- CGI state parsing ----------------
-
-static bool parseCgiStateData(
-	const std::string& s,
-	pid_t& pid,
-	int& stdinFd,
-	int& stdoutFd,
-	int& stderrFd,
-	std::string& method,
-	std::string& version,
-	std::string& body
-)
-{
-	if (s.size() < 4)
-		return false;
-	if (s.compare(0, 4, "CGI|") != 0)
-		return false;
-
-	std::size_t p0 = 4;
-	std::size_t p1 = s.find('|', p0);
-	if (p1 == std::string::npos) return false;
-	std::size_t p2 = s.find('|', p1 + 1);
-	if (p2 == std::string::npos) return false;
-	std::size_t p3 = s.find('|', p2 + 1);
-	if (p3 == std::string::npos) return false;
-	std::size_t p4 = s.find('|', p3 + 1);
-	if (p4 == std::string::npos) return false;
-	std::size_t p5 = s.find('|', p4 + 1);
-	if (p5 == std::string::npos) return false;
-	std::size_t p6 = s.find('|', p5 + 1);
-	if (p6 == std::string::npos) return false;
-
-	std::size_t nl = s.find('\n', p6 + 1);
-	if (nl == std::string::npos) return false;
-
-	long long pidll = std::atoll(s.substr(p0, p1 - p0).c_str());
-	pid = (pid_t)pidll;
-
-	stdinFd  = std::atoi(s.substr(p1 + 1, p2 - (p1 + 1)).c_str());
-	stdoutFd = std::atoi(s.substr(p2 + 1, p3 - (p2 + 1)).c_str());
-	stderrFd = std::atoi(s.substr(p3 + 1, p4 - (p3 + 1)).c_str());
-
-	method  = s.substr(p4 + 1, p5 - (p4 + 1));
-	version = s.substr(p5 + 1, p6 - (p5 + 1));
-
-	std::size_t lenPos = p6 + 1;
-	std::size_t lenEnd = nl;
-
-	std::size_t blen = 0;
-	if (!parseSizeTStrict(s.substr(lenPos, lenEnd - lenPos), blen))
-		return false;
-
-	std::size_t bodyPos = nl + 1;
-	if (s.size() < bodyPos + blen)
-		return false;
-
-	body = s.substr(bodyPos, blen);
-	return true;
-}
-
 // ---------------- CoreServer methods ----------------
 
 void CoreServer::handleNewConnection(EventLoop& loop, int listenFd)
@@ -334,6 +275,13 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 		return;
 	}
 
+	if (client.state == ConnectionState::CGI_PENDING
+		&& _cgiStreamByClient.find(fd) != _cgiStreamByClient.end())
+	{
+		feedCgiStream(loop, fd);
+		return;
+	}
+
 	if (client.inBuffer.empty())
 	{
 		if (client.peerClosed)
@@ -351,7 +299,7 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 	{
 		if (client.inBuffer.size() > MAX_HEADER_BYTES)
 		{
-			failClose(loop, fd, client, 431, "Request Header Fields Too Large", "Headers too large\n");
+			failClose(loop, fd, client, getServerConfig(client.serverConfigIndex), 431, "Request Header Fields Too Large", "Headers too large\n");
 			return;
 		}
 	}
@@ -360,7 +308,7 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 		std::size_t headerBytes = headersEnd + 4;
 		if (headerBytes > MAX_HEADER_BYTES)
 		{
-			failClose(loop, fd, client, 431, "Request Header Fields Too Large", "Headers too large\n");
+			failClose(loop, fd, client, getServerConfig(client.serverConfigIndex), 431, "Request Header Fields Too Large", "Headers too large\n");
 			return;
 		}
 		else
@@ -371,8 +319,7 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 			// IMPORTANT:
 			// Don't force Host-based server selection if Host is missing (nc tests often omit it).
 			// Let the real HTTP parser / handler decide (can return 400 later if strict HTTP/1.1).
-			if (hasHostHeader(headersBlock))
-				updateServerIndexFromHost(client);
+			updateServerIndexFromHost(client, headersEnd);
 
 			std::size_t idx = client.serverConfigIndex;
 			if (idx >= _serverConfigs.size())
@@ -385,7 +332,7 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 			{
 				if (contentLength > maxBody)
 				{
-					failClose(loop, fd, client, 413, "Payload Too Large", "Payload Too Large\n");
+					failClose(loop, fd, client, getServerConfig(client.serverConfigIndex), 413, "Payload Too Large", "Payload Too Large\n");
 					return;
 				}
 			}
@@ -395,7 +342,7 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 				std::size_t bodyBytes = client.inBuffer.size() - headerBytes;
 				if (bodyBytes > maxBody)
 				{
-					failClose(loop, fd, client, 413, "Payload Too Large", "Payload Too Large\n");
+					failClose(loop, fd, client, getServerConfig(client.serverConfigIndex), 413, "Payload Too Large", "Payload Too Large\n");
 					return;
 				}
 			}
@@ -407,48 +354,52 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 
 	if (_httpHandler != nullptr)
 	{
+		HandlerResult result;
+
 		_httpHandler->onDataReceived(
 			fd,
 			client.inBuffer,
-			client.outBuffer,
 			client.state,
 			client.serverConfigIndex,
-			client.sessionId
+			client.streamChecked,
+			result
 		);
 
 		if (client.state == ConnectionState::CGI_PENDING)
 		{
-			pid_t pid = -1;
-			int stdinFd = -1;
-			int stdoutFd = -1;
-			int stderrFd = -1;
-			std::string method;
-			std::string version;
-			std::string body;
-
-			if (!parseCgiStateData(client.sessionId, pid, stdinFd, stdoutFd, stderrFd, method, version, body))
-			{
-				failClose(loop, fd, client, 502, "Bad Gateway", "Bad Gateway\n");
-				return;
-			}
+			loop.setReadEnabled(fd, false);
+			loop.setWriteEnabled(fd, false);
 
-			registerCgiProcess(loop, pid, fd, stdinFd, stdoutFd, stderrFd, body);
+			// a streamed body keeps its first bytes in inBuffer
+			if (!result.cgi.streamBody)
+				std::string().swap(client.inBuffer);
 
-			std::map<pid_t, CgiProcess>::iterator itp = _cgi.find(pid);
-			if (itp != _cgi.end())
-			{
-				itp->second.method = method;
-				itp->second.version = version;
-			}
+			client.range.swap(result.cgi.range);
+			client.ifRange.swap(result.cgi.ifRange);
 
-			loop.setReadEnabled(fd, false);
-			loop.setWriteEnabled(fd, false);
+			// proxied responses pass through as the upstream sent them
+			const ServerConfig& srv = getServerConfig(client.serverConfigIndex);
+			client.location = 0;
+			client.acceptEncoding.swap(result.cgi.acceptEncoding);
+			if (result.cgi.backend != CgiLaunchSpec::PROXY && result.cgi.locationIndex < srv.locations.size())
+				client.location = &srv.locations[result.cgi.locationIndex];
+
+			// a streamed body keeps reading and sees EOF itself; a peer that
+			// already half-closed is still waiting for its answer
+			if (!result.cgi.streamBody && !client.peerClosed && !ignoresClientAbort(getServerConfig(client.serverConfigIndex), result.cgi))
+				loop.setHangupWatch(fd, true);
 
-			std::string().swap(client.inBuffer);
-			std::string().swap(client.sessionId);
+			startCgiBackend(loop, fd, result.cgi);
 			return;
 		}
 
+		if (client.state == ConnectionState::WRITING)
+		{
+			if (compressResponse(loop, fd, result.response, result.method, result.location, result.acceptEncoding, result.filePath))
+				return;
+			queueResponse(client, result.response);
+		}
+
 		if (client.state == ConnectionState::CLOSING)
 		{
 			closeClient(loop, fd);
@@ -482,6 +433,56 @@ void CoreServer::handleClientRead(EventLoop& loop, int fd)
 	}
 }
 
+// Materializes a planned response: headers (and an in-memory body) go to
+// outBuffer, a FILE body is opened here and follows with sendfile(). A file
+// that went away since the stat() is answered with 404 instead.
+void CoreServer::queueResponse(Client& client, HttpResponse& res)
+{
+	if (res.source.kind == BodySource::FILE)
+	{
+		int bodyFd = ::open(res.source.path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (bodyFd < 0)
+		{
+			Logger::warn("Cannot open " + res.source.path + " for fd " + std::to_string(client.fd));
+
+			HttpResponse err;
+			err.version = res.version;
+			HttpError::fill(err, getServerConfig(client.serverConfigIndex), 404, "Not Found");
+			err.headers["Connection"] = "close";
+			const std::string* raw = HttpError::prepared(getServerConfig(client.serverConfigIndex), err);
+			client.outBuffer = (raw != 0 ? *raw : err.serialize());
+			return;
+		}
+
+		if (client.sendFd >= 0)
+			::close(client.sendFd);
+		client.sendFd = bodyFd;
+		client.sendOffset = res.source.offset;
+		client.sendEnd = res.source.offset + res.source.length;
+		client.sendParts.clear();
+		client.sendPart = 0;
+
+		if (!res.source.parts.empty())
+		{
+			// the first part's head goes right after the headers
+			std::vector<BodyPart>& parts = res.source.parts;
+			client.outBuffer = res.serialize() + parts[0].head;
+			client.sendOffset = parts[0].offset;
+			client.sendEnd = parts[0].offset + parts[0].length;
+			client.sendParts.swap(parts);
+			client.sendPart = 1;
+			return;
+		}
+	}
+
+	// a stock error page goes out as serialized at config load
+	const std::string* raw = HttpError::prepared(getServerConfig(client.serverConfigIndex), res);
+	if (raw != 0)
+		client.outBuffer = *raw;
+	else
+		client.outBuffer = res.serialize();
+}
+
 void CoreServer::handleClientWrite(EventLoop& loop, int fd)
 {
 	std::map<int, Client>::iterator it = _clients.find(fd);
@@ -510,11 +511,61 @@ void CoreServer::handleClientWrite(EventLoop& loop, int fd)
 		}
 	}
 
+	if (client.outOffset >= client.outBuffer.size() && client.sendFd >= 0)
+	{
+		if (client.sendOffset < client.sendEnd)
+		{
+			std::size_t remain = static_cast<std::size_t>(client.sendEnd - client.sendOffset);
+			if (remain > SENDFILE_CHUNK)
+				remain = SENDFILE_CHUNK;
+
+			ssize_t n = ::sendfile(fd, client.sendFd, &client.sendOffset, remain);
+			if (n > 0)
+				client.lastActivity = std::chrono::steady_clock::now();
+			else
+			{
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return;
+				// n == 0: the file shrank under us, the length already went out
+				Logger::error("sendfile failed on fd " + std::to_string(fd));
+				closeClient(loop, fd);
+				return;
+			}
+		}
+
+		if (client.sendOffset < client.sendEnd)
+			return;
+
+		// next multipart/byteranges part: its head, then its range
+		if (client.sendPart < client.sendParts.size())
+		{
+			const BodyPart& p = client.sendParts[client.sendPart++];
+			client.outBuffer = p.head;
+			client.outOffset = 0;
+			client.sendOffset = p.offset;
+			client.sendEnd = p.offset + p.length;
+			return;
+		}
+
+		std::vector<BodyPart>().swap(client.sendParts);
+		client.sendPart = 0;
+		::close(client.sendFd);
+		client.sendFd = -1;
+	}
+
 	if (client.outOffset >= client.outBuffer.size())
 	{
 		client.outBuffer.clear();
 		client.outOffset = 0;
 
+		// proxy_buffering off: the upstream still has more for this client
+		if (client.state == ConnectionState::CGI_PENDING)
+		{
+			loop.setWriteEnabled(fd, false);
+			resumeProxyStream(loop, fd);
+			return;
+		}
+
 		if (client.closeAfterWrite || client.peerClosed)
 		{
 			closeClient(loop, fd);
@@ -522,13 +573,41 @@ void CoreServer::handleClientWrite(EventLoop& loop, int fd)
 		}
 
 		client.state = ConnectionState::READING;
+		client.hostResolved = false;
+		client.streamChecked = false;
 		loop.setWriteEnabled(fd, false);
 		loop.setReadEnabled(fd, true);
 	}
 }
 
+// POLLRDHUP while the client waits for a CGI: if the socket is at EOF the
+// client is gone, and closeClient() kills whatever backend works for it.
+void CoreServer::handleClientHangup(EventLoop& loop, int fd)
+{
+	std::map<int, Client>::iterator it = _clients.find(fd);
+	if (it == _clients.end())
+		return;
+
+	loop.setHangupWatch(fd, false);
+
+	if (it->second.state != ConnectionState::CGI_PENDING)
+		return;
+
+	char c;
+	ssize_t n = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+		return;
+
+	Logger::info("Client fd " + std::to_string(fd) + " disconnected while waiting for CGI");
+	closeClient(loop, fd);
+}
+
 void CoreServer::closeClient(EventLoop& loop, int fd)
 {
+	dropCgiLaunches(fd);
+	_cgiCacheTickets.erase(fd);
+	leaveCgiFlights(loop, fd);
+
 	std::vector<pid_t> toKill;
 
 	for (std::map<pid_t, CgiProcess>::iterator it = _cgi.begin(); it != _cgi.end(); ++it)
@@ -539,13 +618,23 @@ void CoreServer::closeClient(EventLoop& loop, int fd)
 
 	for (std::size_t i = 0; i < toKill.size(); ++i)
 	{
+		_cgi[toKill[i]].killedByServer = true;
 		::kill(toKill[i], SIGKILL);
 		cleanupCgi(loop, toKill[i]);
 	}
 
+	dropCgiPoolJobs(fd);
+	abortFastCgiRequest(loop, fd);
+	abortProxyRequest(loop, fd);
+	_compressWaiters.erase(fd);
+
 	std::map<int, Client>::iterator itc = _clients.find(fd);
 	if (itc != _clients.end())
+	{
+		if (itc->second.sendFd >= 0)
+			::close(itc->second.sendFd);
 		_clients.erase(itc);
+	}
 
 	loop.removeFd(fd);
 	::close(fd);
@@ -594,5 +683,12 @@ void CoreServer::checkTimeouts(EventLoop& loop)
 	}
 
 	checkCgiTimeouts(loop);
+	checkCgiPoolTimeouts(loop);
+	checkFastCgiTimeouts(loop);
+	checkProxyTimeouts(loop);
 	reapChildren(loop);
+	logCgiCacheStats(false);
+
+	for (std::map<std::size_t, CgiErrorLog>::iterator it = _cgiErrorLogs.begin(); it != _cgiErrorLogs.end(); ++it)
+		it->second.flush();
 }
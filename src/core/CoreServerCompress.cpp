@@ -0,0 +1,227 @@
+#include "core/CoreServer.hpp"
+#include "core/EventLoop.hpp"
+#include "core/Logger.hpp"
+
+// Up to this size a body is compressed right away on the loop; a few
+// milliseconds at most. Larger ones go to the pool.
+static const std::size_t COMPRESS_INLINE_MAX = 64 * 1024;
+static const std::size_t COMPRESS_THREADS = 2;
+
+void CoreServer::startCompressPool(EventLoop& loop)
+{
+	bool wanted = false;
+	for (std::size_t i = 0; i < _serverConfigs.size() && !wanted; ++i)
+	{
+		const ServerConfig& srv = _serverConfigs[i];
+		for (std::size_t j = 0; j < srv.locations.size(); ++j)
+		{
+			if (srv.locations[j].gzip || srv.locations[j].brotli)
+			{
+				wanted = true;
+				break;
+			}
+		}
+	}
+
+	if (!wanted)
+		return;
+
+	if (!_compressPool.start(COMPRESS_THREADS))
+	{
+		Logger::error("Cannot start compression pool, large bodies are compressed on the loop");
+		return;
+	}
+	loop.addFd(_compressPool.fd(), POLLIN);
+}
+
+bool CoreServer::isCompressFd(int fd) const
+{
+	return (fd >= 0 && fd == _compressPool.fd());
+}
+
+// gzip / brotli res for the client if loc asks for it. false: res is ready
+// to go out, compressed or not. true: the body went to the pool, the client
+// waits in CGI_PENDING and gets its response from handleCompressDone().
+bool CoreServer::compressResponse(
+	EventLoop& loop, int clientFd,
+	HttpResponse& res,
+	const std::string& method,
+	const LocationConfig* loc,
+	const std::string& acceptEncoding,
+	const std::string& filePath
+)
+{
+	if (!loc)
+		return false;
+
+	bool vary = false;
+	Compression::Coding coding = Compression::choose(*loc, res, method, acceptEncoding, vary);
+	if (vary)
+		Compression::addVary(res);
+	if (coding == Compression::NONE)
+		return false;
+
+	std::string key;
+	if (!filePath.empty())
+	{
+		std::map<std::string, std::string>::const_iterator itTag = res.headers.find("ETag");
+		if (itTag != res.headers.end())
+			key = CompressCache::makeKey(filePath, itTag->second, coding);
+	}
+
+	std::string body;
+	bool cached = (!key.empty() && _compressCache.lookup(key, body));
+
+	// HEAD: the GET headers, nothing is compressed for it
+	if (method == "HEAD")
+	{
+		Compression::applyHead(res, coding);
+		if (cached)
+			res.headers["Content-Length"] = std::to_string(body.size());
+		return false;
+	}
+
+	if (cached)
+	{
+		Compression::apply(res, coding, body);
+		return false;
+	}
+
+	int level = Compression::level(*loc, coding);
+	bool fromFile = (res.source.kind == BodySource::FILE);
+
+	if (res.bodyLength() <= COMPRESS_INLINE_MAX || !_compressPool.running())
+	{
+		bool ok;
+		if (fromFile)
+			ok = Compression::compressFile(coding, level, res.source, body);
+		else
+			ok = Compression::compress(coding, level, res.body, body);
+		if (!ok)
+		{
+			Logger::warn("Compression failed on fd " + std::to_string(clientFd) + ", sending the body as is");
+			return false;
+		}
+		if (!key.empty())
+			_compressCache.store(key, body);
+		Compression::apply(res, coding, body);
+		return false;
+	}
+
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return false;
+
+	unsigned long long id;
+	std::map<std::string, unsigned long long>::iterator itKey = _compressByKey.end();
+	if (!key.empty())
+		itKey = _compressByKey.find(key);
+
+	if (itKey != _compressByKey.end())
+		id = itKey->second;
+	else
+	{
+		id = ++_compressSeq;
+
+		CompressJobState& st = _compressJobs[id];
+		st.cacheKey = key;
+		st.coding = coding;
+		if (!key.empty())
+			_compressByKey[key] = id;
+
+		// the waiter keeps the original body in case the job fails; a file
+		// is read by the worker itself
+		CompressPool::Job job;
+		job.id = id;
+		job.coding = coding;
+		job.level = level;
+		if (fromFile)
+			job.source = res.source;
+		else
+			job.input = res.body;
+		_compressPool.submit(job);
+	}
+
+	_compressJobs[id].clients.push_back(clientFd);
+
+	CompressWaiter& w = _compressWaiters[clientFd];
+	w.job = id;
+	std::swap(w.response, res);
+
+	Client& client = itCl->second;
+	std::string().swap(client.inBuffer);
+	client.state = ConnectionState::CGI_PENDING;
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, false);
+	if (!client.peerClosed)
+		loop.setHangupWatch(clientFd, true);
+	return true;
+}
+
+void CoreServer::handleCompressDone(EventLoop& loop)
+{
+	std::vector<CompressPool::Job> done;
+	_compressPool.collect(done);
+
+	for (std::size_t i = 0; i < done.size(); ++i)
+	{
+		CompressPool::Job& job = done[i];
+
+		std::map<unsigned long long, CompressJobState>::iterator itJob = _compressJobs.find(job.id);
+		if (itJob == _compressJobs.end())
+			continue;
+
+		CompressJobState st;
+		std::swap(st, itJob->second);
+		_compressJobs.erase(itJob);
+
+		if (!st.cacheKey.empty())
+		{
+			_compressByKey.erase(st.cacheKey);
+			if (job.ok)
+				_compressCache.store(st.cacheKey, job.output);
+		}
+
+		if (!job.ok)
+			Logger::warn("Compression job " + std::to_string(job.id) + " failed, sending the body as is");
+
+		for (std::size_t j = 0; j < st.clients.size(); ++j)
+		{
+			int fd = st.clients[j];
+
+			// the client may be gone, or its fd reused by a later request
+			std::map<int, CompressWaiter>::iterator itW = _compressWaiters.find(fd);
+			if (itW == _compressWaiters.end() || itW->second.job != job.id)
+				continue;
+
+			HttpResponse res;
+			std::swap(res, itW->second.response);
+			_compressWaiters.erase(itW);
+
+			if (job.ok)
+			{
+				std::string body = job.output;
+				Compression::apply(res, st.coding, body);
+			}
+			sendCompressed(loop, fd, res);
+		}
+	}
+}
+
+void CoreServer::sendCompressed(EventLoop& loop, int clientFd, HttpResponse& res)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	// the write timeout counts from here, not from the request
+	Client& client = itCl->second;
+	client.lastActivity = std::chrono::steady_clock::now();
+	queueResponse(client, res);
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+	client.outOffset = 0;
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+}
@@ -0,0 +1,653 @@
+#include "core/CoreServer.hpp"
+#include "core/EventLoop.hpp"
+#include "core/Logger.hpp"
+#include "cgi/FastCgi.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <poll.h>
+
+// how much STDIN we queue on a connection before waiting for the socket to drain
+static const std::size_t FCGI_OUT_HIGH_WATER = 64 * 1024;
+static const std::size_t FCGI_STDIN_CHUNK = 32 * 1024;
+// how long an aborted request may hold its multiplex slot
+static const std::chrono::seconds FCGI_ABORT_GRACE(5);
+
+static bool setNonBlockingFd(int fd)
+{
+	int flags = ::fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return false;
+	if (::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return false;
+	return true;
+}
+
+// Queues ABORT_REQUEST for req. Its multiplex slot stays taken until the
+// application confirms with END_REQUEST, or until FCGI_ABORT_GRACE runs out.
+static void queueFastCgiAbort(FastCgiConnection& c, std::map<unsigned short, int>::iterator ita, FastCgiRequest& req)
+{
+	ita->second = -1;
+	c.aborted[req.requestId] = std::chrono::steady_clock::now();
+
+	if (!req.stdinDone)
+	{
+		FastCgi::appendStream(c.outBuffer, FastCgi::STDIN, req.requestId, 0, 0);
+		req.stdinDone = true;
+	}
+	FastCgi::appendAbortRequest(c.outBuffer, req.requestId);
+}
+
+// "unix:/path/app.sock" or "host:port"
+static int connectFastCgiSocket(const std::string& address, bool& inProgress)
+{
+	inProgress = false;
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		std::string path = address.substr(5);
+
+		sockaddr_un sa;
+		std::memset(&sa, 0, sizeof(sa));
+		if (path.size() >= sizeof(sa.sun_path))
+			return -1;
+
+		sa.sun_family = AF_UNIX;
+		std::memcpy(sa.sun_path, path.c_str(), path.size());
+
+		int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (!setNonBlockingFd(fd))
+		{
+			::close(fd);
+			return -1;
+		}
+
+		if (::connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) < 0)
+		{
+			if (errno != EINPROGRESS && errno != EAGAIN)
+			{
+				::close(fd);
+				return -1;
+			}
+			inProgress = true;
+		}
+		return fd;
+	}
+
+	std::size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		return -1;
+
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	addrinfo* res = 0;
+	if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+		return -1;
+
+	int fd = ::socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd < 0 || !setNonBlockingFd(fd))
+	{
+		if (fd >= 0)
+			::close(fd);
+		::freeaddrinfo(res);
+		return -1;
+	}
+
+	if (::connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		if (errno != EINPROGRESS)
+		{
+			::close(fd);
+			::freeaddrinfo(res);
+			return -1;
+		}
+		inProgress = true;
+	}
+
+	::freeaddrinfo(res);
+	return fd;
+}
+
+bool CoreServer::isFastCgiFd(int fd) const
+{
+	return (_fcgiConns.find(fd) != _fcgiConns.end());
+}
+
+void CoreServer::startFastCgi(EventLoop& loop, int clientFd, FastCgiRequest& req)
+{
+	const LocationConfig* loc = req.location;
+
+	FastCgiRequest& r0 = _fcgiRequests[clientFd];
+	r0 = std::move(req);
+	r0.clientFd = clientFd;
+	r0.startTime = std::chrono::steady_clock::now();
+	r0.stderrLog.serverIndex = r0.serverIndex;
+	r0.stderrLog.prefix = "[fastcgi " + loc->fastcgiPass + " req " + std::to_string(++_cgiRequestSeq) + "] ";
+
+	int r = dispatchFastCgi(loop, clientFd);
+	if (r < 0)
+	{
+		Logger::error("FastCGI connect failed: " + loc->fastcgiPass);
+		std::string version = _fcgiRequests[clientFd].version;
+		dropFastCgiRequest(_fcgiRequests.find(clientFd));
+		respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+		return;
+	}
+
+	if (r == 0)
+		_fcgiWaiting[loc->fastcgiPass].push_back(clientFd);
+}
+
+// 1 = sent to a connection, 0 = every pooled connection is busy, -1 = cannot connect
+int CoreServer::dispatchFastCgi(EventLoop& loop, int clientFd)
+{
+	std::map<int, FastCgiRequest>::iterator itr = _fcgiRequests.find(clientFd);
+	if (itr == _fcgiRequests.end())
+		return -1;
+
+	FastCgiRequest& req = itr->second;
+	const LocationConfig& loc = *req.location;
+
+	// least loaded live connection with a free multiplex slot
+	int connFd = -1;
+	std::size_t best = 0;
+	std::size_t count = 0;
+
+	for (std::map<int, FastCgiConnection>::iterator it = _fcgiConns.begin(); it != _fcgiConns.end(); ++it)
+	{
+		FastCgiConnection& c = it->second;
+		if (c.address != loc.fastcgiPass || c.broken)
+			continue;
+
+		++count;
+		if (c.active.size() >= loc.fastcgiMultiplex)
+			continue;
+
+		if (connFd < 0 || c.active.size() < best)
+		{
+			connFd = it->first;
+			best = c.active.size();
+		}
+	}
+
+	if (connFd < 0)
+	{
+		if (count >= loc.fastcgiPoolSize)
+			return 0;
+
+		connFd = openFastCgiConnection(loop, loc.fastcgiPass);
+		if (connFd < 0)
+			return -1;
+	}
+
+	FastCgiConnection& c = _fcgiConns[connFd];
+
+	unsigned short id = c.nextId;
+	while (id == 0 || c.active.find(id) != c.active.end())
+		++id;
+	c.nextId = static_cast<unsigned short>(id + 1);
+
+	c.active[id] = clientFd;
+
+	req.connFd = connFd;
+	req.requestId = id;
+	req.bodyOffset = 0;
+	req.stdinDone = false;
+
+	if (c.outOffset >= c.outBuffer.size())
+	{
+		c.outBuffer.clear();
+		c.outOffset = 0;
+	}
+
+	FastCgi::appendBeginRequest(c.outBuffer, id, true);
+	FastCgi::appendStream(c.outBuffer, FastCgi::PARAMS, id, req.params.data(), req.params.size());
+	if (!req.params.empty())
+		FastCgi::appendStream(c.outBuffer, FastCgi::PARAMS, id, 0, 0);
+
+	pumpFastCgiConnection(loop, c);
+
+	// the send failed: close the connection now rather than at the next
+	// sweep, and give this request one more try on another
+	if (c.broken)
+	{
+		c.active.erase(id);
+		req.connFd = -1;
+		closeFastCgiConnection(loop, connFd);
+
+		if (req.retried)
+			return -1;
+		req.retried = true;
+		return dispatchFastCgi(loop, clientFd);
+	}
+	return 1;
+}
+
+void CoreServer::dispatchFastCgiWaiting(EventLoop& loop, const std::string& address)
+{
+	// dispatchFastCgi() may close a broken connection, which queues its
+	// requests here again: the queue is looked up afresh every round
+	while (true)
+	{
+		std::map<std::string, std::deque<int> >::iterator itw = _fcgiWaiting.find(address);
+		if (itw == _fcgiWaiting.end())
+			return;
+		if (itw->second.empty())
+		{
+			_fcgiWaiting.erase(itw);
+			return;
+		}
+
+		int clientFd = itw->second.front();
+		itw->second.pop_front();
+
+		if (_fcgiRequests.find(clientFd) == _fcgiRequests.end())
+			continue;
+
+		int r = dispatchFastCgi(loop, clientFd);
+		if (r == 0)
+		{
+			_fcgiWaiting[address].push_front(clientFd);
+			return;
+		}
+
+		if (r < 0)
+		{
+			std::string version = _fcgiRequests[clientFd].version;
+			dropFastCgiRequest(_fcgiRequests.find(clientFd));
+			respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+		}
+	}
+}
+
+int CoreServer::openFastCgiConnection(EventLoop& loop, const std::string& address)
+{
+	bool inProgress = false;
+	int fd = connectFastCgiSocket(address, inProgress);
+	if (fd < 0)
+		return -1;
+
+	FastCgiConnection c;
+	c.fd = fd;
+	c.address = address;
+	c.connecting = inProgress;
+	c.lastActivity = std::chrono::steady_clock::now();
+
+	_fcgiConns[fd] = c;
+
+	if (inProgress)
+		loop.addFd(fd, POLLOUT);
+	else
+		loop.addFd(fd, POLLIN);
+
+	Logger::info("FastCGI connection fd " + std::to_string(fd) + " to " + address);
+	return fd;
+}
+
+void CoreServer::pumpFastCgiConnection(EventLoop& loop, FastCgiConnection& c)
+{
+	if (c.connecting || c.broken)
+		return;
+
+	while (true)
+	{
+		if (c.outOffset >= c.outBuffer.size())
+		{
+			c.outBuffer.clear();
+			c.outOffset = 0;
+		}
+
+		// top up with request bodies, one chunk per request per round
+		bool progress = true;
+		while (progress && c.outBuffer.size() - c.outOffset < FCGI_OUT_HIGH_WATER)
+		{
+			progress = false;
+
+			for (std::map<unsigned short, int>::iterator it = c.active.begin(); it != c.active.end(); ++it)
+			{
+				if (it->second < 0)
+					continue;
+
+				std::map<int, FastCgiRequest>::iterator itr = _fcgiRequests.find(it->second);
+				if (itr == _fcgiRequests.end())
+					continue;
+
+				FastCgiRequest& req = itr->second;
+				if (req.stdinDone)
+					continue;
+
+				std::size_t n = req.body.size() - req.bodyOffset;
+				if (n > FCGI_STDIN_CHUNK)
+					n = FCGI_STDIN_CHUNK;
+
+				if (n > 0)
+				{
+					FastCgi::appendStream(c.outBuffer, FastCgi::STDIN, it->first, req.body.data() + req.bodyOffset, n);
+					req.bodyOffset += n;
+				}
+
+				if (req.bodyOffset >= req.body.size())
+				{
+					FastCgi::appendStream(c.outBuffer, FastCgi::STDIN, it->first, 0, 0);
+					req.stdinDone = true;
+				}
+				progress = true;
+			}
+		}
+
+		if (c.outOffset >= c.outBuffer.size())
+			break;
+
+		ssize_t n = ::send(c.fd, c.outBuffer.data() + c.outOffset, c.outBuffer.size() - c.outOffset, 0);
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				c.broken = true;
+				return;
+			}
+			break;
+		}
+
+		c.outOffset += static_cast<std::size_t>(n);
+		c.lastActivity = std::chrono::steady_clock::now();
+
+		// socket buffer is full, wait for POLLOUT
+		if (c.outOffset < c.outBuffer.size())
+			break;
+	}
+
+	loop.setWriteEnabled(c.fd, c.outOffset < c.outBuffer.size());
+}
+
+void CoreServer::handleFastCgiWrite(EventLoop& loop, int fd)
+{
+	std::map<int, FastCgiConnection>::iterator it = _fcgiConns.find(fd);
+	if (it == _fcgiConns.end())
+		return;
+
+	FastCgiConnection& c = it->second;
+
+	if (c.connecting)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			Logger::error("FastCGI connect to " + c.address + " failed");
+			closeFastCgiConnection(loop, fd);
+			return;
+		}
+
+		c.connecting = false;
+		loop.setReadEnabled(fd, true);
+	}
+
+	pumpFastCgiConnection(loop, c);
+
+	if (c.broken)
+		closeFastCgiConnection(loop, fd);
+}
+
+void CoreServer::handleFastCgiRead(EventLoop& loop, int fd)
+{
+	std::map<int, FastCgiConnection>::iterator it = _fcgiConns.find(fd);
+	if (it == _fcgiConns.end())
+		return;
+
+	FastCgiConnection& c = it->second;
+
+	if (c.connecting)
+	{
+		handleFastCgiWrite(loop, fd);
+		return;
+	}
+
+	char buf[16384];
+
+	ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+	if (n <= 0)
+	{
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		closeFastCgiConnection(loop, fd);
+		return;
+	}
+
+	c.lastActivity = std::chrono::steady_clock::now();
+	c.inBuffer.append(buf, static_cast<std::size_t>(n));
+
+	std::size_t off = 0;
+	FastCgi::Record rec;
+	bool abortQueued = false;
+
+	while (FastCgi::takeRecord(c.inBuffer, off, rec))
+	{
+		std::map<unsigned short, int>::iterator ita = c.active.find(rec.requestId);
+		if (ita == c.active.end())
+			continue;
+
+		int clientFd = ita->second;
+		std::map<int, FastCgiRequest>::iterator itr = _fcgiRequests.end();
+		if (clientFd >= 0)
+			itr = _fcgiRequests.find(clientFd);
+
+		if (rec.type == FastCgi::STDOUT)
+		{
+			if (itr == _fcgiRequests.end())
+				continue;
+
+			FastCgiRequest& req = itr->second;
+			std::string why;
+			if (!bufferCgiOutput(req.output, _serverConfigs[req.serverIndex], rec.content.data(), rec.content.size(), why))
+			{
+				Logger::warn("FastCGI request to " + c.address + " aborted after "
+					+ std::to_string(req.output.outputSize) + " bytes of output: " + why);
+
+				// the connection is pumped once the records are taken
+				std::string version = req.version;
+				queueFastCgiAbort(c, ita, req);
+				abortQueued = true;
+				dropFastCgiRequest(itr);
+				respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+			}
+		}
+		else if (rec.type == FastCgi::STDERR)
+		{
+			if (itr != _fcgiRequests.end())
+				forwardCgiStderr(itr->second.stderrLog, rec.content.data(), rec.content.size());
+		}
+		else if (rec.type == FastCgi::END_REQUEST)
+		{
+			c.active.erase(ita);
+			c.aborted.erase(rec.requestId);
+
+			if (itr == _fcgiRequests.end())
+				continue;
+
+			FastCgiRequest& req = itr->second;
+
+			int appStatus = 0;
+			int protocolStatus = FastCgi::REQUEST_COMPLETE;
+			FastCgi::parseEndRequest(rec.content, appStatus, protocolStatus);
+
+			if (protocolStatus == FastCgi::OVERLOADED)
+				respondGatewayError(loop, clientFd, 503, "Service Unavailable", req.version);
+			else if (protocolStatus != FastCgi::REQUEST_COMPLETE)
+				respondGatewayError(loop, clientFd, 502, "Bad Gateway", req.version);
+			else if (req.output.spillFd >= 0)
+				respondFromCgiSpill(loop, clientFd, req.output, req.method, req.version);
+			else
+				respondFromCgiOutput(loop, clientFd, req.output.buffer, req.method, req.version);
+
+			dropFastCgiRequest(itr);
+		}
+	}
+
+	c.inBuffer.erase(0, off);
+
+	if (abortQueued)
+	{
+		pumpFastCgiConnection(loop, c);
+		if (c.broken)
+		{
+			closeFastCgiConnection(loop, fd);
+			return;
+		}
+	}
+
+	std::string address = c.address;
+	dispatchFastCgiWaiting(loop, address);
+}
+
+void CoreServer::closeFastCgiConnection(EventLoop& loop, int connFd)
+{
+	std::map<int, FastCgiConnection>::iterator it = _fcgiConns.find(connFd);
+	if (it == _fcgiConns.end())
+		return;
+
+	std::string address = it->second.address;
+	std::map<unsigned short, int> active;
+	active.swap(it->second.active);
+
+	loop.removeFd(connFd);
+	::close(connFd);
+	_fcgiConns.erase(it);
+
+	for (std::map<unsigned short, int>::iterator ita = active.begin(); ita != active.end(); ++ita)
+	{
+		int clientFd = ita->second;
+		if (clientFd < 0)
+			continue;
+
+		std::map<int, FastCgiRequest>::iterator itr = _fcgiRequests.find(clientFd);
+		if (itr == _fcgiRequests.end())
+			continue;
+
+		FastCgiRequest& req = itr->second;
+
+		// a pooled connection may have been closed by the application while idle:
+		// retry once on a fresh one if nothing came back yet
+		if (!req.retried && req.output.outputSize == 0)
+		{
+			req.retried = true;
+			req.connFd = -1;
+			_fcgiWaiting[address].push_front(clientFd);
+			continue;
+		}
+
+		std::string version = req.version;
+		dropFastCgiRequest(itr);
+		respondGatewayError(loop, clientFd, 502, "Bad Gateway", version);
+	}
+
+	dispatchFastCgiWaiting(loop, address);
+}
+
+void CoreServer::abortFastCgiRequest(EventLoop& loop, int clientFd)
+{
+	std::map<int, FastCgiRequest>::iterator itr = _fcgiRequests.find(clientFd);
+	if (itr == _fcgiRequests.end())
+		return;
+
+	FastCgiRequest& req = itr->second;
+
+	std::map<int, FastCgiConnection>::iterator itc = _fcgiConns.end();
+	if (req.connFd >= 0)
+		itc = _fcgiConns.find(req.connFd);
+
+	if (itc != _fcgiConns.end())
+	{
+		FastCgiConnection& c = itc->second;
+		std::map<unsigned short, int>::iterator ita = c.active.find(req.requestId);
+		if (ita != c.active.end())
+			queueFastCgiAbort(c, ita, req);
+
+		dropFastCgiRequest(itr);
+		pumpFastCgiConnection(loop, c);
+		if (c.broken)
+			closeFastCgiConnection(loop, c.fd);
+		return;
+	}
+
+	dropFastCgiRequest(itr);
+}
+
+// the spill file goes with the request, what is left of its stderr is logged
+void CoreServer::dropFastCgiRequest(std::map<int, FastCgiRequest>::iterator it)
+{
+	if (it == _fcgiRequests.end())
+		return;
+
+	FastCgiRequest& req = it->second;
+	if (req.output.spillFd >= 0)
+		::close(req.output.spillFd);
+	finishCgiStderr(req.stderrLog);
+
+	_fcgiRequests.erase(it);
+}
+
+void CoreServer::checkFastCgiTimeouts(EventLoop& loop)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::vector<int> expired;
+	for (std::map<int, FastCgiRequest>::iterator it = _fcgiRequests.begin(); it != _fcgiRequests.end(); ++it)
+	{
+		if (now - it->second.startTime > _cgiTimeout)
+			expired.push_back(it->first);
+	}
+
+	for (std::size_t i = 0; i < expired.size(); ++i)
+	{
+		int clientFd = expired[i];
+		std::string version = _fcgiRequests[clientFd].version;
+
+		Logger::warn("FastCGI timeout for client fd " + std::to_string(clientFd));
+		abortFastCgiRequest(loop, clientFd);
+		respondGatewayError(loop, clientFd, 504, "Gateway Timeout", version);
+	}
+
+	std::vector<int> idle;
+	for (std::map<int, FastCgiConnection>::iterator it = _fcgiConns.begin(); it != _fcgiConns.end(); ++it)
+	{
+		FastCgiConnection& c = it->second;
+		if (c.broken || (c.active.empty() && now - c.lastActivity > _fcgiIdleTimeout))
+		{
+			idle.push_back(it->first);
+			continue;
+		}
+
+		for (std::map<unsigned short, std::chrono::steady_clock::time_point>::iterator ita = c.aborted.begin(); ita != c.aborted.end(); ++ita)
+		{
+			if (now - ita->second > FCGI_ABORT_GRACE)
+			{
+				Logger::warn("FastCGI connection fd " + std::to_string(it->first) + " to " + c.address
+					+ ": no END_REQUEST for aborted request " + std::to_string(ita->first));
+				idle.push_back(it->first);
+				break;
+			}
+		}
+	}
+
+	for (std::size_t i = 0; i < idle.size(); ++i)
+		closeFastCgiConnection(loop, idle[i]);
+}
@@ -0,0 +1,910 @@
+#include "core/CoreServer.hpp"
+#include "core/EventLoop.hpp"
+#include "core/Logger.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <vector>
+#include <utility>
+#include <poll.h>
+
+static const std::size_t PROXY_READ_CHUNK = 64 * 1024;
+static const std::size_t PROXY_MAX_HEAD = 64 * 1024;
+
+// proxy_buffering off: stop reading the upstream while this much is still
+// queued for a slow client
+static const std::size_t PROXY_STREAM_HIGH_WATER = 256 * 1024;
+
+// a server that refused a connection is skipped this long (nginx fail_timeout)
+static const int PROXY_FAIL_TIMEOUT = 10;
+
+// ---------------- small helpers ----------------
+
+static std::string toLowerStr(const std::string& s)
+{
+	std::string r = s;
+	for (std::size_t i = 0; i < r.size(); ++i)
+		r[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(r[i])));
+	return r;
+}
+
+static bool setNonBlockingFd(int fd)
+{
+	int flags = ::fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return false;
+	if (::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return false;
+	return true;
+}
+
+// "host:port"
+static int connectProxySocket(const std::string& address, bool& inProgress)
+{
+	inProgress = false;
+
+	std::size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		return -1;
+
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	addrinfo* res = 0;
+	if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+		return -1;
+
+	int fd = ::socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || !setNonBlockingFd(fd))
+	{
+		if (fd >= 0)
+			::close(fd);
+		::freeaddrinfo(res);
+		return -1;
+	}
+
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (::connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		if (errno != EINPROGRESS)
+		{
+			::close(fd);
+			::freeaddrinfo(res);
+			return -1;
+		}
+		inProgress = true;
+	}
+
+	::freeaddrinfo(res);
+	return fd;
+}
+
+// Status line and headers of an upstream response. Hop-by-hop headers are
+// dropped here; the framing ones are reported through the out parameters.
+static bool parseUpstreamHead(
+	const std::string& head,
+	HttpResponse& res,
+	std::string& connection,
+	std::string& transferEncoding,
+	std::string& contentLength
+)
+{
+	std::size_t eol = head.find("\r\n");
+	std::string statusLine = head.substr(0, eol);
+
+	if (statusLine.compare(0, 5, "HTTP/") != 0)
+		return false;
+
+	std::size_t sp1 = statusLine.find(' ');
+	if (sp1 == std::string::npos || sp1 + 4 > statusLine.size())
+		return false;
+
+	for (std::size_t i = sp1 + 1; i < sp1 + 4; ++i)
+	{
+		if (!std::isdigit(static_cast<unsigned char>(statusLine[i])))
+			return false;
+	}
+
+	res.version = statusLine.substr(0, sp1);
+	res.status = std::atoi(statusLine.c_str() + sp1 + 1);
+	res.reason = "";
+	if (sp1 + 5 <= statusLine.size())
+		res.reason = statusLine.substr(sp1 + 5);
+	res.headers.clear();
+
+	std::size_t pos = eol;
+	while (pos != std::string::npos && pos < head.size())
+	{
+		pos += 2;
+		std::size_t end = head.find("\r\n", pos);
+		std::string line;
+		if (end == std::string::npos)
+			line = head.substr(pos);
+		else
+			line = head.substr(pos, end - pos);
+		pos = end;
+
+		if (line.empty())
+			continue;
+
+		std::size_t colon = line.find(':');
+		if (colon == std::string::npos || colon == 0)
+			return false;
+
+		std::string key = line.substr(0, colon);
+		std::string val = line.substr(colon + 1);
+		while (!val.empty() && (val[0] == ' ' || val[0] == '\t'))
+			val.erase(0, 1);
+		while (!val.empty() && (val[val.size() - 1] == ' ' || val[val.size() - 1] == '\t'))
+			val.erase(val.size() - 1);
+
+		std::string keyLower = toLowerStr(key);
+
+		if (keyLower == "connection")
+			connection = toLowerStr(val);
+		else if (keyLower == "transfer-encoding")
+			transferEncoding = toLowerStr(val);
+		else if (keyLower == "content-length")
+			contentLength = val;
+		else if (keyLower != "keep-alive" && keyLower != "proxy-connection"
+			&& keyLower != "trailer" && keyLower != "upgrade")
+			res.headers[key] = val;
+	}
+
+	return true;
+}
+
+static bool parseContentLength(const std::string& s, std::size_t& out)
+{
+	if (s.empty())
+		return false;
+
+	std::size_t v = 0;
+	for (std::size_t i = 0; i < s.size(); ++i)
+	{
+		if (!std::isdigit(static_cast<unsigned char>(s[i])))
+			return false;
+		if (v > (static_cast<std::size_t>(-1) - 9) / 10)
+			return false;
+		v = v * 10 + static_cast<std::size_t>(s[i] - '0');
+	}
+	out = v;
+	return true;
+}
+
+// ---------------- CoreServer methods ----------------
+
+bool CoreServer::isProxyFd(int fd) const
+{
+	return (_proxyConns.find(fd) != _proxyConns.end());
+}
+
+void CoreServer::startProxy(EventLoop& loop, int clientFd, ProxyRequest& req)
+{
+	ProxyRequest& r0 = _proxyRequests[clientFd];
+	r0 = std::move(req);
+	r0.clientFd = clientFd;
+	r0.startTime = std::chrono::steady_clock::now();
+
+	if (!dispatchProxy(loop, r0))
+		failProxyRequest(loop, clientFd, 502, "Bad Gateway");
+}
+
+// round-robin over the servers that did not fail recently; least_conn takes
+// the one with the fewest requests in flight, ties going round-robin
+std::string CoreServer::pickProxyServer(const UpstreamConfig& up)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::size_t n = up.servers.size();
+	std::size_t& next = _proxyNext[&up];
+
+	std::size_t best = n;
+	std::size_t bestBusy = 0;
+
+	for (std::size_t k = 0; k < n; ++k)
+	{
+		std::size_t i = (next + k) % n;
+		const std::string& addr = up.servers[i];
+
+		std::map<std::string, std::chrono::steady_clock::time_point>::const_iterator itd = _proxyDown.find(addr);
+		if (itd != _proxyDown.end() && now < itd->second)
+			continue;
+
+		std::size_t busy = 0;
+		std::map<std::string, std::size_t>::const_iterator itb = _proxyBusy.find(addr);
+		if (itb != _proxyBusy.end())
+			busy = itb->second;
+
+		if (best == n || (up.leastConn && busy < bestBusy))
+		{
+			best = i;
+			bestBusy = busy;
+		}
+		if (!up.leastConn)
+			break;
+	}
+
+	// everything is marked down: try the next one anyway
+	if (best == n)
+		best = next % n;
+
+	next = best + 1;
+	return up.servers[best];
+}
+
+// false = no server of the group could be connected to
+bool CoreServer::dispatchProxy(EventLoop& loop, ProxyRequest& req)
+{
+	const UpstreamConfig& up = *req.upstream;
+
+	while (req.attempts < up.servers.size())
+	{
+		std::string address = pickProxyServer(up);
+		++req.attempts;
+
+		int connFd = takeProxyConnection(loop, address);
+		if (connFd < 0)
+		{
+			Logger::error("proxy connect to " + address + " failed");
+			_proxyDown[address] = std::chrono::steady_clock::now() + std::chrono::seconds(PROXY_FAIL_TIMEOUT);
+			continue;
+		}
+
+		ProxyConnection& c = _proxyConns[connFd];
+		c.clientFd = req.clientFd;
+		++_proxyBusy[address];
+
+		req.connFd = connFd;
+		req.address = address;
+		req.outOffset = 0;
+		req.lastProgress = std::chrono::steady_clock::now();
+
+		if (!c.connecting)
+			pumpProxyRequest(loop, req);
+		return true;
+	}
+
+	return false;
+}
+
+// an idle pooled connection to address, or a new one
+int CoreServer::takeProxyConnection(EventLoop& loop, const std::string& address)
+{
+	std::map<std::string, std::vector<int> >::iterator iti = _proxyIdle.find(address);
+	if (iti != _proxyIdle.end() && !iti->second.empty())
+	{
+		int fd = iti->second.back();
+		iti->second.pop_back();
+		if (iti->second.empty())
+			_proxyIdle.erase(iti);
+
+		loop.setWriteEnabled(fd, true);
+		return fd;
+	}
+
+	bool inProgress = false;
+	int fd = connectProxySocket(address, inProgress);
+	if (fd < 0)
+		return -1;
+
+	ProxyConnection c;
+	c.fd = fd;
+	c.address = address;
+	c.connecting = inProgress;
+	c.lastActivity = std::chrono::steady_clock::now();
+
+	_proxyConns[fd] = c;
+
+	if (inProgress)
+		loop.addFd(fd, POLLOUT);
+	else
+		loop.addFd(fd, POLLIN | POLLOUT);
+
+	Logger::info("proxy connection fd " + std::to_string(fd) + " to " + address);
+	return fd;
+}
+
+void CoreServer::pumpProxyRequest(EventLoop& loop, ProxyRequest& req)
+{
+	int connFd = req.connFd;
+
+	while (req.outOffset < req.out.size())
+	{
+		ssize_t n = ::send(connFd, req.out.data() + req.outOffset, req.out.size() - req.outOffset, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			proxyConnectionLost(loop, connFd);
+			return;
+		}
+
+		req.outOffset += static_cast<std::size_t>(n);
+		req.lastProgress = std::chrono::steady_clock::now();
+		_proxyConns[connFd].lastActivity = req.lastProgress;
+	}
+
+	loop.setWriteEnabled(connFd, req.outOffset < req.out.size());
+}
+
+void CoreServer::handleProxyWrite(EventLoop& loop, int fd)
+{
+	std::map<int, ProxyConnection>::iterator it = _proxyConns.find(fd);
+	if (it == _proxyConns.end())
+		return;
+
+	ProxyConnection& c = it->second;
+
+	if (c.connecting)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		{
+			Logger::error("proxy connect to " + c.address + " failed");
+			_proxyDown[c.address] = std::chrono::steady_clock::now() + std::chrono::seconds(PROXY_FAIL_TIMEOUT);
+			proxyConnectionLost(loop, fd);
+			return;
+		}
+
+		c.connecting = false;
+		_proxyDown.erase(c.address);
+		loop.setReadEnabled(fd, true);
+	}
+
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.end();
+	if (c.clientFd >= 0)
+		itr = _proxyRequests.find(c.clientFd);
+
+	if (itr == _proxyRequests.end())
+	{
+		loop.setWriteEnabled(fd, false);
+		return;
+	}
+
+	pumpProxyRequest(loop, itr->second);
+}
+
+void CoreServer::handleProxyRead(EventLoop& loop, int fd)
+{
+	std::map<int, ProxyConnection>::iterator it = _proxyConns.find(fd);
+	if (it == _proxyConns.end())
+		return;
+
+	ProxyConnection& c = it->second;
+
+	if (c.connecting)
+	{
+		handleProxyWrite(loop, fd);
+		return;
+	}
+
+	char buf[PROXY_READ_CHUNK];
+
+	ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	// idle in the pool: EOF, or bytes nobody asked for
+	if (c.clientFd < 0)
+	{
+		closeProxyConnection(loop, fd);
+		return;
+	}
+
+	if (n <= 0)
+	{
+		proxyConnectionLost(loop, fd);
+		return;
+	}
+
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(c.clientFd);
+	if (itr == _proxyRequests.end())
+	{
+		closeProxyConnection(loop, fd);
+		return;
+	}
+
+	ProxyRequest& req = itr->second;
+	c.lastActivity = std::chrono::steady_clock::now();
+	req.lastProgress = c.lastActivity;
+	req.inBuffer.append(buf, static_cast<std::size_t>(n));
+
+	processProxyResponse(loop, req);
+}
+
+void CoreServer::processProxyResponse(EventLoop& loop, ProxyRequest& req)
+{
+	while (!req.headersDone)
+	{
+		std::size_t headEnd = req.inBuffer.find("\r\n\r\n");
+		if (headEnd == std::string::npos)
+		{
+			if (req.inBuffer.size() > PROXY_MAX_HEAD)
+			{
+				Logger::warn("proxy: oversized response head from " + req.address);
+				failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+			}
+			return;
+		}
+
+		std::string connection;
+		std::string transferEncoding;
+		std::string contentLength;
+
+		if (!parseUpstreamHead(req.inBuffer.substr(0, headEnd), req.response, connection, transferEncoding, contentLength))
+		{
+			Logger::warn("proxy: malformed response head from " + req.address);
+			failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+			return;
+		}
+		req.inBuffer.erase(0, headEnd + 4);
+
+		int status = req.response.status;
+
+		// 100 Continue and friends: the final response follows
+		if (status >= 100 && status < 200 && status != 101)
+			continue;
+		if (status == 101)
+		{
+			Logger::warn("proxy: protocol upgrade from " + req.address + " is not supported");
+			failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+			return;
+		}
+
+		if (req.method == "HEAD" || status == 204 || status == 304)
+			req.bodyMode = ProxyRequest::NO_BODY;
+		else if (!transferEncoding.empty())
+		{
+			if (transferEncoding.find("chunked") == std::string::npos)
+			{
+				failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+				return;
+			}
+			req.bodyMode = ProxyRequest::CHUNKED;
+		}
+		else if (!contentLength.empty())
+		{
+			if (!parseContentLength(contentLength, req.bodyLeft))
+			{
+				failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+				return;
+			}
+			req.bodyMode = ProxyRequest::LENGTH;
+		}
+		else
+			req.bodyMode = ProxyRequest::UNTIL_CLOSE;
+
+		// HEAD/304 keep the length of the entity they describe
+		if (!contentLength.empty() && req.bodyMode != ProxyRequest::CHUNKED)
+			req.response.headers["Content-Length"] = contentLength;
+
+		if (req.response.version == "HTTP/1.1")
+			req.upstreamKeepAlive = (connection.find("close") == std::string::npos);
+		else
+			req.upstreamKeepAlive = (connection.find("keep-alive") != std::string::npos);
+		if (req.bodyMode == ProxyRequest::UNTIL_CLOSE)
+			req.upstreamKeepAlive = false;
+
+		req.headersDone = true;
+
+		if (!req.location->proxyBuffering)
+			startProxyStream(loop, req);
+	}
+
+	std::string data;
+	bool done = false;
+
+	if (req.bodyMode == ProxyRequest::NO_BODY)
+		done = true;
+	else if (req.bodyMode == ProxyRequest::LENGTH)
+	{
+		std::size_t n = req.inBuffer.size();
+		if (n > req.bodyLeft)
+			n = req.bodyLeft;
+
+		if (n == req.inBuffer.size())
+			data.swap(req.inBuffer);
+		else
+		{
+			data.assign(req.inBuffer, 0, n);
+			req.inBuffer.erase(0, n);
+		}
+		req.bodyLeft -= n;
+		done = (req.bodyLeft == 0);
+	}
+	else if (req.bodyMode == ProxyRequest::CHUNKED)
+	{
+		if (req.chunked.feed(req.inBuffer, data) == HttpParser::BAD_REQUEST)
+		{
+			Logger::warn("proxy: bad chunked body from " + req.address);
+			failProxyRequest(loop, req.clientFd, 502, "Bad Gateway");
+			return;
+		}
+		done = req.chunked.done();
+	}
+	else
+		data.swap(req.inBuffer);
+
+	if (!data.empty())
+	{
+		if (req.streaming)
+			appendProxyStream(loop, req, data);
+		else
+		{
+			req.response.body.append(data);
+			if (req.response.body.size() > req.location->proxyBufferSize)
+				startProxyStream(loop, req);
+		}
+	}
+
+	if (done)
+		finishProxyResponse(loop, req.clientFd, req.upstreamKeepAlive && req.inBuffer.empty());
+}
+
+// Headers (and whatever body is buffered) go to the client now, the rest
+// of the body follows as it arrives. Without an upstream length the body
+// ends when the connection closes.
+void CoreServer::startProxyStream(EventLoop& loop, ProxyRequest& req)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(req.clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+	HttpResponse& res = req.response;
+
+	if (!req.version.empty())
+		res.version = req.version;
+	else
+		res.version = "HTTP/1.1";
+	res.headers["Connection"] = "close";
+
+	client.outBuffer = res.serialize();
+	client.outOffset = 0;
+	client.closeAfterWrite = false;
+	std::string().swap(res.body);
+
+	req.streaming = true;
+	loop.setWriteEnabled(req.clientFd, true);
+}
+
+void CoreServer::appendProxyStream(EventLoop& loop, ProxyRequest& req, const std::string& data)
+{
+	std::map<int, Client>::iterator itCl = _clients.find(req.clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+
+	if (client.outOffset > 0)
+	{
+		client.outBuffer.erase(0, client.outOffset);
+		client.outOffset = 0;
+	}
+	client.outBuffer.append(data);
+	loop.setWriteEnabled(req.clientFd, true);
+
+	// resumeProxyStream() re-enables it once the client drained its buffer
+	if (client.outBuffer.size() > PROXY_STREAM_HIGH_WATER && req.connFd >= 0)
+		loop.setReadEnabled(req.connFd, false);
+}
+
+// called by handleClientWrite() when a streaming client's buffer is empty
+void CoreServer::resumeProxyStream(EventLoop& loop, int clientFd)
+{
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(clientFd);
+	if (itr == _proxyRequests.end() || itr->second.connFd < 0)
+		return;
+
+	itr->second.lastProgress = std::chrono::steady_clock::now();
+	loop.setReadEnabled(itr->second.connFd, true);
+}
+
+void CoreServer::finishProxyResponse(EventLoop& loop, int clientFd, bool reusable)
+{
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(clientFd);
+	if (itr == _proxyRequests.end())
+		return;
+
+	ProxyRequest& req = itr->second;
+
+	if (req.connFd >= 0)
+		releaseProxyConnection(loop, req.connFd, reusable);
+
+	HttpResponse res;
+	std::swap(res, req.response);
+	bool streaming = req.streaming;
+	ProxyRequest::BodyMode bodyMode = req.bodyMode;
+	std::string method = req.method;
+	std::string version = req.version;
+	_proxyRequests.erase(itr);
+
+	std::map<int, Client>::iterator itCl = _clients.find(clientFd);
+	if (itCl == _clients.end())
+		return;
+
+	Client& client = itCl->second;
+
+	client.state = ConnectionState::WRITING;
+	client.closeAfterWrite = true;
+
+	if (!streaming)
+	{
+		if (!version.empty())
+			res.version = version;
+		else
+			res.version = "HTTP/1.1";
+		res.headers["Connection"] = "close";
+
+		if (bodyMode == ProxyRequest::CHUNKED || bodyMode == ProxyRequest::UNTIL_CLOSE)
+			res.headers["Content-Length"] = std::to_string(res.body.size());
+
+		if (method == "HEAD")
+			res.body.clear();
+
+		client.outBuffer = res.serialize();
+		client.outOffset = 0;
+	}
+
+	loop.setReadEnabled(clientFd, false);
+	loop.setWriteEnabled(clientFd, true);
+}
+
+// The response can no longer be completed: an error page, or for a stream
+// whose headers already went out, closing the client.
+void CoreServer::failProxyRequest(EventLoop& loop, int clientFd, int status, const std::string& reason)
+{
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(clientFd);
+	if (itr == _proxyRequests.end())
+		return;
+
+	int connFd = itr->second.connFd;
+	bool streaming = itr->second.streaming;
+	std::string version = itr->second.version;
+	_proxyRequests.erase(itr);
+
+	if (connFd >= 0)
+		closeProxyConnection(loop, connFd);
+
+	if (streaming)
+		closeClient(loop, clientFd);
+	else
+		respondGatewayError(loop, clientFd, status, reason, version);
+}
+
+// EOF or a socket error on a connection that serves a request
+void CoreServer::proxyConnectionLost(EventLoop& loop, int connFd)
+{
+	std::map<int, ProxyConnection>::iterator it = _proxyConns.find(connFd);
+	if (it == _proxyConns.end())
+		return;
+
+	int clientFd = it->second.clientFd;
+	bool reused = it->second.reused;
+
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.end();
+	if (clientFd >= 0)
+		itr = _proxyRequests.find(clientFd);
+
+	if (itr == _proxyRequests.end())
+	{
+		closeProxyConnection(loop, connFd);
+		return;
+	}
+
+	ProxyRequest& req = itr->second;
+
+	if (req.headersDone && req.bodyMode == ProxyRequest::UNTIL_CLOSE)
+	{
+		req.connFd = -1;
+		closeProxyConnection(loop, connFd);
+		finishProxyResponse(loop, clientFd, false);
+		return;
+	}
+
+	if (req.headersDone || !req.inBuffer.empty())
+	{
+		Logger::warn("proxy: " + req.address + " closed the connection mid-response");
+		failProxyRequest(loop, clientFd, 502, "Bad Gateway");
+		return;
+	}
+
+	req.connFd = -1;
+	closeProxyConnection(loop, connFd);
+
+	// nothing came back yet: a pooled connection was most likely closed by
+	// the upstream while idle, retry once on a fresh one without counting
+	// it as a try of the group
+	if (reused && !req.retried)
+	{
+		req.retried = true;
+		--req.attempts;
+	}
+
+	if (!dispatchProxy(loop, req))
+		failProxyRequest(loop, clientFd, 502, "Bad Gateway");
+}
+
+void CoreServer::releaseProxyConnection(EventLoop& loop, int connFd, bool reusable)
+{
+	std::map<int, ProxyConnection>::iterator it = _proxyConns.find(connFd);
+	if (it == _proxyConns.end())
+		return;
+
+	ProxyConnection& c = it->second;
+
+	std::size_t keepalive = 0;
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(c.clientFd);
+	if (itr != _proxyRequests.end())
+		keepalive = itr->second.upstream->keepalive;
+
+	std::vector<int>& idle = _proxyIdle[c.address];
+	if (!reusable || idle.size() >= keepalive)
+	{
+		if (idle.empty())
+			_proxyIdle.erase(c.address);
+		closeProxyConnection(loop, connFd);
+		return;
+	}
+
+	std::map<std::string, std::size_t>::iterator itb = _proxyBusy.find(c.address);
+	if (itb != _proxyBusy.end() && --itb->second == 0)
+		_proxyBusy.erase(itb);
+
+	c.clientFd = -1;
+	c.reused = true;
+	c.lastActivity = std::chrono::steady_clock::now();
+	idle.push_back(connFd);
+
+	// idle: only watch for the upstream closing it
+	loop.setWriteEnabled(connFd, false);
+	loop.setReadEnabled(connFd, true);
+}
+
+void CoreServer::closeProxyConnection(EventLoop& loop, int connFd)
+{
+	std::map<int, ProxyConnection>::iterator it = _proxyConns.find(connFd);
+	if (it == _proxyConns.end())
+		return;
+
+	ProxyConnection& c = it->second;
+
+	if (c.clientFd >= 0)
+	{
+		std::map<std::string, std::size_t>::iterator itb = _proxyBusy.find(c.address);
+		if (itb != _proxyBusy.end() && --itb->second == 0)
+			_proxyBusy.erase(itb);
+	}
+	else
+	{
+		std::map<std::string, std::vector<int> >::iterator iti = _proxyIdle.find(c.address);
+		if (iti != _proxyIdle.end())
+		{
+			for (std::size_t i = 0; i < iti->second.size(); ++i)
+			{
+				if (iti->second[i] == connFd)
+				{
+					iti->second.erase(iti->second.begin() + static_cast<std::ptrdiff_t>(i));
+					break;
+				}
+			}
+			if (iti->second.empty())
+				_proxyIdle.erase(iti);
+		}
+	}
+
+	loop.removeFd(connFd);
+	::close(connFd);
+	_proxyConns.erase(it);
+}
+
+// the client went away: the upstream connection is mid-request and cannot
+// be reused
+void CoreServer::abortProxyRequest(EventLoop& loop, int clientFd)
+{
+	std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(clientFd);
+	if (itr == _proxyRequests.end())
+		return;
+
+	int connFd = itr->second.connFd;
+	_proxyRequests.erase(itr);
+
+	if (connFd >= 0)
+		closeProxyConnection(loop, connFd);
+}
+
+void CoreServer::checkProxyTimeouts(EventLoop& loop)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::vector<int> expired;
+	for (std::map<int, ProxyRequest>::iterator it = _proxyRequests.begin(); it != _proxyRequests.end(); ++it)
+	{
+		ProxyRequest& req = it->second;
+		const LocationConfig& loc = *req.location;
+
+		std::map<int, ProxyConnection>::iterator itc = _proxyConns.find(req.connFd);
+		if (itc == _proxyConns.end())
+			continue;
+
+		std::chrono::steady_clock::duration quiet = now - req.lastProgress;
+
+		if (itc->second.connecting)
+		{
+			if (quiet > std::chrono::seconds(loc.proxyConnectTimeout))
+				expired.push_back(it->first);
+			continue;
+		}
+
+		if (req.outOffset < req.out.size())
+		{
+			if (quiet > std::chrono::seconds(loc.proxySendTimeout))
+				expired.push_back(it->first);
+			continue;
+		}
+
+		// a stream paused for a slow client is the client's timeout
+		if (req.streaming)
+		{
+			std::map<int, Client>::iterator itCl = _clients.find(it->first);
+			if (itCl != _clients.end() && itCl->second.outOffset < itCl->second.outBuffer.size())
+				continue;
+		}
+
+		if (quiet > std::chrono::seconds(loc.proxyReadTimeout))
+			expired.push_back(it->first);
+	}
+
+	for (std::size_t i = 0; i < expired.size(); ++i)
+	{
+		std::map<int, ProxyRequest>::iterator itr = _proxyRequests.find(expired[i]);
+		if (itr == _proxyRequests.end())
+			continue;
+
+		ProxyRequest& req = itr->second;
+		int connFd = req.connFd;
+		bool connecting = _proxyConns[connFd].connecting;
+
+		if (connecting)
+		{
+			Logger::warn("proxy connect timeout to " + req.address);
+			_proxyDown[req.address] = now + std::chrono::seconds(PROXY_FAIL_TIMEOUT);
+
+			req.connFd = -1;
+			closeProxyConnection(loop, connFd);
+			if (dispatchProxy(loop, req))
+				continue;
+		}
+		else
+			Logger::warn("proxy timeout from " + req.address + " for client fd " + std::to_string(expired[i]));
+
+		failProxyRequest(loop, expired[i], 504, "Gateway Timeout");
+	}
+
+	std::vector<int> idle;
+	for (std::map<int, ProxyConnection>::iterator it = _proxyConns.begin(); it != _proxyConns.end(); ++it)
+	{
+		if (it->second.clientFd < 0 && now - it->second.lastActivity > _proxyIdleTimeout)
+			idle.push_back(it->first);
+	}
+
+	for (std::size_t i = 0; i < idle.size(); ++i)
+		closeProxyConnection(loop, idle[i]);
+}
@@ -20,6 +20,8 @@ bool CoreServer::stopRequested()
 
 void CoreServer::shutdown(EventLoop& loop)
 {
+	logCgiCacheStats(true);
+
 	std::vector<pid_t> pids;
 	pids.reserve(_cgi.size());
 
@@ -30,12 +32,58 @@ void CoreServer::shutdown(EventLoop& loop)
 
 	for(std::size_t i=0;i<pids.size();++i)
 	{
+		_cgi[pids[i]].killedByServer=true;
 		::kill(pids[i],SIGKILL);
 		cleanupCgi(loop,pids[i]);
 	}
 
+	std::vector<pid_t> workers;
+	for(std::map<pid_t,CgiWorker>::iterator it=_cgiWorkers.begin();it!=_cgiWorkers.end();++it)
+	{
+		workers.push_back(it->first);
+	}
+
+	for(std::size_t i=0;i<workers.size();++i)
+	{
+		retireCgiWorker(loop,workers[i],true);
+	}
+
 	reapChildren(loop);
 
+	std::vector<int> fcgiFds;
+	for(std::map<int,FastCgiConnection>::iterator it=_fcgiConns.begin();it!=_fcgiConns.end();++it)
+	{
+		fcgiFds.push_back(it->first);
+	}
+
+	_fcgiRequests.clear();
+	_fcgiWaiting.clear();
+
+	for(std::size_t i=0;i<fcgiFds.size();++i)
+	{
+		closeFastCgiConnection(loop,fcgiFds[i]);
+	}
+
+	std::vector<int> proxyFds;
+	for(std::map<int,ProxyConnection>::iterator it=_proxyConns.begin();it!=_proxyConns.end();++it)
+	{
+		proxyFds.push_back(it->first);
+	}
+
+	_proxyRequests.clear();
+
+	for(std::size_t i=0;i<proxyFds.size();++i)
+	{
+		closeProxyConnection(loop,proxyFds[i]);
+	}
+
+	_compressWaiters.clear();
+	_compressJobs.clear();
+	_compressByKey.clear();
+	if(_compressPool.running())
+		loop.removeFd(_compressPool.fd());
+	_compressPool.stop();
+
 	std::vector<int> clientFds;
 	clientFds.reserve(_clients.size());
 
@@ -1,97 +1,74 @@
 #include "core/CoreServer.hpp"
 
 #include <cctype>
+#include <cstring>
 
-static std::string toLowerStr(const std::string& s)
+// Host value of the header block buf[0, end), in place: no port, no
+// brackets around an IPv6 literal. False when there is no Host header.
+static bool findHostInHeaders(const std::string& buf,std::size_t end,const char*& host,std::size_t& len)
 {
-	std::string r=s;
-	for(std::size_t i=0;i<r.size();++i)
+	std::size_t pos=buf.find("\r\n");
+	if(pos==std::string::npos||pos>=end)
 	{
-		r[i]=static_cast<char>(std::tolower(static_cast<unsigned char>(r[i])));
+		return false;
 	}
-	return r;
-}
-
-static std::string ltrimSpaces(const std::string& s)
-{
-	std::size_t i=0;
-	while(i<s.size()&&(s[i]==' '||s[i]=='\t'))
-	{
-		++i;
-	}
-	return s.substr(i);
-}
-
-static std::string extractHostFromHeadersBlock(const std::string& headersBlock)
-{
-	std::size_t lineEnd=headersBlock.find("\r\n");
-	if(lineEnd==std::string::npos)
-	{
-		return "";
-	}
-
-	std::size_t pos=lineEnd+2;
+	pos+=2;
 
-	while(pos<headersBlock.size())
+	const char* p=buf.data();
+	while(pos<end)
 	{
-		std::size_t end=headersBlock.find("\r\n",pos);
-		if(end==std::string::npos)
-		{
-			break;
-		}
-
-		std::string line=headersBlock.substr(pos,end-pos);
-		pos=end+2;
-
-		if(line.empty())
+		std::size_t lineEnd=buf.find("\r\n",pos);
+		if(lineEnd==std::string::npos||lineEnd>end)
 		{
-			break;
+			lineEnd=end;
 		}
 
-		std::size_t colon=line.find(':');
-		if(colon==std::string::npos)
+		if(lineEnd-pos>=5&& ::strncasecmp(p+pos,"host:",5)==0)
 		{
-			continue;
-		}
-
-		std::string key=toLowerStr(line.substr(0,colon));
-		std::string val=ltrimSpaces(line.substr(colon+1));
+			std::size_t v=pos+5;
+			while(v<lineEnd&&(p[v]==' '||p[v]=='\t'))
+			{
+				++v;
+			}
+			std::size_t e=lineEnd;
+			while(e>v&&(p[e-1]==' '||p[e-1]=='\t'))
+			{
+				--e;
+			}
 
-		if(key=="host")
-		{
-			if(!val.empty()&& val[0]=='[')
+			if(v<e&& p[v]=='[')
 			{
-				std::size_t close=val.find(']');
-				if(close!=std::string::npos&& close>1)
+				const char* close=static_cast<const char*>(std::memchr(p+v,']',e-v));
+				if(close!=0&& close>p+v+1)
 				{
-					val=val.substr(1,close-1);
+					host=p+v+1;
+					len=static_cast<std::size_t>(close-host);
+					return true;
 				}
 			}
-			else
+
+			const char* colon=static_cast<const char*>(std::memchr(p+v,':',e-v));
+			if(colon!=0)
 			{
-				std::size_t p=val.find(':');
-				if(p!=std::string::npos)
-				{
-					val=val.substr(0,p);
-				}
+				e=static_cast<std::size_t>(colon-p);
 			}
-			return toLowerStr(val);
+			host=p+v;
+			len=e-v;
+			return true;
 		}
+
+		pos=lineEnd+2;
 	}
 
-	return "";
+	return false;
 }
 
-std::size_t CoreServer::selectServerIndexByHost(unsigned short port,std::size_t defaultIndex,const std::string& host) const
+std::size_t CoreServer::selectServerIndexByHost(unsigned short port,std::size_t defaultIndex,const char* host,std::size_t hostLen) const
 {
-	std::map<unsigned short,std::map<std::string,std::size_t> >::const_iterator itPort=_serverByPortHost.find(port);
-	if(itPort!=_serverByPortHost.end())
+	long s=_serverByPortHost.find(port,host,hostLen);
+	if(s>=0)
 	{
-		std::map<std::string,std::size_t>::const_iterator itHost=itPort->second.find(host);
-		if(itHost!=itPort->second.end())
-		{
-			return itHost->second;
-		}
+		return static_cast<std::size_t>(s);
 	}
 
 	std::map<unsigned short,std::size_t>::const_iterator itDef=_defaultServerByPort.find(port);
@@ -103,17 +80,19 @@ std::size_t CoreServer::selectServerIndexByHost(unsigned short port,std::size_t
 	return defaultIndex;
 }
 
-void CoreServer::updateServerIndexFromHost(Client& client)
+// once per request, when its headers are in: a missing Host leaves the
+// listener's server in place (nc tests often omit it)
+void CoreServer::updateServerIndexFromHost(Client& client,std::size_t headersEnd)
 {
-	std::size_t headersEnd=client.inBuffer.find("\r\n\r\n");
-	if(headersEnd==std::string::npos)
+	if(client.hostResolved)
 	{
 		return;
 	}
+	client.hostResolved=true;
 
-	std::string headersBlock=client.inBuffer.substr(0,headersEnd);
-	std::string host=extractHostFromHeadersBlock(headersBlock);
-	if(host.empty())
+	const char* host=0;
+	std::size_t len=0;
+	if(!findHostInHeaders(client.inBuffer,headersEnd,host,len)||len==0)
 	{
 		return;
 	}
@@ -130,5 +109,5 @@ void CoreServer::updateServerIndexFromHost(Client& client)
 		port=_serverConfigs[def].listenPort;
 	}
 
-	client.serverConfigIndex=selectServerIndexByHost(port,def,host);
+	client.serverConfigIndex=selectServerIndexByHost(port,def,host,len);
 }
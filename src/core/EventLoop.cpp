@@ -20,6 +20,9 @@ void EventLoop::run(CoreServer& server)
 		addFd(listenFds[i],POLLIN);
 	}
 
+	server.startCgiPools(*this);
+	server.startCompressPool(*this);
+
 	Logger::info("EventLoop started");
 
 	while(!CoreServer::stopRequested())
@@ -92,6 +95,55 @@ void EventLoop::run(CoreServer& server)
 						server.handleCgiWrite(*this,fd);
 					}
 				}
+				else if(server.isCgiPoolFd(fd))
+				{
+					if(revents&(POLLIN|POLLERR|POLLHUP|POLLNVAL))
+					{
+						server.handleCgiPoolRead(*this,fd);
+					}
+
+					if((revents&POLLOUT) && server.isCgiPoolFd(fd))
+					{
+						server.handleCgiPoolWrite(*this,fd);
+					}
+				}
+				else if(server.isFastCgiFd(fd))
+				{
+					if(revents&(POLLERR|POLLHUP|POLLNVAL))
+					{
+						server.handleFastCgiRead(*this,fd);
+						continue;
+					}
+
+					if(revents&POLLIN)
+					{
+						server.handleFastCgiRead(*this,fd);
+					}
+
+					if((revents&POLLOUT) && server.isFastCgiFd(fd))
+					{
+						server.handleFastCgiWrite(*this,fd);
+					}
+				}
+				else if(server.isCompressFd(fd))
+				{
+					if(revents&(POLLIN|POLLERR|POLLHUP|POLLNVAL))
+					{
+						server.handleCompressDone(*this);
+					}
+				}
+				else if(server.isProxyFd(fd))
+				{
+					if(revents&(POLLIN|POLLERR|POLLHUP|POLLNVAL))
+					{
+						server.handleProxyRead(*this,fd);
+					}
+
+					if((revents&POLLOUT) && server.isProxyFd(fd))
+					{
+						server.handleProxyWrite(*this,fd);
+					}
+				}
 				else
 				{
 					if(revents&(POLLERR|POLLNVAL))
@@ -114,6 +166,11 @@ void EventLoop::run(CoreServer& server)
 					{
 						server.handleClientRead(*this,fd);
 					}
+
+					if((revents&POLLRDHUP) && !(revents&(POLLIN|POLLHUP)))
+					{
+						server.handleClientHangup(*this,fd);
+					}
 				}
 			}
 
@@ -213,6 +270,28 @@ void EventLoop::setReadEnabled(int fd,bool enabled)
 	}
 }
 
+// POLLRDHUP is reported even while POLLIN is off, so a client that gives up
+// during CGI_PENDING is noticed without reading its socket.
+void EventLoop::setHangupWatch(int fd,bool enabled)
+{
+	std::map<int,std::size_t>::iterator it=_fdToIndex.find(fd);
+	if(it==_fdToIndex.end())
+	{
+		return;
+	}
+
+	std::size_t idx=it->second;
+
+	if(enabled)
+	{
+		_pollFds[idx].events=(short)(_pollFds[idx].events|POLLRDHUP);
+	}
+	else
+	{
+		_pollFds[idx].events=(short)(_pollFds[idx].events&~POLLRDHUP);
+	}
+}
+
 void EventLoop::compact()
 {
 	std::vector<struct pollfd> tmp;
@@ -16,6 +16,7 @@ public:
 	void removeFd(int fd);
 	void setWriteEnabled(int fd,bool enabled);
 	void setReadEnabled(int fd,bool enabled);
+	void setHangupWatch(int fd,bool enabled);
 
 private:
 	std::vector<struct pollfd> _pollFds;
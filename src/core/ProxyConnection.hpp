@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <cstddef>
+#include "http/HttpParser.hpp"
+#include "http/HttpResponse.hpp"
+
+struct LocationConfig;
+struct UpstreamConfig;
+
+// One HTTP/1.1 socket to a proxy_pass server. It carries one request at a
+// time and goes back to the per-address idle pool when the response ended
+// cleanly and the upstream allowed keep-alive.
+struct ProxyConnection
+{
+	int fd;
+	std::string address;
+
+	bool connecting;
+
+	// client being served, -1 while idle in the pool
+	int clientFd;
+
+	// has served a request before; a failure before any response byte is
+	// then most likely the upstream closing an idle connection
+	bool reused;
+
+	std::chrono::steady_clock::time_point lastActivity;
+
+	ProxyConnection()
+		: fd(-1)
+		, address()
+		, connecting(false)
+		, clientFd(-1)
+		, reused(false)
+		, lastActivity(std::chrono::steady_clock::now())
+	{
+	}
+};
+
+// Per-client proxy_pass state while the client is in CGI_PENDING.
+struct ProxyRequest
+{
+	enum BodyMode
+	{
+		NO_BODY,
+		LENGTH,
+		CHUNKED,
+		UNTIL_CLOSE
+	};
+
+	int clientFd;
+	int connFd;
+	const LocationConfig* location;
+	const UpstreamConfig* upstream;
+	std::string address;
+
+	// servers tried so far (proxy_next_upstream on connect errors), and
+	// whether the one stale keep-alive retry was used
+	std::size_t attempts;
+	bool retried;
+
+	// head + body, resent as is on a retry
+	std::string out;
+	std::size_t outOffset;
+
+	std::string inBuffer;
+	bool headersDone;
+	HttpResponse response;
+	BodyMode bodyMode;
+	std::size_t bodyLeft;
+	ChunkedDecoder chunked;
+	bool upstreamKeepAlive;
+
+	// streaming: headers already went to the client, body bytes follow
+	bool streaming;
+
+	std::string method;
+	std::string version;
+
+	std::chrono::steady_clock::time_point startTime;
+	std::chrono::steady_clock::time_point lastProgress;
+
+	ProxyRequest()
+		: clientFd(-1)
+		, connFd(-1)
+		, location(0)
+		, upstream(0)
+		, address()
+		, attempts(0)
+		, retried(false)
+		, out()
+		, outOffset(0)
+		, inBuffer()
+		, headersDone(false)
+		, response()
+		, bodyMode(NO_BODY)
+		, bodyLeft(0)
+		, chunked()
+		, upstreamKeepAlive(false)
+		, streaming(false)
+		, method()
+		, version()
+		, startTime(std::chrono::steady_clock::now())
+		, lastProgress(std::chrono::steady_clock::now())
+	{
+	}
+};
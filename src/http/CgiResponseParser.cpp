@@ -11,8 +11,69 @@ static std::string toLowerStr(const std::string& s)
 	return r;
 }
 
+static std::string trimStr(const std::string& s)
+{
+	std::size_t b = 0;
+	std::size_t e = s.size();
+	while (b < e && (s[b] == ' ' || s[b] == '\t'))
+		++b;
+	while (e > b && (s[e - 1] == ' ' || s[e - 1] == '\t'))
+		--e;
+	return s.substr(b, e - b);
+}
+
+// directives are compared whole: "s-maxage=" is not "max-age=", and a
+// "private" inside another token does not count
+static long cacheControlMaxAge(const std::string& value)
+{
+	long maxAge = -1;
+
+	std::size_t pos = 0;
+	while (pos <= value.size())
+	{
+		std::size_t comma = value.find(',', pos);
+		if (comma == std::string::npos)
+			comma = value.size();
+
+		std::string token = trimStr(value.substr(pos, comma - pos));
+		pos = comma + 1;
+
+		std::string name = token;
+		std::string arg;
+		std::size_t eq = token.find('=');
+		if (eq != std::string::npos)
+		{
+			name = trimStr(token.substr(0, eq));
+			arg = trimStr(token.substr(eq + 1));
+			if (arg.size() >= 2 && arg[0] == '"' && arg[arg.size() - 1] == '"')
+				arg = arg.substr(1, arg.size() - 2);
+		}
+		name = toLowerStr(name);
+
+		if (name == "no-store" || name == "no-cache" || name == "private")
+			return 0;
+
+		if (name == "max-age")
+		{
+			if (arg.empty() || !std::isdigit(static_cast<unsigned char>(arg[0])))
+				maxAge = 0;
+			else
+				maxAge = std::atol(arg.c_str());
+		}
+	}
+	return maxAge;
+}
+
 bool CgiResponseParser::parse(const std::string& out, HttpResponse& res)
 {
+	Meta meta;
+	return parse(out, res, meta);
+}
+
+bool CgiResponseParser::parse(const std::string& out, HttpResponse& res, Meta& meta)
+{
+	meta = Meta();
+
 	std::size_t sep = out.find("\r\n\r\n");
 	if (sep == std::string::npos)
 	{
@@ -83,8 +144,16 @@ bool CgiResponseParser::parse(const std::string& out, HttpResponse& res)
 			else
 				res.reason = "OK";
 		}
+		else if (keyLower == "x-accel-redirect")
+			meta.accelRedirect = val;
+		else if (keyLower == "x-sendfile")
+			meta.sendfilePath = val;
 		else
 		{
+			if (keyLower == "cache-control")
+				meta.maxAge = cacheControlMaxAge(val);
+			if (keyLower == "content-type")
+				meta.hasContentType = true;
 			res.headers[key] = val;
 		}
 	}
@@ -7,4 +7,24 @@ class CgiResponseParser
 {
 public:
 	static bool parse(const std::string& out, HttpResponse& res);
+
+	// What the script asked of the server rather than of the client.
+	struct Meta
+	{
+		// Cache-Control: max-age seconds, 0 for no-store/no-cache/private,
+		// -1 if not stated
+		long maxAge;
+
+		// X-Accel-Redirect (a URI of an internal location) and X-Sendfile
+		// (a file path); both are consumed, never forwarded
+		std::string accelRedirect;
+		std::string sendfilePath;
+
+		// the script set Content-Type itself (otherwise text/plain is filled in)
+		bool hasContentType;
+
+		Meta() : maxAge(-1), accelRedirect(), sendfilePath(), hasContentType(false) {}
+	};
+
+	static bool parse(const std::string& out, HttpResponse& res, Meta& meta);
 };
@@ -0,0 +1,92 @@
+#include "http/CompressCache.hpp"
+
+CompressCache::CompressCache()
+	: _entries()
+	, _lru()
+	, _bytes(0)
+	, _hits(0)
+	, _misses(0)
+{
+}
+
+std::string CompressCache::makeKey(const std::string& path, const std::string& etag, Compression::Coding coding)
+{
+	std::string key;
+	key.reserve(path.size() + etag.size() + 8);
+
+	key += path;
+	key.push_back('\0');
+	key += etag;
+	key.push_back('\0');
+	key += Compression::token(coding);
+	return key;
+}
+
+bool CompressCache::lookup(const std::string& key, std::string& body)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	if (it == _entries.end())
+	{
+		++_misses;
+		return false;
+	}
+
+	_lru.splice(_lru.begin(), _lru, it->second.lru);
+	body = it->second.body;
+	++_hits;
+	return true;
+}
+
+void CompressCache::store(const std::string& key, const std::string& body)
+{
+	if (body.size() > MAX_BODY)
+		return;
+
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	if (it != _entries.end())
+	{
+		_bytes -= it->second.body.size();
+		_lru.erase(it->second.lru);
+		_entries.erase(it);
+	}
+
+	_lru.push_front(key);
+
+	Entry& e = _entries[key];
+	e.body = body;
+	e.lru = _lru.begin();
+	_bytes += body.size();
+
+	evict();
+}
+
+void CompressCache::evict()
+{
+	while (!_lru.empty() && (_entries.size() > MAX_ENTRIES || _bytes > MAX_BYTES))
+	{
+		std::map<std::string, Entry>::iterator it = _entries.find(_lru.back());
+		_bytes -= it->second.body.size();
+		_entries.erase(it);
+		_lru.pop_back();
+	}
+}
+
+std::size_t CompressCache::hits() const
+{
+	return _hits;
+}
+
+std::size_t CompressCache::misses() const
+{
+	return _misses;
+}
+
+std::size_t CompressCache::size() const
+{
+	return _entries.size();
+}
+
+std::size_t CompressCache::bytes() const
+{
+	return _bytes;
+}
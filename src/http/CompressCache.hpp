@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <cstddef>
+#include "http/Compression.hpp"
+
+// Compressed variants of static files, so each one is compressed once.
+// The key carries the ETag (inode, size, mtime): a changed file gets a new
+// key and its old variant ages out. Least recently used entries go first.
+class CompressCache
+{
+public:
+	static const std::size_t MAX_ENTRIES = 1024;
+	static const std::size_t MAX_BYTES = 32 * 1024 * 1024;
+	// a single variant larger than this is not kept
+	static const std::size_t MAX_BODY = 8 * 1024 * 1024;
+
+	CompressCache();
+
+	static std::string makeKey(const std::string& path, const std::string& etag, Compression::Coding coding);
+
+	bool lookup(const std::string& key, std::string& body);
+	void store(const std::string& key, const std::string& body);
+
+	std::size_t hits() const;
+	std::size_t misses() const;
+	std::size_t size() const;
+	std::size_t bytes() const;
+
+private:
+	struct Entry
+	{
+		std::string body;
+		std::list<std::string>::iterator lru;
+	};
+
+	std::map<std::string, Entry> _entries;
+	// most recently used first
+	std::list<std::string> _lru;
+	std::size_t _bytes;
+	std::size_t _hits;
+	std::size_t _misses;
+
+	void evict();
+};
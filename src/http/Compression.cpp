@@ -0,0 +1,379 @@
+#include "http/Compression.hpp"
+#include "http/StaticFile.hpp"
+
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <map>
+
+Compression::Stream::Stream()
+	: _coding(NONE)
+	, _zs()
+	, _br(0)
+	, _open(false)
+{
+}
+
+Compression::Stream::~Stream()
+{
+	end();
+}
+
+void Compression::Stream::end()
+{
+	if (!_open)
+		return;
+	if (_coding == GZIP)
+		::deflateEnd(&_zs);
+	else if (_br)
+		::BrotliEncoderDestroyInstance(_br);
+	_br = 0;
+	_open = false;
+}
+
+bool Compression::Stream::begin(Coding coding, int level)
+{
+	end();
+	_coding = coding;
+
+	if (coding == GZIP)
+	{
+		std::memset(&_zs, 0, sizeof(_zs));
+		// windowBits 15 + 16: gzip wrapper instead of zlib
+		if (::deflateInit2(&_zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		_open = true;
+		return true;
+	}
+
+	if (coding == BROTLI)
+	{
+		_br = ::BrotliEncoderCreateInstance(0, 0, 0);
+		if (!_br)
+			return false;
+		::BrotliEncoderSetParameter(_br, BROTLI_PARAM_QUALITY, static_cast<uint32_t>(level));
+		::BrotliEncoderSetParameter(_br, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+		_open = true;
+		return true;
+	}
+	return false;
+}
+
+static bool deflateAll(z_stream& zs, int flush, std::string& out)
+{
+	unsigned char buf[16 * 1024];
+
+	while (true)
+	{
+		zs.next_out = buf;
+		zs.avail_out = sizeof(buf);
+
+		int rc = ::deflate(&zs, flush);
+		if (rc == Z_STREAM_ERROR)
+			return false;
+
+		out.append(reinterpret_cast<char*>(buf), sizeof(buf) - zs.avail_out);
+
+		if (flush == Z_FINISH)
+		{
+			if (rc == Z_STREAM_END)
+				return true;
+		}
+		else if (zs.avail_in == 0 && zs.avail_out != 0)
+			return true;
+	}
+}
+
+static bool brotliAll(BrotliEncoderState* br, BrotliEncoderOperation op,
+	const char* data, std::size_t len, std::string& out)
+{
+	const uint8_t* nextIn = reinterpret_cast<const uint8_t*>(data);
+	std::size_t availIn = len;
+
+	while (true)
+	{
+		std::size_t availOut = 0;
+		if (!::BrotliEncoderCompressStream(br, op, &availIn, &nextIn, &availOut, 0, 0))
+			return false;
+
+		std::size_t n = 0;
+		const uint8_t* produced = ::BrotliEncoderTakeOutput(br, &n);
+		if (n > 0)
+			out.append(reinterpret_cast<const char*>(produced), n);
+
+		if (op == BROTLI_OPERATION_FINISH)
+		{
+			if (::BrotliEncoderIsFinished(br))
+				return true;
+		}
+		else if (availIn == 0 && !::BrotliEncoderHasMoreOutput(br))
+			return true;
+	}
+}
+
+bool Compression::Stream::update(const char* data, std::size_t len, std::string& out)
+{
+	if (!_open)
+		return false;
+
+	if (_coding == GZIP)
+	{
+		_zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		_zs.avail_in = static_cast<uInt>(len);
+		return deflateAll(_zs, Z_NO_FLUSH, out);
+	}
+	return brotliAll(_br, BROTLI_OPERATION_PROCESS, data, len, out);
+}
+
+bool Compression::Stream::finish(std::string& out)
+{
+	if (!_open)
+		return false;
+
+	bool ok;
+	if (_coding == GZIP)
+	{
+		_zs.next_in = 0;
+		_zs.avail_in = 0;
+		ok = deflateAll(_zs, Z_FINISH, out);
+	}
+	else
+		ok = brotliAll(_br, BROTLI_OPERATION_FINISH, 0, 0, out);
+
+	end();
+	return ok;
+}
+
+const char* Compression::token(Coding coding)
+{
+	if (coding == GZIP)
+		return "gzip";
+	if (coding == BROTLI)
+		return "br";
+	return "identity";
+}
+
+static std::map<std::string, std::string>::const_iterator findHeader(const HttpResponse& res, const char* name)
+{
+	std::size_t len = std::strlen(name);
+	for (std::map<std::string, std::string>::const_iterator it = res.headers.begin(); it != res.headers.end(); ++it)
+	{
+		if (it->first.size() == len && ::strncasecmp(it->first.c_str(), name, len) == 0)
+			return it;
+	}
+	return res.headers.end();
+}
+
+static void eraseHeader(HttpResponse& res, const char* name)
+{
+	std::size_t len = std::strlen(name);
+	for (std::map<std::string, std::string>::iterator it = res.headers.begin(); it != res.headers.end(); )
+	{
+		if (it->first.size() == len && ::strncasecmp(it->first.c_str(), name, len) == 0)
+			res.headers.erase(it++);
+		else
+			++it;
+	}
+}
+
+// "text/html; charset=utf-8" -> "text/html"
+static std::string mimeType(const HttpResponse& res)
+{
+	std::map<std::string, std::string>::const_iterator it = findHeader(res, "content-type");
+	if (it == res.headers.end())
+		return "";
+
+	const std::string& v = it->second;
+	std::size_t b = 0;
+	while (b < v.size() && (v[b] == ' ' || v[b] == '\t'))
+		++b;
+	std::size_t e = v.find(';', b);
+	if (e == std::string::npos)
+		e = v.size();
+	while (e > b && (v[e - 1] == ' ' || v[e - 1] == '\t'))
+		--e;
+
+	std::string t = v.substr(b, e - b);
+	for (std::size_t i = 0; i < t.size(); ++i)
+		t[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(t[i])));
+	return t;
+}
+
+static bool typeListed(const std::vector<std::string>& types, const std::string& type)
+{
+	if (type == "text/html")
+		return true;
+	for (std::size_t i = 0; i < types.size(); ++i)
+	{
+		if (types[i] == "*" || types[i] == type)
+			return true;
+	}
+	return false;
+}
+
+// HEAD carries no body; the GET would have sent Content-Length bytes
+static std::size_t plannedLength(const HttpResponse& res, const std::string& method)
+{
+	if (method != "HEAD")
+		return res.bodyLength();
+
+	std::map<std::string, std::string>::const_iterator it = findHeader(res, "content-length");
+	if (it == res.headers.end())
+		return 0;
+	return static_cast<std::size_t>(std::strtoull(it->second.c_str(), 0, 10));
+}
+
+Compression::Coding Compression::choose(const LocationConfig& loc, const HttpResponse& res,
+	const std::string& method, const std::string& acceptEncoding, bool& vary)
+{
+	vary = false;
+
+	if (!loc.gzip && !loc.brotli)
+		return NONE;
+	if (res.status != 200 && res.status != 403 && res.status != 404)
+		return NONE;
+	if (findHeader(res, "content-encoding") != res.headers.end())
+		return NONE;
+	if (findHeader(res, "content-range") != res.headers.end())
+		return NONE;
+
+	std::string type = mimeType(res);
+	if (type.empty())
+		return NONE;
+
+	bool brotli = (loc.brotli && typeListed(loc.brotliTypes, type));
+	bool gzip = (loc.gzip && typeListed(loc.gzipTypes, type));
+	vary = (brotli || gzip);
+
+	std::size_t len = plannedLength(res, method);
+	if (len > MAX_BODY)
+		return NONE;
+
+	if (brotli && len >= loc.brotliMinLength && StaticFile::acceptsEncoding(acceptEncoding, "br"))
+		return BROTLI;
+	if (gzip && len >= loc.gzipMinLength && StaticFile::acceptsEncoding(acceptEncoding, "gzip"))
+		return GZIP;
+	return NONE;
+}
+
+int Compression::level(const LocationConfig& loc, Coding coding)
+{
+	if (coding == BROTLI)
+		return loc.brotliCompLevel;
+	return loc.gzipCompLevel;
+}
+
+bool Compression::compress(Coding coding, int level, const std::string& in, std::string& out)
+{
+	out.clear();
+
+	Stream s;
+	if (!s.begin(coding, level))
+		return false;
+
+	for (std::size_t pos = 0; pos < in.size(); pos += SLICE)
+	{
+		std::size_t n = in.size() - pos;
+		if (n > SLICE)
+			n = SLICE;
+		if (!s.update(in.data() + pos, n, out))
+			return false;
+	}
+	return s.finish(out);
+}
+
+bool Compression::compressFile(Coding coding, int level, const BodySource& src, std::string& out)
+{
+	out.clear();
+
+	int fd = ::open(src.path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	Stream s;
+	bool ok = s.begin(coding, level);
+
+	std::vector<char> buf(SLICE);
+	off_t pos = src.offset;
+	off_t end = src.offset + src.length;
+
+	while (ok && pos < end)
+	{
+		std::size_t want = SLICE;
+		if (static_cast<off_t>(want) > end - pos)
+			want = static_cast<std::size_t>(end - pos);
+
+		ssize_t n = ::pread(fd, &buf[0], want, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			// shorter than planned: the Content-Length would lie
+			ok = false;
+			break;
+		}
+
+		ok = s.update(&buf[0], static_cast<std::size_t>(n), out);
+		pos += n;
+	}
+
+	::close(fd);
+
+	if (!ok)
+		return false;
+	return s.finish(out);
+}
+
+void Compression::addVary(HttpResponse& res)
+{
+	res.prepared = false;
+
+	std::map<std::string, std::string>::const_iterator it = findHeader(res, "vary");
+	if (it == res.headers.end())
+	{
+		res.headers["Vary"] = "Accept-Encoding";
+		return;
+	}
+
+	std::string v = it->second;
+	std::string lower = v;
+	for (std::size_t i = 0; i < lower.size(); ++i)
+		lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(lower[i])));
+	if (lower.find("accept-encoding") != std::string::npos || lower.find('*') != std::string::npos)
+		return;
+
+	eraseHeader(res, "vary");
+	res.headers["Vary"] = v + ", Accept-Encoding";
+}
+
+void Compression::apply(HttpResponse& res, Coding coding, std::string& body)
+{
+	res.body.swap(body);
+	res.source = BodySource();
+
+	applyHead(res, coding);
+	res.headers["Content-Length"] = std::to_string(res.body.size());
+}
+
+void Compression::applyHead(HttpResponse& res, Coding coding)
+{
+	res.prepared = false;
+
+	eraseHeader(res, "content-length");
+	eraseHeader(res, "accept-ranges");
+	res.headers["Content-Encoding"] = token(coding);
+	addVary(res);
+
+	std::map<std::string, std::string>::const_iterator it = findHeader(res, "etag");
+	if (it != res.headers.end() && !it->second.empty() && it->second[0] == '"')
+	{
+		std::string weak = "W/" + it->second;
+		eraseHeader(res, "etag");
+		res.headers["ETag"] = weak;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "http/HttpResponse.hpp"
+#include "ServerConfig.hpp"
+
+// On-the-fly gzip / brotli of response bodies (gzip, brotli directives).
+// The encoder is incremental: input goes in by slices and the output grows
+// as it is produced, so the whole body never has to be held twice in zlib's
+// or brotli's own buffers; a file body is read from disk a slice at a time.
+class Compression
+{
+public:
+	enum Coding
+	{
+		NONE,
+		GZIP,
+		BROTLI
+	};
+
+	// input is fed to the encoder in slices of this size
+	static const std::size_t SLICE = 64 * 1024;
+	// the output is built in memory; a larger body goes out uncompressed,
+	// as its variant would not fit CompressCache either
+	static const std::size_t MAX_BODY = 8 * 1024 * 1024;
+
+	class Stream
+	{
+	public:
+		Stream();
+		~Stream();
+
+		bool begin(Coding coding, int level);
+		bool update(const char* data, std::size_t len, std::string& out);
+		bool finish(std::string& out);
+
+	private:
+		Coding _coding;
+		z_stream _zs;
+		BrotliEncoderState* _br;
+		bool _open;
+
+		void end();
+
+		Stream(const Stream&);
+		Stream& operator=(const Stream&);
+	};
+
+	// Content-Encoding token
+	static const char* token(Coding coding);
+
+	// brotli over gzip when both apply. vary is set when the response would
+	// have been compressed for a client that takes the coding. HEAD is
+	// judged by its Content-Length, so it gets the same answer as GET.
+	static Coding choose(const LocationConfig& loc, const HttpResponse& res,
+		const std::string& method, const std::string& acceptEncoding, bool& vary);
+
+	static int level(const LocationConfig& loc, Coding coding);
+
+	static bool compress(Coding coding, int level, const std::string& in, std::string& out);
+	// the FILE body of a planned response, read slice by slice
+	static bool compressFile(Coding coding, int level, const BodySource& src, std::string& out);
+
+	// body becomes the response body: Content-Encoding, Content-Length and
+	// Vary are set, a strong ETag turns weak, Accept-Ranges goes away
+	static void apply(HttpResponse& res, Coding coding, std::string& body);
+	// the same headers for HEAD, without a body; Content-Length goes, as the
+	// compressed size is not known
+	static void applyHead(HttpResponse& res, Coding coding);
+
+	// adds Accept-Encoding to Vary, keeping what is there
+	static void addVary(HttpResponse& res);
+};
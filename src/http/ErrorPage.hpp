@@ -6,5 +6,7 @@
 class ErrorPage
 {
 public:
+	// the built-in page for status and reason; HttpError keeps those of the
+	// stock statuses, built at config load
 	static std::string defaultHtml(int status, const std::string& reason);
 };
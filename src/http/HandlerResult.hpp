@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "http/HttpResponse.hpp"
+
+struct LocationConfig;
+
+// Everything the core needs to start a CGI-style backend for one request.
+// env and body are moved out of the parsed request, never re-serialized.
+struct CgiLaunchSpec
+{
+	enum Backend
+	{
+		FORK,     // cgi: one process per request
+		POOL,     // cgi_pool: pre-forked interpreter
+		FASTCGI,  // fastcgi_pass
+		PROXY     // proxy_pass: env is unused, proxyHead is sent instead
+	};
+
+	Backend backend;
+	std::size_t locationIndex;
+
+	std::string extension;
+	std::string interpreter;
+	std::string scriptPath;
+	std::vector<std::string> env;
+	std::string body;
+
+	// proxy_pass: request line and headers as they go to the upstream
+	std::string proxyHead;
+
+	std::string method;
+	std::string version;
+
+	// Range / If-Range of the request, applied if the script answers with
+	// X-Accel-Redirect or X-Sendfile
+	std::string range;
+	std::string ifRange;
+
+	// gzip / brotli of the script's response
+	std::string acceptEncoding;
+
+	// cgi_stream_body: body is still arriving and stays in the client's
+	// inBuffer; bodyLength is unused when bodyChunked
+	bool streamBody;
+	bool bodyChunked;
+	std::size_t bodyLength;
+
+	CgiLaunchSpec()
+		: backend(FORK)
+		, locationIndex(0)
+		, extension()
+		, interpreter()
+		, scriptPath()
+		, env()
+		, body()
+		, proxyHead()
+		, method()
+		, version()
+		, range()
+		, ifRange()
+		, acceptEncoding()
+		, streamBody(false)
+		, bodyChunked(false)
+		, bodyLength(0)
+	{
+	}
+};
+
+// Outcome of IHttpHandler::onDataReceived for a complete request:
+// state WRITING  -> response is ready to be serialized,
+// state CGI_PENDING -> cgi describes the backend to start.
+struct HandlerResult
+{
+	HttpResponse response;
+	CgiLaunchSpec cgi;
+
+	// state WRITING: what the core needs to gzip / brotli the response;
+	// filePath is set for a static file, whose variants are cached
+	const LocationConfig* location;
+	std::string method;
+	std::string acceptEncoding;
+	std::string filePath;
+
+	HandlerResult()
+		: response()
+		, cgi()
+		, location(0)
+		, method()
+		, acceptEncoding()
+		, filePath()
+	{
+	}
+};
@@ -1,39 +1,163 @@
 #include "http/HttpError.hpp"
 #include "http/ErrorPage.hpp"
+#include "core/Logger.hpp"
 #include "utils/FileUtils.hpp"
 
-static std::string getContentTypeByPath(const std::string& p)
+struct StockError
 {
-	std::size_t dot = p.rfind('.');
-	if (dot == std::string::npos)
-		return "application/octet-stream";
-
-	std::string ext = p.substr(dot + 1);
-	if (ext == "html")	return "text/html";
-	if (ext == "css")	return "text/css";
-	if (ext == "js")	return "application/javascript";
-	return "application/octet-stream";
+	int status;
+	const char* reason;
+	// the built-in page, built by the first prepare()
+	std::string page;
+};
+
+// the statuses the server answers with itself
+static StockError STOCK_ERRORS[] = {
+	{ 400, "Bad Request", "" },
+	{ 403, "Forbidden", "" },
+	{ 404, "Not Found", "" },
+	{ 405, "Method Not Allowed", "" },
+	{ 408, "Request Timeout", "" },
+	{ 413, "Payload Too Large", "" },
+	{ 414, "URI Too Long", "" },
+	{ 431, "Request Header Fields Too Large", "" },
+	{ 500, "Internal Server Error", "" },
+	{ 501, "Not Implemented", "" },
+	{ 502, "Bad Gateway", "" },
+	{ 503, "Service Unavailable", "" },
+	{ 504, "Gateway Timeout", "" },
+	{ 505, "HTTP Version Not Supported", "" },
+};
+
+static const std::size_t STOCK_COUNT = sizeof(STOCK_ERRORS) / sizeof(STOCK_ERRORS[0]);
+
+static const StockError* stockError(int status)
+{
+	for (std::size_t i = 0; i < STOCK_COUNT; ++i)
+	{
+		if (STOCK_ERRORS[i].status == status)
+			return &STOCK_ERRORS[i];
+	}
+	return 0;
 }
 
 void HttpError::fill(HttpResponse& res, const ServerConfig& cfg, int code, const std::string& reason)
 {
+	// a response that already has headers is not the serialized one
+	bool fresh = res.headers.empty() && res.source.kind == BodySource::MEMORY;
+
 	res.status = code;
 	res.reason = reason;
+	res.prepared = false;
+
+	std::map<int, PreparedError>::const_iterator it = cfg.preparedErrors.find(code);
+	if (it != cfg.preparedErrors.end() && (it->second.custom || it->second.reason == reason))
+	{
+		res.body = *it->second.body;
+		res.headers["Content-Type"] = it->second.contentType;
+		res.headers["Content-Length"] = std::to_string(res.body.size());
+		res.prepared = fresh && it->second.close && it->second.reason == reason;
+		return;
+	}
 
-	std::map<int, std::string>::const_iterator it = cfg.errorPages.find(code);
-	if (it != cfg.errorPages.end())
+	// a stock page unless the caller has a reason of its own
+	const StockError* stock = stockError(code);
+	if (stock != 0 && !stock->page.empty() && reason == stock->reason)
+		res.body = stock->page;
+	else
+		res.body = ErrorPage::defaultHtml(code, reason);
+	res.headers["Content-Type"] = "text/html";
+	res.headers["Content-Length"] = std::to_string(res.body.size());
+}
+
+void HttpError::prepare(ServerConfig& cfg)
+{
+	cfg.preparedErrors.clear();
+
+	std::map<int, std::string> reasons;
+	for (std::size_t i = 0; i < STOCK_COUNT; ++i)
+	{
+		StockError& e = STOCK_ERRORS[i];
+		if (e.page.empty())
+			e.page = ErrorPage::defaultHtml(e.status, e.reason);
+		reasons[e.status] = e.reason;
+	}
+	for (std::map<int, std::string>::const_iterator it = cfg.errorPages.begin(); it != cfg.errorPages.end(); ++it)
 	{
+		const StockError* stock = stockError(it->first);
+		reasons[it->first] = (stock != 0 ? stock->reason : "");
+	}
+
+	for (std::map<int, std::string>::const_iterator it = reasons.begin(); it != reasons.end(); ++it)
+	{
+		PreparedError p;
+		p.reason = it->second;
+
+		std::map<int, std::string>::const_iterator page = cfg.errorPages.find(it->first);
 		std::string body;
-		if (FileUtils::readFile(it->second, body))
+		if (page != cfg.errorPages.end())
+		{
+			if (FileUtils::readFile(page->second, body))
+			{
+				p.custom = true;
+				p.contentType = cfg.mimeTypes.lookup(page->second);
+			}
+			else
+				Logger::warn("Cannot read error_page " + page->second + ", the built-in page is used");
+		}
+
+		// a status without a reason phrase only exists for its file
+		if (!p.custom && p.reason.empty())
+			continue;
+		if (!p.custom)
 		{
+			// only stock statuses get here
+			body = stockError(it->first)->page;
+			p.contentType = "text/html";
+		}
+		p.body = std::make_shared<const std::string>(body);
+
+		if (!p.reason.empty())
+		{
+			HttpResponse res;
+			res.status = it->first;
+			res.reason = p.reason;
 			res.body = body;
-			res.headers["Content-Type"] = getContentTypeByPath(it->second);
-			res.headers["Content-Length"] = std::to_string(res.body.size());
-			return;
+			res.headers["Content-Type"] = p.contentType;
+			res.headers["Content-Length"] = std::to_string(body.size());
+
+			res.headers["Connection"] = "close";
+			p.close = std::make_shared<const std::string>(res.serialize());
+			res.headers["Connection"] = "keep-alive";
+			p.keepAlive = std::make_shared<const std::string>(res.serialize());
 		}
+
+		cfg.preparedErrors[it->first] = p;
 	}
+}
 
-	res.body = ErrorPage::defaultHtml(code, reason);
-	res.headers["Content-Type"] = "text/html";
-	res.headers["Content-Length"] = std::to_string(res.body.size());
+const std::string* HttpError::serialized(const ServerConfig& cfg, int code, bool keepAlive)
+{
+	std::map<int, PreparedError>::const_iterator it = cfg.preparedErrors.find(code);
+	if (it == cfg.preparedErrors.end())
+		return 0;
+
+	const std::shared_ptr<const std::string>& raw = (keepAlive ? it->second.keepAlive : it->second.close);
+	return raw.get();
+}
+
+const std::string* HttpError::prepared(const ServerConfig& cfg, const HttpResponse& res)
+{
+	// the serialized variants are HTTP/1.1 ones
+	if (!res.prepared || res.version != "HTTP/1.1")
+		return 0;
+
+	std::map<std::string, std::string>::const_iterator conn = res.headers.find("Connection");
+	if (conn == res.headers.end())
+		return 0;
+	if (conn->second == "close")
+		return serialized(cfg, res.status, false);
+	if (conn->second == "keep-alive")
+		return serialized(cfg, res.status, true);
+	return 0;
 }
@@ -7,5 +7,19 @@
 class HttpError
 {
 public:
+	// error page for code: the prepared one when there is one, so no file
+	// is read here; res.prepared tells whether it was
 	static void fill(HttpResponse& res, const ServerConfig& cfg, int code, const std::string& reason);
+
+	// at config load: reads the error_page files of cfg and serializes the
+	// error responses of the usual statuses and of those files
+	static void prepare(ServerConfig& cfg);
+
+	// the response for code and connection mode serialized by prepare(), 0
+	// if there is none
+	static const std::string* serialized(const ServerConfig& cfg, int code, bool keepAlive);
+
+	// res serialized by prepare(), picked by its Connection header, when
+	// res.prepared is still set; 0 otherwise
+	static const std::string* prepared(const ServerConfig& cfg, const HttpResponse& res);
 };
@@ -4,6 +4,11 @@
 #include "http/HttpError.hpp"
 #include "cgi/CgiRunner.hpp"
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+
 HttpHandler::~HttpHandler() {}
 
 HttpHandler::HttpHandler()
@@ -16,25 +21,158 @@ void HttpHandler::setServerConfigs(const std::vector<ServerConfig>* cfgs)
 	_cfgs = cfgs;
 }
 
-static void fillBadGateway(HttpResponse& res,const ServerConfig& cfg,const HttpRequest& req)
+static bool parseDecimal(const std::string& s,std::size_t& out)
 {
-	HttpError::fill(res,cfg,502,"Bad Gateway");
-	res.headers["Connection"]="close";
-	if(req.method=="HEAD")
-		res.body="";
+	std::size_t i=0;
+	while(i<s.size()&&(s[i]==' '||s[i]=='\t'))
+		++i;
+	std::size_t j=s.size();
+	while(j>i&&(s[j-1]==' '||s[j-1]=='\t'))
+		--j;
+	if(i==j)
+		return false;
+
+	std::size_t v=0;
+	for(;i<j;++i)
+	{
+		if(s[i]<'0'||s[i]>'9')
+			return false;
+		if(v>(static_cast<std::size_t>(-1)-9)/10)
+			return false;
+		v=v*10+static_cast<std::size_t>(s[i]-'0');
+	}
+	out=v;
+	return true;
+}
+
+// cgi_stream_body: once the headers of a POST to a fork-per-request CGI are
+// in, start the script and let the core pipe the body as it arrives.
+// checked is the connection's: the headers are looked at once per request,
+// not again on every read of a body that goes elsewhere.
+static bool startStreamedCgi(std::string& inBuffer,const ServerConfig& cfg,bool& checked,CgiLaunchSpec& cgi)
+{
+	if(checked||inBuffer.compare(0,5,"POST ")!=0)
+		return false;
+
+	HttpRequest req;
+	std::size_t bodyStart=0;
+
+	if(HttpParser::parseHeaders(inBuffer,req,bodyStart)!=HttpParser::OK)
+		return false;
+	checked=true;
+
+	HttpRouter::RouteResult rr;
+	if(!HttpRouter::streamedCgi(req,cfg,rr))
+		return false;
+
+	std::map<std::string,std::string>::const_iterator te=req.headers.find("transfer-encoding");
+	std::map<std::string,std::string>::const_iterator cl=req.headers.find("content-length");
+
+	if(te!=req.headers.end())
+		cgi.bodyChunked=true;
+	else if(cl==req.headers.end()||!parseDecimal(cl->second,cgi.bodyLength))
+		return false;
+
+	std::map<std::string,std::string> extra;
+	CgiRunner::buildEnv(rr.cgiScriptPath,req,extra,cgi.env);
+
+	// buildEnv() counts req.body, which is still empty here. A chunked body
+	// has no length up front: the script reads stdin until EOF.
+	for(std::size_t i=0;i<cgi.env.size();++i)
+	{
+		if(cgi.env[i].compare(0,15,"CONTENT_LENGTH=")!=0)
+			continue;
+		if(cgi.bodyChunked)
+			cgi.env.erase(cgi.env.begin()+static_cast<std::ptrdiff_t>(i));
+		else
+			cgi.env[i]="CONTENT_LENGTH="+std::to_string(cgi.bodyLength);
+		break;
+	}
+
+	cgi.backend=CgiLaunchSpec::FORK;
+	cgi.locationIndex=static_cast<std::size_t>(rr.location-&cfg.locations[0]);
+	cgi.extension=rr.cgiExtension;
+	cgi.interpreter=rr.cgiInterpreter;
+	cgi.scriptPath=rr.cgiScriptPath;
+	cgi.method=req.method;
+	cgi.version=req.version;
+	cgi.streamBody=true;
+
+	std::map<std::string,std::string>::const_iterator ae=req.headers.find("accept-encoding");
+	if(ae!=req.headers.end())
+		cgi.acceptEncoding=ae->second;
+
+	inBuffer.erase(0,bodyStart);
+	return true;
+}
+
+static bool isHopByHop(const std::string& name)
+{
+	static const char* names[]={"connection","keep-alive","proxy-connection","te","trailer",
+		"transfer-encoding","upgrade","expect","content-length",0};
+
+	for(std::size_t i=0;names[i];++i)
+	{
+		if(name==names[i])
+			return true;
+	}
+	return false;
+}
+
+// proxy_pass: the client's request line and end-to-end headers plus the
+// X-Forwarded-* set. The body was already de-chunked by the parser, so it
+// always goes with a Content-Length, on a keep-alive HTTP/1.1 connection.
+static std::string buildProxyHead(int fd,const HttpRequest& req,const std::string& upstream)
+{
+	std::string h=req.method+" "+req.target+" HTTP/1.1\r\n";
+	std::string forwardedFor;
+
+	for(std::map<std::string,std::string>::const_iterator it=req.headers.begin();it!=req.headers.end();++it)
+	{
+		if(isHopByHop(it->first)||it->first=="x-real-ip"||it->first=="x-forwarded-proto")
+			continue;
+		if(it->first=="x-forwarded-for")
+		{
+			forwardedFor=it->second;
+			continue;
+		}
+		h+=it->first+": "+it->second+"\r\n";
+	}
+
+	if(req.headers.find("host")==req.headers.end())
+		h+="host: "+upstream+"\r\n";
+
+	sockaddr_in sa;
+	socklen_t len=sizeof(sa);
+	char addr[INET_ADDRSTRLEN];
+	std::memset(&sa,0,sizeof(sa));
+	if(::getpeername(fd,reinterpret_cast<sockaddr*>(&sa),&len)==0&&sa.sin_family==AF_INET
+		&&::inet_ntop(AF_INET,&sa.sin_addr,addr,sizeof(addr)))
+	{
+		if(!forwardedFor.empty())
+			forwardedFor+=", ";
+		forwardedFor+=addr;
+		h+="x-real-ip: "+std::string(addr)+"\r\n";
+	}
+	if(!forwardedFor.empty())
+		h+="x-forwarded-for: "+forwardedFor+"\r\n";
+	h+="x-forwarded-proto: http\r\n";
+
+	if(!req.body.empty()||req.method=="POST")
+		h+="content-length: "+std::to_string(req.body.size())+"\r\n";
+	h+="connection: keep-alive\r\n\r\n";
+	return h;
 }
 
 void HttpHandler::onDataReceived(
 	int fd,
 	std::string& inBuffer,
-	std::string& outBuffer,
 	ConnectionState& state,
 	std::size_t serverConfigIndex,
-	std::string& stateData
+	bool& streamChecked,
+	HandlerResult& result
 )
 {
-	(void)fd;
-
 	if(!_cfgs||_cfgs->empty())
 		return;
 
@@ -49,17 +187,19 @@ void HttpHandler::onDataReceived(
 
 	if(r==HttpParser::NEED_MORE)
 	{
-		state=ConnectionState::READING;
+		if(startStreamedCgi(inBuffer,*cfg,streamChecked,result.cgi))
+			state=ConnectionState::CGI_PENDING;
+		else
+			state=ConnectionState::READING;
 		return;
 	}
 
-	HttpResponse res;
+	HttpResponse& res=result.response;
 
 	if(r==HttpParser::BAD_REQUEST)
 	{
 		HttpError::fill(res,*cfg,400,"Bad Request");
 		res.headers["Connection"]="close";
-		outBuffer=res.serialize();
 		state=ConnectionState::WRITING;
 		return;
 	}
@@ -68,45 +208,64 @@ void HttpHandler::onDataReceived(
 	{
 		HttpError::fill(res,*cfg,413,"Payload Too Large");
 		res.headers["Connection"]="close";
-		outBuffer=res.serialize();
 		state=ConnectionState::WRITING;
 		return;
 	}
 
 	HttpRouter::RouteResult rr=HttpRouter::route2(req,*cfg);
 
-	if(rr.isCgi)
+	if(rr.isProxy)
+	{
+		CgiLaunchSpec& cgi=result.cgi;
+
+		cgi.backend=CgiLaunchSpec::PROXY;
+		cgi.locationIndex=static_cast<std::size_t>(rr.location-&cfg->locations[0]);
+		cgi.proxyHead=buildProxyHead(fd,req,rr.location->proxyPass);
+		cgi.method=req.method;
+		cgi.version=req.version;
+		cgi.body.swap(req.body);
+
+		state=ConnectionState::CGI_PENDING;
+		return;
+	}
+
+	if(rr.isCgi||rr.isFastCgi)
 	{
-		CgiRunner::Spawned sp;
+		CgiLaunchSpec& cgi=result.cgi;
 		std::map<std::string,std::string> extra;
 
-		if(!CgiRunner::spawn(rr.cgiInterpreter,rr.cgiScriptPath,req,extra,sp))
+		if(rr.isFastCgi)
 		{
-			fillBadGateway(res,*cfg,req);
-			outBuffer=res.serialize();
-			state=ConnectionState::WRITING;
-			return;
+			cgi.backend=CgiLaunchSpec::FASTCGI;
+			extra["REQUEST_URI"]=req.target;
+			extra["DOCUMENT_ROOT"]=cfg->root;
+			if(!rr.location->root.empty())
+				extra["DOCUMENT_ROOT"]=rr.location->root;
 		}
+		else if(rr.location->cgiPools.find(rr.cgiExtension)!=rr.location->cgiPools.end())
+			cgi.backend=CgiLaunchSpec::POOL;
+		else
+			cgi.backend=CgiLaunchSpec::FORK;
 
-		// Формат stateData:
-		// CGI|<pid>|<stdinFd>|<stdoutFd>|<stderrFd>|<method>|<version>|<len>\n<body>
-		stateData.clear();
-		stateData+="CGI|";
-		stateData+=std::to_string((long long)sp.pid);
-		stateData+="|";
-		stateData+=std::to_string(sp.stdinFd);
-		stateData+="|";
-		stateData+=std::to_string(sp.stdoutFd);
-		stateData+="|";
-		stateData+=std::to_string(sp.stderrFd);
-		stateData+="|";
-		stateData+=req.method;
-		stateData+="|";
-		stateData+=req.version;
-		stateData+="|";
-		stateData+=std::to_string(req.body.size());
-		stateData+="\n";
-		stateData.append(req.body);
+		CgiRunner::buildEnv(rr.cgiScriptPath,req,extra,cgi.env);
+
+		cgi.locationIndex=static_cast<std::size_t>(rr.location-&cfg->locations[0]);
+		cgi.extension=rr.cgiExtension;
+		cgi.interpreter=rr.cgiInterpreter;
+		cgi.scriptPath=rr.cgiScriptPath;
+		cgi.method=req.method;
+		cgi.version=req.version;
+		cgi.body.swap(req.body);
+
+		std::map<std::string,std::string>::const_iterator h=req.headers.find("range");
+		if(h!=req.headers.end())
+			cgi.range=h->second;
+		h=req.headers.find("if-range");
+		if(h!=req.headers.end())
+			cgi.ifRange=h->second;
+		h=req.headers.find("accept-encoding");
+		if(h!=req.headers.end())
+			cgi.acceptEncoding=h->second;
 
 		state=ConnectionState::CGI_PENDING;
 		return;
@@ -116,6 +275,12 @@ void HttpHandler::onDataReceived(
 	res.headers["Connection"]="close";
 	res.version=req.version;
 
-	outBuffer=res.serialize();
+	result.location=rr.location;
+	result.method=req.method;
+	result.filePath.swap(rr.filePath);
+	std::map<std::string,std::string>::const_iterator ae=req.headers.find("accept-encoding");
+	if(ae!=req.headers.end())
+		result.acceptEncoding=ae->second;
+
 	state=ConnectionState::WRITING;
 }
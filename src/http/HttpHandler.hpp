@@ -15,10 +15,10 @@ public:
 	virtual void onDataReceived(
 		int clientFd,
 		std::string& inBuffer,
-		std::string& outBuffer,
 		ConnectionState& state,
 		std::size_t serverConfigIndex,
-		std::string& stateData
+		bool& streamChecked,
+		HandlerResult& result
 	);
 
 private:
@@ -142,6 +142,7 @@ static bool parseUnsignedSize(const std::string& s, std::size_t& out)
 
 static HttpParser::Result parseChunkedBody(
 	const std::string& rest,
+	std::size_t start,
 	std::size_t maxBody,
 	std::string& outBody,
 	std::size_t& consumed
@@ -150,7 +151,7 @@ static HttpParser::Result parseChunkedBody(
 	outBody.clear();
 	consumed = 0;
 
-	std::size_t p = 0;
+	std::size_t p = start;
 	while (true)
 	{
 		std::size_t lineEnd = rest.find("\r\n", p);
@@ -208,13 +209,13 @@ static HttpParser::Result parseChunkedBody(
 		{
 			if (p == rest.size())
 			{
-				consumed = p;
+				consumed = p - start;
 				return HttpParser::OK;
 			}
 			if (rest.size() >= p + 2 && rest.compare(p, 2, "\r\n") == 0)
 			{
 				p += 2;
-				consumed = p;
+				consumed = p - start;
 				return HttpParser::OK;
 			}
 
@@ -222,7 +223,7 @@ static HttpParser::Result parseChunkedBody(
 			if (trailersEnd == std::string::npos)
 				return HttpParser::NEED_MORE;
 
-			consumed = trailersEnd + 4;
+			consumed = trailersEnd + 4 - start;
 			return HttpParser::OK;
 		}
 	}
@@ -230,18 +231,14 @@ static HttpParser::Result parseChunkedBody(
 
 // ---------------- main parse ----------------
 
-HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, std::size_t maxBodySize)
+// request-line + headers + target; inBuffer[headersEnd] is the CRLFCRLF
+static HttpParser::Result parseHead(const std::string& inBuffer, std::size_t headersEnd, HttpRequest& req)
 {
-	// find end of headers (CRLFCRLF)
-	std::size_t headersEnd = inBuffer.find("\r\n\r\n");
-	if (headersEnd == std::string::npos)
-		return NEED_MORE;
-
 	// IMPORTANT FIX:
 	// request-line ends with the FIRST CRLF, which may be exactly at headersEnd when there are NO headers.
 	std::size_t lineEnd = inBuffer.find("\r\n");
 	if (lineEnd == std::string::npos || lineEnd > headersEnd)
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 
 	std::string requestLine = inBuffer.substr(0, lineEnd);
 
@@ -253,16 +250,13 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 	else
 		headersPart = "";
 
-	// body starts after CRLFCRLF
-	std::string rest = inBuffer.substr(headersEnd + 4);
-
 	// parse request line
 	std::size_t p1 = requestLine.find(' ');
 	if (p1 == std::string::npos)
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 	std::size_t p2 = requestLine.find(' ', p1 + 1);
 	if (p2 == std::string::npos)
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 
 	req.method  = requestLine.substr(0, p1);
 	req.target  = requestLine.substr(p1 + 1, p2 - p1 - 1);
@@ -279,7 +273,7 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 	else if (req.version == "HTTP/1.0")
 		isHttp11 = false;
 	else
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 
 	// parse headers lines (headersPart contains lines separated by CRLF, WITHOUT the final empty line)
 	std::size_t pos = 0;
@@ -304,7 +298,7 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 
 		std::size_t colon = line.find(':');
 		if (colon == std::string::npos)
-			return BAD_REQUEST;
+			return HttpParser::BAD_REQUEST;
 
 		std::string key = toLower(line.substr(0, colon));
 		std::string value = trimLeftSpaces(line.substr(colon + 1));
@@ -320,7 +314,7 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 	if (isHttp11)
 	{
 		if (req.headers.find("host") == req.headers.end())
-			return BAD_REQUEST;
+			return HttpParser::BAD_REQUEST;
 	}
 
 	// absolute-form target -> strip scheme+host, keep path
@@ -356,16 +350,47 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 	// decode + normalize
 	std::string decoded;
 	if (!percentDecode(rawPath, decoded))
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 
 	std::string normalized;
 	if (!normalizePath(decoded, normalized))
-		return BAD_REQUEST;
+		return HttpParser::BAD_REQUEST;
 
 	req.path = normalized;
 	if (req.hadTrailingSlash && req.path.size() > 1 && req.path[req.path.size() - 1] != '/')
 		req.path += "/";
 
+	return HttpParser::OK;
+}
+
+HttpParser::Result HttpParser::parseHeaders(const std::string& inBuffer, HttpRequest& req, std::size_t& bodyStart)
+{
+	std::size_t headersEnd = inBuffer.find("\r\n\r\n");
+	if (headersEnd == std::string::npos)
+		return NEED_MORE;
+
+	Result r = parseHead(inBuffer, headersEnd, req);
+	if (r != OK)
+		return r;
+
+	bodyStart = headersEnd + 4;
+	return OK;
+}
+
+HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, std::size_t maxBodySize)
+{
+	// find end of headers (CRLFCRLF)
+	std::size_t headersEnd = inBuffer.find("\r\n\r\n");
+	if (headersEnd == std::string::npos)
+		return NEED_MORE;
+
+	Result hr = parseHead(inBuffer, headersEnd, req);
+	if (hr != OK)
+		return hr;
+
+	// body starts after CRLFCRLF
+	std::size_t bodyStart = headersEnd + 4;
+
 	// transfer-encoding
 	bool isChunked = false;
 	std::map<std::string, std::string>::const_iterator te = req.headers.find("transfer-encoding");
@@ -383,12 +408,12 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 		std::string body;
 		std::size_t consumed = 0;
 
-		Result r = parseChunkedBody(rest, maxBodySize, body, consumed);
+		Result r = parseChunkedBody(inBuffer, bodyStart, maxBodySize, body, consumed);
 		if (r != OK)
 			return r;
 
-		req.body = body;
-		inBuffer.erase(0, headersEnd + 4 + consumed);
+		req.body.swap(body);
+		inBuffer.erase(0, bodyStart + consumed);
 		return OK;
 	}
 
@@ -408,12 +433,131 @@ HttpParser::Result HttpParser::parse(std::string& inBuffer, HttpRequest& req, st
 	if (contentLength > maxBodySize)
 		return TOO_LARGE;
 
-	if (rest.size() < contentLength)
+	if (inBuffer.size() - bodyStart < contentLength)
 		return NEED_MORE;
 
 	if (contentLength > 0)
-		req.body = rest.substr(0, contentLength);
+		req.body.assign(inBuffer, bodyStart, contentLength);
 
-	inBuffer.erase(0, headersEnd + 4 + contentLength);
+	inBuffer.erase(0, bodyStart + contentLength);
 	return OK;
 }
+
+// ---------------- incremental chunked decoder ----------------
+
+static const std::size_t MAX_CHUNK_LINE = 1024;
+
+ChunkedDecoder::ChunkedDecoder()
+	: _state(SIZE_LINE)
+	, _left(0)
+{
+}
+
+bool ChunkedDecoder::done() const
+{
+	return (_state == DONE);
+}
+
+HttpParser::Result ChunkedDecoder::feed(std::string& in, std::string& out)
+{
+	std::size_t p = 0;
+	HttpParser::Result r = HttpParser::NEED_MORE;
+
+	while (_state != DONE)
+	{
+		if (_state == SIZE_LINE)
+		{
+			std::size_t lineEnd = in.find("\r\n", p);
+			if (lineEnd == std::string::npos)
+			{
+				if (in.size() - p > MAX_CHUNK_LINE)
+					r = HttpParser::BAD_REQUEST;
+				break;
+			}
+
+			std::size_t end = in.find(';', p);
+			if (end == std::string::npos || end > lineEnd)
+				end = lineEnd;
+			while (p < end && (in[p] == ' ' || in[p] == '\t'))
+				++p;
+			while (end > p && (in[end - 1] == ' ' || in[end - 1] == '\t'))
+				--end;
+
+			if (p == end)
+			{
+				r = HttpParser::BAD_REQUEST;
+				break;
+			}
+
+			std::size_t size = 0;
+			bool ok = true;
+			for (std::size_t i = p; i < end; ++i)
+			{
+				int hv = hexVal(in[i]);
+				if (hv < 0 || size > (static_cast<std::size_t>(-1) >> 4))
+				{
+					ok = false;
+					break;
+				}
+				size = (size << 4) + static_cast<std::size_t>(hv);
+			}
+			if (!ok)
+			{
+				r = HttpParser::BAD_REQUEST;
+				break;
+			}
+
+			p = lineEnd + 2;
+			_left = size;
+			if (size == 0)
+				_state = TRAILERS;
+			else
+				_state = DATA;
+		}
+		else if (_state == DATA)
+		{
+			std::size_t n = in.size() - p;
+			if (n > _left)
+				n = _left;
+
+			out.append(in, p, n);
+			p += n;
+			_left -= n;
+
+			if (_left > 0)
+				break;
+			_state = DATA_CRLF;
+		}
+		else if (_state == DATA_CRLF)
+		{
+			if (in.size() - p < 2)
+				break;
+			if (in.compare(p, 2, "\r\n") != 0)
+			{
+				r = HttpParser::BAD_REQUEST;
+				break;
+			}
+			p += 2;
+			_state = SIZE_LINE;
+		}
+		else
+		{
+			std::size_t lineEnd = in.find("\r\n", p);
+			if (lineEnd == std::string::npos)
+			{
+				if (in.size() - p > MAX_CHUNK_LINE)
+					r = HttpParser::BAD_REQUEST;
+				break;
+			}
+			if (lineEnd == p)
+				_state = DONE;
+			p = lineEnd + 2;
+		}
+	}
+
+	in.erase(0, p);
+
+	if (_state == DONE)
+		return HttpParser::OK;
+	return r;
+}
@@ -21,4 +21,39 @@ public:
 		HttpRequest& out,
 		std::size_t maxBodySize
 	);
+
+	// Request line and headers only (cgi_stream_body): the body is left in
+	// inBuffer starting at bodyStart.
+	static Result parseHeaders
+	(
+		const std::string& inBuffer,
+		HttpRequest& out,
+		std::size_t& bodyStart
+	);
+};
+
+// Incremental Transfer-Encoding: chunked decoder for bodies that are
+// forwarded while they arrive (cgi_stream_body).
+class ChunkedDecoder
+{
+public:
+	ChunkedDecoder();
+
+	// Consumes complete pieces from the front of in and appends the payload
+	// to out. OK once the last chunk and trailers are read.
+	HttpParser::Result feed(std::string& in, std::string& out);
+	bool done() const;
+
+private:
+	enum State
+	{
+		SIZE_LINE,
+		DATA,
+		DATA_CRLF,
+		TRAILERS,
+		DONE
+	};
+
+	State _state;
+	std::size_t _left;
 };
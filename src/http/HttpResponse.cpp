@@ -1,5 +1,50 @@
 #include "http/HttpResponse.hpp"
 
+void HttpResponse::planFile(const std::string& path, off_t offset, off_t length)
+{
+	body.clear();
+	prepared = false;
+	source.kind = BodySource::FILE;
+	source.path = path;
+	source.parts.clear();
+	source.offset = offset;
+	source.length = length;
+}
+
+void HttpResponse::planParts(const std::string& path, std::vector<BodyPart>& parts)
+{
+	body.clear();
+	prepared = false;
+	source = BodySource();
+	source.kind = BodySource::FILE;
+	source.path = path;
+	source.parts.swap(parts);
+}
+
+void HttpResponse::planNone()
+{
+	body.clear();
+	prepared = false;
+	source = BodySource();
+	source.kind = BodySource::NONE;
+}
+
+std::size_t HttpResponse::bodyLength() const
+{
+	if (source.kind == BodySource::FILE && !source.parts.empty())
+	{
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < source.parts.size(); ++i)
+			n += source.parts[i].head.size() + static_cast<std::size_t>(source.parts[i].length);
+		return n;
+	}
+	if (source.kind == BodySource::FILE)
+		return static_cast<std::size_t>(source.length);
+	if (source.kind == BodySource::NONE)
+		return 0;
+	return body.size();
+}
+
 std::string HttpResponse::serialize() const
 {
 	std::string result;
@@ -1,6 +1,48 @@
 #pragma once
 #include <string>
 #include <map>
+#include <vector>
+#include <sys/types.h>
+
+// One part of a multipart/byteranges body: its header text, then length
+// bytes of the file from offset.
+struct BodyPart
+{
+	std::string head;
+	off_t offset;
+	off_t length;
+
+	BodyPart()
+		: head(), offset(0), length(0)
+	{
+	}
+};
+
+// Where the body of a response comes from. Responses are planned from
+// metadata (stat) alone: a FILE body is opened by the writer, and only when
+// the body actually goes out, so HEAD, 304 and 416 never touch file data.
+struct BodySource
+{
+	enum Kind
+	{
+		MEMORY, // HttpResponse::body
+		FILE,   // length bytes of path from offset, sent with sendfile()
+		NONE    // nothing follows the headers; Content-Length may still be set
+	};
+
+	Kind kind;
+	std::string path;
+	off_t offset;
+	off_t length;
+	// FILE sent as multipart/byteranges: the parts in order, each range
+	// sent from the file; offset and length are unused
+	std::vector<BodyPart> parts;
+
+	BodySource()
+		: kind(MEMORY), path(), offset(0), length(0), parts()
+	{
+	}
+};
 
 struct HttpResponse
 {
@@ -9,11 +51,26 @@ struct HttpResponse
 	std::string reason;
 	std::map<std::string, std::string> headers;
 	std::string body;
+	BodySource source;
+
+	// set by HttpError::fill(): status line, headers and body are the error
+	// response serialized at config load, give or take Connection. Whatever
+	// changes anything else clears it.
+	bool prepared;
 
 	HttpResponse()
-		: version("HTTP/1.1"), status(200), reason("OK"), headers(), body()
+		: version("HTTP/1.1"), status(200), reason("OK"), headers(), body(), source(), prepared(false)
 	{
 	}
 
+	void planFile(const std::string& path, off_t offset, off_t length);
+	void planParts(const std::string& path, std::vector<BodyPart>& parts);
+	void planNone();
+
+	// bytes the body will have once materialized
+	std::size_t bodyLength() const;
+
+	// status line, headers and an in-memory body; a FILE body follows
+	// separately
 	std::string serialize() const;
 };
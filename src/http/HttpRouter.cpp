@@ -2,6 +2,7 @@
 #include "http/HttpError.hpp"
 #include "utils/FileUtils.hpp"
 #include "http/AutoIndex.hpp"
+#include "http/StaticFile.hpp"
 
 #include <unistd.h>
 #include <ctime>
@@ -9,6 +10,7 @@
 #include <string>
 #include <cctype>
 #include <cstdlib>
+#include <climits>
 
 // ---------- helpers ----------
 
@@ -65,31 +67,119 @@ static std::string getExtWithDot(const std::string& p)
 	return p.substr(dot); // includes '.'
 }
 
-static std::string getContentTypeByPath(const std::string& p)
+// GET/HEAD of a regular file, planned from stat() alone: the body is a
+// byte range of the file that the writer sends, or nothing for HEAD, 304
+// and 416; multipart/byteranges is a list of ranges sent the same way. With
+// gzip_static / brotli_static a fresh precompressed sibling is served
+// instead when the client takes it.
+// false, with res left empty, if path is not a regular file.
+static bool fillFileResponse(const HttpRequest& req, const ServerConfig& cfg, const LocationConfig& loc, const std::string& path, HttpResponse& res)
 {
-    std::size_t dot = p.rfind('.');
-    if (dot == std::string::npos)
-        return "text/plain";
-
-    std::string ext = p.substr(dot + 1);
-    ext = toLowerStr(ext);
-
-    if (ext == "html" || ext == "htm") return "text/html";
-    if (ext == "css")  return "text/css";
-    if (ext == "js")   return "application/javascript";
-    if (ext == "png")  return "image/png";
-    if (ext == "jpg" || ext == "jpeg") return "image/jpeg";
-    if (ext == "gif")  return "image/gif";
-    if (ext == "txt")  return "text/plain";
-
-    // ВАЖНО ДЛЯ ВАШЕГО SUBJECT/TESTER:
-    if (ext == "bad_extension") return "text/html";   // youpi.bad_extension обычно HTML
-    if (ext == "bla")           return "text/plain";  // youpi.bla — текст
-    if (ext == "py")            return "text/plain";  // если вдруг отдаётся как статика
-
-    return "application/octet-stream";
-}
+	bool negotiate = (loc.gzipStatic || loc.brotliStatic);
+
+	StaticFile::Info info;
+	if (!StaticFile::lookup(path, negotiate, info))
+		return false;
+
+	const std::string& contentType = cfg.mimeTypes.lookup(path);
+	std::string bodyPath = path;
+	struct stat st = info.st;
+
+	if (negotiate)
+	{
+		res.headers["Vary"] = "Accept-Encoding";
+
+		if (loc.brotliStatic && info.hasBrotli && StaticFile::acceptsEncoding(req, "br"))
+		{
+			bodyPath = path + ".br";
+			st = info.brotli;
+			res.headers["Content-Encoding"] = "br";
+		}
+		else if (loc.gzipStatic && info.hasGzip && StaticFile::acceptsEncoding(req, "gzip"))
+		{
+			bodyPath = path + ".gz";
+			st = info.gzip;
+			res.headers["Content-Encoding"] = "gzip";
+		}
+	}
+
+	std::string etag = StaticFile::etag(st);
+
+	res.headers["ETag"] = etag;
+	res.headers["Last-Modified"] = StaticFile::httpDate(st.st_mtime);
+
+	if (StaticFile::notModified(req, etag, st.st_mtime))
+	{
+		res.status = 304;
+		res.reason = "Not Modified";
+		res.planNone();
+		return true;
+	}
+
+	res.headers["Accept-Ranges"] = "bytes";
+
+	std::vector<StaticFile::ByteRange> ranges;
+	StaticFile::RangeResult rangeResult = StaticFile::RANGE_NONE;
+
+	std::map<std::string, std::string>::const_iterator itRange = req.headers.find("range");
+	if (req.method == "GET" && itRange != req.headers.end())
+	{
+		std::string ifRange;
+		std::map<std::string, std::string>::const_iterator itIf = req.headers.find("if-range");
+		if (itIf != req.headers.end())
+			ifRange = itIf->second;
+
+		if (StaticFile::ifRangeMatches(ifRange, etag, st.st_mtime))
+			rangeResult = StaticFile::parseRange(itRange->second, st.st_size, ranges);
+	}
+
+	if (rangeResult == StaticFile::RANGE_UNSATISFIABLE)
+	{
+		res.status = 416;
+		res.reason = "Range Not Satisfiable";
+		res.headers["Content-Range"] = "bytes */" + std::to_string((long long)st.st_size);
+		res.headers["Content-Length"] = "0";
+		res.planNone();
+		return true;
+	}
+
+	if (rangeResult == StaticFile::RANGE_OK && ranges.size() == 1)
+	{
+		off_t len = ranges[0].last - ranges[0].first + 1;
+
+		res.status = 206;
+		res.reason = "Partial Content";
+		res.headers["Content-Type"] = contentType;
+		res.headers["Content-Range"] = StaticFile::contentRange(ranges[0], st.st_size);
+		res.headers["Content-Length"] = std::to_string((long long)len);
+		res.planFile(bodyPath, ranges[0].first, len);
+		return true;
+	}
+
+	if (rangeResult == StaticFile::RANGE_OK)
+	{
+		std::string boundary = StaticFile::makeBoundary(etag);
+		std::vector<BodyPart> parts;
+		StaticFile::multipartParts(ranges, st.st_size, contentType, boundary, parts);
+
+		res.status = 206;
+		res.reason = "Partial Content";
+		res.headers["Content-Type"] = "multipart/byteranges; boundary=" + boundary;
+		res.planParts(bodyPath, parts);
+		res.headers["Content-Length"] = std::to_string(res.bodyLength());
+		return true;
+	}
 
+	res.status = 200;
+	res.reason = "OK";
+	res.headers["Content-Type"] = contentType;
+	res.headers["Content-Length"] = std::to_string((long long)st.st_size);
+	if (req.method == "GET")
+		res.planFile(bodyPath, 0, st.st_size);
+	else
+		res.planNone();
+	return true;
+}
 
 static std::string makeUploadFileName()
 {
@@ -104,29 +194,33 @@ static std::string makeUploadFileName()
 		+ ".bin";
 }
 
+// nginx order: "= path", else the longest prefix if it is "^~", else the
+// first regex that matches, else that longest prefix
 static const LocationConfig* matchLocation(const ServerConfig& cfg, const std::string& path)
 {
-	for (std::size_t i = 0; i < cfg.locations.size(); ++i)
+	long i = cfg.locationTrie.matchExact(path);
+	if (i < 0)
 	{
-		const LocationConfig& loc = cfg.locations[i];
-		const std::string& pre = loc.prefix;
-
-		if (pre == "/")
-			return &loc;
-
-		if (path.size() >= pre.size() && path.compare(0, pre.size(), pre) == 0)
+		i = cfg.locationTrie.match(path);
+		if (i < 0 || cfg.locations[static_cast<std::size_t>(i)].match != LocationConfig::PREFIX_NO_REGEX)
 		{
-			if (path.size() == pre.size())
-				return &loc;
-
-			if (!pre.empty() && pre[pre.size() - 1] == '/')
-				return &loc;
-
-			if (path[pre.size()] == '/')
-				return &loc;
+			long r = cfg.locationRegex.match(path);
+			if (r >= 0)
+				i = r;
 		}
 	}
-	return 0;
+	if (i < 0 || static_cast<std::size_t>(i) >= cfg.locations.size())
+		return 0;
+	return &cfg.locations[static_cast<std::size_t>(i)];
+}
+
+// loc.root already holds the server's root after config load; the built-in
+// ServerConfig() default is the one config that never went through it
+static const std::string& locationRoot(const ServerConfig& cfg, const LocationConfig& loc)
+{
+	if (!loc.root.empty())
+		return loc.root;
+	return cfg.root;
 }
 
 static std::string buildRelPath(const LocationConfig* loc, const std::string& reqPath)
@@ -136,8 +230,9 @@ static std::string buildRelPath(const LocationConfig* loc, const std::string& re
 	if (!loc)
 		return rel;
 
-	// if location is "/", reqPath is "/x/y" -> rel = "x/y"
-	if (loc->prefix == "/")
+	// if location is "/", reqPath is "/x/y" -> rel = "x/y"; regex and "="
+	// locations always map the whole path
+	if (loc->prefix == "/" || (loc->match != LocationConfig::PREFIX && loc->match != LocationConfig::PREFIX_NO_REGEX))
 	{
 		if (reqPath.size() > 1)
 			return reqPath.substr(1);
@@ -186,7 +281,17 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 	{
 		HttpError::fill(rr.response, cfg, 500, "Internal Server Error");
 		if (req.method == "HEAD")
-			rr.response.body = "";
+			rr.response.planNone();
+		applyConnectionPolicy(req, rr.response);
+		return rr;
+	}
+
+	// internal locations do not exist for clients
+	if (loc->internal)
+	{
+		HttpError::fill(rr.response, cfg, 404, "Not Found");
+		if (req.method == "HEAD")
+			rr.response.planNone();
 		applyConnectionPolicy(req, rr.response);
 		return rr;
 	}
@@ -223,16 +328,28 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 	}
 
 	// ----- build filesystem path using location -----
-	std::string baseRoot = cfg.root;
-	if (!loc->root.empty())
-		baseRoot = loc->root;
-
-	std::string indexName = cfg.index;
-	if (!loc->index.empty())
-		indexName = loc->index;
+	// root and index were merged with the server's at config load
+	const std::string& indexName = loc->index;
 
 	std::string relPath = buildRelPath(loc, req.path);
-	std::string fsPath = FileUtils::join(baseRoot, relPath);
+	std::string fsPath = FileUtils::join(locationRoot(cfg, *loc), relPath);
+
+	rr.location = loc;
+
+	// ----- proxy_pass: forwarded as is, nothing is looked up on disk -----
+	if (!loc->proxyPass.empty())
+	{
+		rr.isProxy = true;
+		return rr;
+	}
+
+	// ----- FastCGI: the whole location belongs to the application -----
+	if (!loc->fastcgiPass.empty())
+	{
+		rr.isFastCgi = true;
+		rr.cgiScriptPath = fsPath;
+		return rr;
+	}
 
 	// =========================
 	// CGI detect (tester): only POST + ext in cfg.cgi
@@ -248,7 +365,7 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 			{
 				HttpError::fill(rr.response, cfg, 404, "Not Found");
 				if (req.method == "HEAD")
-					rr.response.body = "";
+					rr.response.planNone();
 				applyConnectionPolicy(req, rr.response);
 				return rr;
 			}
@@ -256,6 +373,7 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 			rr.isCgi = true;
 			rr.cgiInterpreter = it->second;
 			rr.cgiScriptPath = fsPath;
+			rr.cgiExtension = ext;
 			return rr;
 		}
 	}
@@ -274,7 +392,7 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 		{
 			HttpError::fill(rr.response, cfg, 500, "Internal Server Error");
 			if (req.method == "HEAD")
-				rr.response.body = "";
+				rr.response.planNone();
 			applyConnectionPolicy(req, rr.response);
 			return rr;
 		}
@@ -327,7 +445,7 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 
 			HttpError::fill(rr.response, cfg, 500, "Internal Server Error");
 			if (req.method == "HEAD")
-				rr.response.body = "";
+				rr.response.planNone();
 			rr.response.headers["Connection"] = "close";
 			return rr;
 		}
@@ -358,15 +476,10 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 
 		{
 			std::string indexPath = FileUtils::join(fsPath, indexName);
-			std::string indexBody;
 
-			if (FileUtils::readFile(indexPath, indexBody))
+			if (fillFileResponse(req, cfg, *loc, indexPath, rr.response))
 			{
-				rr.response.status = 200;
-				rr.response.reason = "OK";
-				rr.response.headers["Content-Type"] = getContentTypeByPath(indexPath);
-				rr.response.headers["Content-Length"] = std::to_string(indexBody.size());
-				rr.response.body = (req.method == "GET") ? indexBody : "";
+				rr.filePath = indexPath;
 				applyConnectionPolicy(req, rr.response);
 				return rr;
 			}
@@ -390,46 +503,131 @@ HttpRouter::RouteResult HttpRouter::route2(const HttpRequest& req, const ServerC
 
 		HttpError::fill(rr.response, cfg, 404, "Not Found");
 		if (req.method == "HEAD")
-			rr.response.body = "";
+			rr.response.planNone();
 		applyConnectionPolicy(req, rr.response);
 		return rr;
 	}
 
 	// file
 	{
-		std::string body;
-
-		if (!FileUtils::readFile(fsPath, body))
+		if (!fillFileResponse(req, cfg, *loc, fsPath, rr.response))
 		{
 			HttpError::fill(rr.response, cfg, 404, "Not Found");
 			if (req.method == "HEAD")
-				rr.response.body = "";
+				rr.response.planNone();
 			applyConnectionPolicy(req, rr.response);
 			return rr;
 		}
 
-		rr.response.status = 200;
-		rr.response.reason = "OK";
-		rr.response.headers["Content-Type"] = getContentTypeByPath(fsPath);
-		rr.response.headers["Content-Length"] = std::to_string(body.size());
-		rr.response.body = (req.method == "GET") ? body : "";
+		rr.filePath = fsPath;
 		applyConnectionPolicy(req, rr.response);
 		return rr;
 	}
 }
 
+bool HttpRouter::streamedCgi(const HttpRequest& req, const ServerConfig& cfg, RouteResult& rr)
+{
+	if (req.method != "POST")
+		return false;
+
+	const LocationConfig* loc = matchLocation(cfg, req.path);
+	if (!loc || !loc->cgiStreamBody || loc->internal || !loc->allowPost || loc->hasReturn)
+		return false;
+	if (!loc->proxyPass.empty() || !loc->fastcgiPass.empty())
+		return false;
+
+	std::string fsPath = FileUtils::join(locationRoot(cfg, *loc), buildRelPath(loc, req.path));
+	std::string ext = getExtWithDot(fsPath);
+	if (ext.empty() || loc->cgiPools.find(ext) != loc->cgiPools.end())
+		return false;
+
+	std::map<std::string, std::string>::const_iterator it = cfg.cgi.find(ext);
+	if (it == cfg.cgi.end())
+		return false;
+	// a missing script is route2()'s 404 once the body is in
+	if (!FileUtils::exists(fsPath) || FileUtils::isDirectory(fsPath))
+		return false;
+
+	rr.isCgi = true;
+	rr.location = loc;
+	rr.cgiInterpreter = it->second;
+	rr.cgiScriptPath = fsPath;
+	rr.cgiExtension = ext;
+	return true;
+}
+
+
+static bool hasDotDotSegment(const std::string& p)
+{
+	std::size_t i = 0;
+	while (i <= p.size())
+	{
+		std::size_t j = p.find('/', i);
+		if (j == std::string::npos)
+			j = p.size();
+		if (p.compare(i, j - i, "..") == 0 && j - i == 2)
+			return true;
+		i = j + 1;
+	}
+	return false;
+}
+
+bool HttpRouter::resolveInternal(const ServerConfig& cfg, const std::string& uri, std::string& fsPath)
+{
+	std::string path = uri;
+	std::size_t q = path.find('?');
+	if (q != std::string::npos)
+		path.erase(q);
+
+	if (path.empty() || path[0] != '/' || hasDotDotSegment(path))
+		return false;
+
+	const LocationConfig* loc = matchLocation(cfg, path);
+	if (!loc || !loc->internal)
+		return false;
+
+	fsPath = FileUtils::join(locationRoot(cfg, *loc), buildRelPath(loc, path));
+	return true;
+}
+
+bool HttpRouter::sendfileAllowed(const ServerConfig& cfg, const std::string& path)
+{
+	char resolved[PATH_MAX];
+	if (::realpath(path.c_str(), resolved) == 0)
+		return false;
+
+	std::string real = resolved;
+
+	for (std::size_t i = 0; i < cfg.locations.size(); ++i)
+	{
+		const LocationConfig& loc = cfg.locations[i];
+		if (!loc.internal)
+			continue;
+
+		char rootBuf[PATH_MAX];
+		if (::realpath(locationRoot(cfg, loc).c_str(), rootBuf) == 0)
+			continue;
+
+		std::string root = rootBuf;
+		if (root != "/")
+			root += "/";
+		if (real.compare(0, root.size(), root) == 0)
+			return true;
+	}
+	return false;
+}
 
 HttpResponse HttpRouter::route(const HttpRequest& req, const ServerConfig& cfg)
 {
 	RouteResult rr = route2(req, cfg);
 
-	if (rr.isCgi)
+	if (rr.isCgi || rr.isFastCgi)
 	{
 		HttpResponse res;
 		res.version = req.version;
 		HttpError::fill(res, cfg, 500, "Internal Server Error");
 		if (req.method == "HEAD")
-			res.body = "";
+			res.planNone();
 		applyConnectionPolicy(req, res);
 		return res;
 	}
@@ -11,13 +11,29 @@ public:
 	struct RouteResult
 	{
 		bool isCgi;
+		bool isFastCgi;
+		bool isProxy;
 		std::string cgiInterpreter;
 		std::string cgiScriptPath;
+		std::string cgiExtension;
+		const LocationConfig* location;
 		HttpResponse response;
+		// file behind a 200 response, for the compressed-variant cache
+		std::string filePath;
 
-		RouteResult() : isCgi(false), cgiInterpreter(), cgiScriptPath(), response() {}
+		RouteResult() : isCgi(false), isFastCgi(false), isProxy(false), cgiInterpreter(), cgiScriptPath(), cgiExtension(), location(0), response(), filePath() {}
 	};
 
 	static HttpResponse route(const HttpRequest& req, const ServerConfig& cfg);
 	static RouteResult route2(const HttpRequest& req, const ServerConfig& cfg);
+
+	// cgi_stream_body: the fork-per-request CGI route2() would pick for a
+	// POST whose body is not in yet, found without touching anything (no
+	// upload, no error response); false when the request goes elsewhere
+	static bool streamedCgi(const HttpRequest& req, const ServerConfig& cfg, RouteResult& rr);
+
+	// X-Accel-Redirect: URI of an internal location -> file path
+	static bool resolveInternal(const ServerConfig& cfg, const std::string& uri, std::string& fsPath);
+	// X-Sendfile: path must lie under the root of an internal location
+	static bool sendfileAllowed(const ServerConfig& cfg, const std::string& path);
 };
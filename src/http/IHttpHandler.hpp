@@ -2,11 +2,12 @@
 
 #include <string>
 #include "core/ConnectionState.hpp"
+#include "http/HandlerResult.hpp"
 
 class IHttpHandler
 {
 public:
-	
+
 	virtual ~IHttpHandler()
 	{
 	}
@@ -15,9 +16,9 @@ public:
 	(
 		int clientFd,
 		std::string& inBuffer,
-		std::string& outBuffer,
 		ConnectionState& state,
 		std::size_t serverConfigIndex,
-		std::string& sessionId
+		bool& streamChecked,
+		HandlerResult& result
 	)=0;
 };
@@ -0,0 +1,386 @@
+#include "http/StaticFile.hpp"
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <map>
+#include <chrono>
+#include <algorithm>
+
+bool StaticFile::statRegular(const std::string& path, struct stat& st)
+{
+	if (::stat(path.c_str(), &st) != 0)
+		return false;
+	return S_ISREG(st.st_mode);
+}
+
+struct CachedInfo
+{
+	StaticFile::Info info;
+	bool siblingsChecked;
+	std::chrono::steady_clock::time_point checkedAt;
+};
+
+static std::map<std::string, CachedInfo>& infoCache()
+{
+	static std::map<std::string, CachedInfo> cache;
+	return cache;
+}
+
+static bool freshSibling(const std::string& path, const struct stat& orig, struct stat& st)
+{
+	if (!StaticFile::statRegular(path, st))
+		return false;
+	return (st.st_mtim.tv_sec > orig.st_mtim.tv_sec
+		|| (st.st_mtim.tv_sec == orig.st_mtim.tv_sec && st.st_mtim.tv_nsec >= orig.st_mtim.tv_nsec));
+}
+
+bool StaticFile::lookup(const std::string& path, bool siblings, Info& out)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::map<std::string, CachedInfo>& cache = infoCache();
+
+	std::map<std::string, CachedInfo>::iterator it = cache.find(path);
+	if (it != cache.end())
+	{
+		if (now - it->second.checkedAt < std::chrono::milliseconds(CACHE_VALID_MS)
+			&& (it->second.siblingsChecked || !siblings))
+		{
+			out = it->second.info;
+			return true;
+		}
+		cache.erase(it);
+	}
+
+	Info info;
+	std::memset(&info, 0, sizeof(info));
+	if (!statRegular(path, info.st))
+		return false;
+
+	if (siblings)
+	{
+		info.hasGzip = freshSibling(path + ".gz", info.st, info.gzip);
+		info.hasBrotli = freshSibling(path + ".br", info.st, info.brotli);
+	}
+
+	// a burst of distinct paths: start over rather than track ages
+	if (cache.size() >= CACHE_MAX_ENTRIES)
+		cache.clear();
+
+	CachedInfo& c = cache[path];
+	c.info = info;
+	c.siblingsChecked = siblings;
+	c.checkedAt = now;
+
+	out = info;
+	return true;
+}
+
+bool StaticFile::acceptsEncoding(const HttpRequest& req, const std::string& coding)
+{
+	std::map<std::string, std::string>::const_iterator it = req.headers.find("accept-encoding");
+	if (it == req.headers.end())
+		return false;
+	return acceptsEncoding(it->second, coding);
+}
+
+bool StaticFile::acceptsEncoding(const std::string& v, const std::string& coding)
+{
+	bool star = false;
+
+	std::size_t pos = 0;
+	while (pos < v.size())
+	{
+		std::size_t comma = v.find(',', pos);
+		if (comma == std::string::npos)
+			comma = v.size();
+
+		std::size_t b = pos;
+		std::size_t e = v.find(';', pos);
+		if (e == std::string::npos || e > comma)
+			e = comma;
+		while (b < e && (v[b] == ' ' || v[b] == '\t'))
+			++b;
+		std::size_t nameEnd = e;
+		while (nameEnd > b && (v[nameEnd - 1] == ' ' || v[nameEnd - 1] == '\t'))
+			--nameEnd;
+
+		double q = 1.0;
+		std::size_t qpos = v.find("q=", e);
+		if (qpos != std::string::npos && qpos < comma)
+			q = std::atof(v.c_str() + qpos + 2);
+
+		std::string name = v.substr(b, nameEnd - b);
+		for (std::size_t i = 0; i < name.size(); ++i)
+			name[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(name[i])));
+
+		if (name == coding)
+			return (q > 0);
+		if (name == "*")
+			star = (q > 0);
+
+		pos = comma + 1;
+	}
+	return star;
+}
+
+std::string StaticFile::etag(const struct stat& st)
+{
+	unsigned long long mtime = static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ULL
+		+ static_cast<unsigned long long>(st.st_mtim.tv_nsec);
+
+	char buf[80];
+	std::snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+		static_cast<unsigned long long>(st.st_ino),
+		static_cast<unsigned long long>(st.st_size),
+		mtime);
+	return std::string(buf);
+}
+
+std::string StaticFile::httpDate(std::time_t t)
+{
+	struct tm tmv;
+	char buf[64];
+
+	if (::gmtime_r(&t, &tmv) == 0)
+		return "";
+	if (std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tmv) == 0)
+		return "";
+	return std::string(buf);
+}
+
+bool StaticFile::parseHttpDate(const std::string& s, std::time_t& out)
+{
+	struct tm tmv;
+	std::memset(&tmv, 0, sizeof(tmv));
+
+	const char* end = ::strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tmv);
+	if (end == 0 || *end != '\0')
+		return false;
+
+	out = ::timegm(&tmv);
+	return (out != static_cast<std::time_t>(-1));
+}
+
+// weak comparison: W/"x" matches "x"
+static bool etagListMatches(const std::string& list, const std::string& etag)
+{
+	std::size_t pos = 0;
+	while (pos < list.size())
+	{
+		std::size_t comma = list.find(',', pos);
+		if (comma == std::string::npos)
+			comma = list.size();
+
+		std::size_t b = pos;
+		std::size_t e = comma;
+		while (b < e && (list[b] == ' ' || list[b] == '\t'))
+			++b;
+		while (e > b && (list[e - 1] == ' ' || list[e - 1] == '\t'))
+			--e;
+		if (e - b > 2 && list.compare(b, 2, "W/") == 0)
+			b += 2;
+
+		if (e - b == 1 && list[b] == '*')
+			return true;
+		if (list.compare(b, e - b, etag) == 0)
+			return true;
+
+		pos = comma + 1;
+	}
+	return false;
+}
+
+bool StaticFile::notModified(const HttpRequest& req, const std::string& etag, std::time_t mtime)
+{
+	std::map<std::string, std::string>::const_iterator it = req.headers.find("if-none-match");
+	if (it != req.headers.end())
+		return etagListMatches(it->second, etag);
+
+	it = req.headers.find("if-modified-since");
+	if (it == req.headers.end())
+		return false;
+
+	std::time_t since;
+	if (!parseHttpDate(it->second, since))
+		return false;
+	return (mtime <= since);
+}
+
+static bool parseOffset(const std::string& s, std::size_t b, std::size_t e, off_t& out)
+{
+	if (b >= e)
+		return false;
+
+	unsigned long long v = 0;
+	for (std::size_t i = b; i < e; ++i)
+	{
+		if (s[i] < '0' || s[i] > '9')
+			return false;
+		if (v > (0x7fffffffffffffffULL - 9) / 10)
+			return false;
+		v = v * 10 + static_cast<unsigned long long>(s[i] - '0');
+	}
+	out = static_cast<off_t>(v);
+	return true;
+}
+
+static bool rangeBefore(const StaticFile::ByteRange& a, const StaticFile::ByteRange& b)
+{
+	return a.first < b.first;
+}
+
+StaticFile::RangeResult StaticFile::parseRange(const std::string& value, off_t size, std::vector<ByteRange>& out)
+{
+	out.clear();
+
+	if (value.compare(0, 6, "bytes=") != 0)
+		return RANGE_NONE;
+
+	std::size_t count = 0;
+	std::size_t pos = 6;
+	while (pos <= value.size())
+	{
+		std::size_t comma = value.find(',', pos);
+		if (comma == std::string::npos)
+			comma = value.size();
+
+		std::size_t b = pos;
+		std::size_t e = comma;
+		while (b < e && (value[b] == ' ' || value[b] == '\t'))
+			++b;
+		while (e > b && (value[e - 1] == ' ' || value[e - 1] == '\t'))
+			--e;
+		pos = comma + 1;
+
+		if (b == e)
+			continue;
+		if (++count > MAX_RANGES)
+			return RANGE_NONE;
+
+		std::size_t dash = value.find('-', b);
+		if (dash == std::string::npos || dash >= e)
+			return RANGE_NONE;
+
+		ByteRange r;
+		if (dash == b)
+		{
+			// suffix: the last n bytes
+			off_t n;
+			if (!parseOffset(value, dash + 1, e, n))
+				return RANGE_NONE;
+			if (n == 0 || size == 0)
+				continue;
+			if (n > size)
+				n = size;
+			r.first = size - n;
+			r.last = size - 1;
+		}
+		else
+		{
+			if (!parseOffset(value, b, dash, r.first))
+				return RANGE_NONE;
+			if (dash + 1 == e)
+				r.last = size - 1;
+			else if (!parseOffset(value, dash + 1, e, r.last) || r.last < r.first)
+				return RANGE_NONE;
+
+			if (r.first >= size)
+				continue;
+			if (r.last >= size)
+				r.last = size - 1;
+		}
+		out.push_back(r);
+	}
+
+	if (count == 0)
+		return RANGE_NONE;
+	if (out.empty())
+		return RANGE_UNSATISFIABLE;
+
+	// "0-,0-" and the like: more than the whole file is not worth ranges
+	off_t total = 0;
+	for (std::size_t i = 0; i < out.size(); ++i)
+	{
+		total += out[i].last - out[i].first + 1;
+		if (total > size)
+		{
+			out.clear();
+			return RANGE_NONE;
+		}
+	}
+
+	std::sort(out.begin(), out.end(), rangeBefore);
+	std::size_t n = 0;
+	for (std::size_t i = 1; i < out.size(); ++i)
+	{
+		if (out[i].first <= out[n].last + 1)
+		{
+			if (out[i].last > out[n].last)
+				out[n].last = out[i].last;
+		}
+		else
+			out[++n] = out[i];
+	}
+	out.resize(n + 1);
+	return RANGE_OK;
+}
+
+bool StaticFile::ifRangeMatches(const std::string& value, const std::string& etag, std::time_t mtime)
+{
+	if (value.empty())
+		return true;
+
+	// weak validators never match If-Range
+	if (value[0] == '"')
+		return (value == etag);
+
+	std::time_t t;
+	if (!parseHttpDate(value, t))
+		return false;
+	return (t == mtime);
+}
+
+std::string StaticFile::contentRange(const ByteRange& r, off_t size)
+{
+	return "bytes " + std::to_string((long long)r.first) + "-" + std::to_string((long long)r.last)
+		+ "/" + std::to_string((long long)size);
+}
+
+void StaticFile::multipartParts(const std::vector<ByteRange>& ranges, off_t size,
+	const std::string& contentType, const std::string& boundary, std::vector<BodyPart>& parts)
+{
+	parts.clear();
+	parts.resize(ranges.size() + 1);
+
+	for (std::size_t i = 0; i < ranges.size(); ++i)
+	{
+		BodyPart& p = parts[i];
+		p.head = "\r\n--" + boundary + "\r\n";
+		p.head += "Content-Type: " + contentType + "\r\n";
+		p.head += "Content-Range: " + contentRange(ranges[i], size) + "\r\n\r\n";
+		p.offset = ranges[i].first;
+		p.length = ranges[i].last - ranges[i].first + 1;
+	}
+	parts.back().head = "\r\n--" + boundary + "--\r\n";
+}
+
+std::string StaticFile::makeBoundary(const std::string& etag)
+{
+	static unsigned long counter = 0;
+
+	unsigned long long h = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < etag.size(); ++i)
+	{
+		h ^= static_cast<unsigned char>(etag[i]);
+		h *= 1099511628211ULL;
+	}
+
+	char buf[48];
+	std::snprintf(buf, sizeof(buf), "%016llx%08lx", h, ++counter);
+	return std::string(buf);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "http/HttpRequest.hpp"
+#include "http/HttpResponse.hpp"
+
+// Validators and byte ranges of files served from disk. Validators work on
+// stat data only, so a revalidation never opens the file; ranges are sent
+// from the file with sendfile(), never read into memory.
+class StaticFile
+{
+public:
+	// inclusive, like Content-Range
+	struct ByteRange
+	{
+		off_t first;
+		off_t last;
+	};
+
+	enum RangeResult
+	{
+		RANGE_NONE,          // no usable Range header: send the whole file
+		RANGE_OK,
+		RANGE_UNSATISFIABLE  // 416
+	};
+
+	// stat data of a file and of its precompressed siblings (path.gz,
+	// path.br); a sibling only counts if it is not older than the file
+	struct Info
+	{
+		struct stat st;
+		bool hasGzip;
+		struct stat gzip;
+		bool hasBrotli;
+		struct stat brotli;
+	};
+
+	// more ranges than this are answered with the whole file
+	static const std::size_t MAX_RANGES = 16;
+
+	// lookup() results are trusted this long before the next stat()
+	static const long CACHE_VALID_MS = 1000;
+	static const std::size_t CACHE_MAX_ENTRIES = 4096;
+
+	// regular file only
+	static bool statRegular(const std::string& path, struct stat& st);
+
+	// cached statRegular() plus, if siblings is set, the .gz/.br lookup
+	static bool lookup(const std::string& path, bool siblings, Info& out);
+
+	// Accept-Encoding lists coding (or "*") with a non-zero q
+	static bool acceptsEncoding(const HttpRequest& req, const std::string& coding);
+	static bool acceptsEncoding(const std::string& acceptEncoding, const std::string& coding);
+
+	// "inode-size-mtime", hex, mtime in nanoseconds
+	static std::string etag(const struct stat& st);
+
+	// IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT"
+	static std::string httpDate(std::time_t t);
+	static bool parseHttpDate(const std::string& s, std::time_t& out);
+
+	// If-None-Match wins over If-Modified-Since (RFC 9110 13.2.2)
+	static bool notModified(const HttpRequest& req, const std::string& etag, std::time_t mtime);
+
+	// "bytes=0-99,200-,-50" against a file of size bytes; a header that
+	// does not parse is ignored (RANGE_NONE), and so are ranges asking for
+	// more bytes in total than the file has. Overlapping and adjacent
+	// ranges are merged, in file order.
+	static RangeResult parseRange(const std::string& value, off_t size, std::vector<ByteRange>& out);
+
+	// If-Range: exact ETag or the Last-Modified date; empty always matches
+	static bool ifRangeMatches(const std::string& value, const std::string& etag, std::time_t mtime);
+
+	static std::string contentRange(const ByteRange& r, off_t size);
+
+	// multipart/byteranges parts for ranges, the closing boundary last (a
+	// part of no file bytes); boundary goes to Content-Type
+	static void multipartParts(const std::vector<ByteRange>& ranges, off_t size,
+		const std::string& contentType, const std::string& boundary, std::vector<BodyPart>& parts);
+
+	static std::string makeBoundary(const std::string& etag);
+};